@@ -76,6 +76,9 @@ void Error_Handler(void);
 /* Private defines -----------------------------------------------------------*/
 
 /* USER CODE BEGIN Private defines */
+#define PERF_STATS //comment out to remove the main loop and step timing instrumentation
+#define STEP_CAPTURE //comment out to remove the step edge capture buffer (4 bytes RAM per CAPTURE_LEN)
+#define PULSE_ENGINE //comment out to remove the TIM3/DMA step pulse engine of m2 (uses TIM3 and DMA1 channel 4)
 
 /* USER CODE END Private defines */
 
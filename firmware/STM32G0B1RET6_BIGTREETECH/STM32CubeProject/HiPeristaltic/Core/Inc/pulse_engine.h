@@ -0,0 +1,32 @@
+// Copyright 2025 Gun Deniz Akkoc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// https://github.com/gunakkoc/HiPeristaltic
+
+// Hardware step pulse engine for m2 (PB0, TIM3_CH3)
+// Step periods are precomputed into a double buffered table, DMA bursts each entry into TIM3 PSC/ARR/CCR3
+// on every update event and the pulse itself is generated by the timer in PWM mode.
+// Half and full transfer interrupts refill the table, no CPU time is needed per step.
+
+// Enabled by PULSE_ENGINE in main.h
+
+#include <stdbool.h>
+
+void PulseEngine_Init(uint16_t tick_psc, uint32_t pulse_width); //tick_psc: timer clock cycles per tick of TIM2
+bool PulseEngine_Start(uint32_t steps, uint32_t step_interval, uint32_t accel); //accel in steps/s^2, 0 for constant rate
+uint32_t PulseEngine_Stop(void); //returns the number of issued step pulses
+uint32_t PulseEngine_GetStepCount(void); //number of issued step pulses so far
+uint32_t PulseEngine_GetLastStepTick(void); //TIM2 tick of the last step pulse of a completed run
+bool PulseEngine_IsActive(void);
+bool PulseEngine_IsDone(void); //all steps are issued, PulseEngine_Stop() must be called to release the pin
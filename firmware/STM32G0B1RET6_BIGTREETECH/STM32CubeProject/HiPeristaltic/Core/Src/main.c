@@ -41,6 +41,9 @@
 /* USER CODE BEGIN Includes */
 #include "usbd_cdc_if.h"
 #include "tmc2209_d.h"
+#ifdef PULSE_ENGINE
+#include "pulse_engine.h"
+#endif
 #include <stdbool.h>
 #include "stm32g0xx_hal.h"
 /* USER CODE END Includes */
@@ -58,12 +61,43 @@ typedef struct {
 #define BUFFER_LEN 256
 #define UART_BUFFER_LEN 256
 #define MSG_LEN 6
-#define USB_INTERMSG_DELAY_US 1300 //minimum 1000us for USB polling + 300us for safety
+#define FRAME_LEN 9 //protocol v2 frame on the wire, COBS encoded message with CRC-16 (MSG_LEN + 1 bytes) + 1 overhead byte + 0x00 delimiter
+#define PROTOCOL_V1 1 //fixed MSG_LEN frames with XOR checksum, resynchronized by SERIAL_INTERBYTE_TIMEOUT
+#define PROTOCOL_V2 2 //COBS frames with CRC-16/CCITT, resynchronized on every 0x00 delimiter
+#define CMD_SET_PROTOCOL 78
+#define CMD_STOP_ALL 82
+#define STOP_ALL_MAGIC 0x5AA5 //bytes 2-3 of the stop_all argument, lets the rx interrupts find the frame in the raw stream
+#define RCV_READY 255 //rcv_*_cnt once a complete frame is in rcv_buffer
+#define RCV_BAD_FRAME 254 //rcv_*_cnt once a v2 frame of wrong length is received
 #define UART_INTERMSG_DELAY_US 366 //(MSGLEN / (115200 * 0.8)) * 1000000 = ~66us + 300us for safety
 #define SERIAL_INTERBYTE_TIMEOUT_US 500000
 #define MOTOR_MIN_PULSE_WIDTH_US 3 //1us for A4988, 2us for DRV8825, ~100ns for TMC2208 and TMC2209
+#define UART_BOOT_BAUDRATE 115200 //rate after reset, raised by the host with set_baudrate
+#define UART_BAUD_MAX_ERR_PCT 2 //max deviation of the achievable rate from the requested one
+#define UART_BAUD_CONFIRM_TIMEOUT_US 1000000 //a new rate falls back to the previous one unless confirmed within this time
+#define UART_FE_FALLBACK_CNT 3 //framing errors without a valid frame in between that return the link to UART_BOOT_BAUDRATE
+#define SND_DMA_BUFFER_LEN 64 //one full speed bulk packet (CDC_DATA_FS_MAX_PACKET_SIZE), queued frames are packed into it over USB
+#define TX_QUEUE_LEN 16 //number of frames waiting to be sent, must be a power of 2 (<= 128)
+#define BULK_MAX_LEN 64 //max number of 32 bit words in a multi-frame response
+
+#define STATS_VERSION 1 //layout of the get_stats response, increment on change
+#define STATE_VERSION 1 //layout of the get_state response, increment on change
+#define STATS_HIST_LEN 16 //log2 histogram of the main loop period, bucket i counts periods in [2^i, 2^(i+1)) ticks
+#define STEP_LATE_THRESHOLD_US 10 //a step pulse later than this (w.r.t. step interval) is counted as late
+#define CAPTURE_LEN 1024 //number of step edge ticks kept by the capture ring, must be a power of 2 (<= 32768)
+#define CAPTURE_OFF 255
 
 #define tick_now TIM2->CNT
+
+//direct register writes, with the static const pins below the port and pin are resolved at compile time
+#define gpio_set(gpio) ((gpio).port->BSRR = (uint32_t) (gpio).pin)
+#define gpio_reset(gpio) ((gpio).port->BRR = (uint32_t) (gpio).pin)
+#define gpio_write(gpio, state) ((state) ? gpio_set(gpio) : gpio_reset(gpio))
+
+//all step pins are on STEP_GPIO_PORT, edges due in the same pass are collected and written with a single store
+#define STEP_GPIO_PORT GPIOB
+#define step_set(gpio) (step_port_bsrr |= (uint32_t) (gpio).pin)
+#define step_reset(gpio) (step_port_bsrr |= ((uint32_t) (gpio).pin) << 16)
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -83,11 +117,11 @@ DMA_HandleTypeDef hdma_usart5_tx;
 extern USBD_HandleTypeDef hUsbDeviceFS;
 
 const uint32_t SUB_US_DIV = 16;
-const uint32_t USB_INTERMSG_DELAY = USB_INTERMSG_DELAY_US * SUB_US_DIV;
 const uint32_t UART_INTERMSG_DELAY = UART_INTERMSG_DELAY_US * SUB_US_DIV;
 const uint32_t SERIAL_INTERBYTE_TIMEOUT = SERIAL_INTERBYTE_TIMEOUT_US * SUB_US_DIV;
 const uint32_t MOTOR_MIN_PULSE_WIDTH = MOTOR_MIN_PULSE_WIDTH_US * SUB_US_DIV;
-const uint8_t CMD_COUNT = 68;
+const uint32_t UART_BAUD_CONFIRM_TIMEOUT = UART_BAUD_CONFIRM_TIMEOUT_US * SUB_US_DIV;
+const uint8_t CMD_COUNT = 82;
 
 uint8_t rcv_buffer[BUFFER_LEN];
 uint8_t rcv_usb_buffer[BUFFER_LEN];
@@ -96,16 +130,81 @@ uint8_t rcv_usb_write_ind = 0;
 uint8_t rcv_usb_read_ind = 0;
 uint8_t rcv_uart_write_ind = 0;
 uint8_t rcv_uart_read_ind = 0;
-uint8_t snd_buffer[BUFFER_LEN];
+uint8_t snd_buffer[BUFFER_LEN]; //frame being composed by the command and signal functions
+uint8_t snd_dma_buffer[SND_DMA_BUFFER_LEN]; //frame(s) being transmitted, must not change until tx is completed
+uint8_t snd_dma_len = MSG_LEN;
+uint8_t snd_queue[TX_QUEUE_LEN][FRAME_LEN]; //framed messages waiting for transmission, in order
+uint8_t snd_queue_len[TX_QUEUE_LEN];
+uint8_t snd_queue_write_ind = 0;
+uint8_t snd_queue_read_ind = 0;
 uint8_t rcv_usb_cnt = 0;
 uint8_t rcv_uart_cnt = 0;
 uint8_t snd_byte_cnt = MSG_LEN + 1;
 uint32_t rcv_last_tick = 0;
 uint32_t snd_last_tick = 0;
 uint8_t checksum = 0;
+bool usb_link = false; //set once the host link switched from UART5 to USB
+uint32_t uart_baud = UART_BOOT_BAUDRATE;
+uint32_t uart_baud_next = 0; //set by set_baudrate, applied once its ack is sent
+uint32_t uart_baud_prev = 0; //restored after UART_BAUD_CONFIRM_TIMEOUT, 0 once the new rate is confirmed
+uint32_t uart_baud_tick = 0;
+volatile bool uart_rx_error = false; //rx DMA was aborted by a line error, restarted by process_commands_uart
+volatile uint8_t uart_fe_cnt = 0; //framing errors since the last valid frame
+uint8_t protocol = PROTOCOL_V1; //framing of both directions, changed by the host with set_protocol
+uint8_t rcv_v1_window[MSG_LEN]; //last bytes received in v2, to catch a v1 host resetting the framing
+static const uint8_t PROTOCOL_RESET_FRAME[MSG_LEN] = {CMD_SET_PROTOCOL, PROTOCOL_V1, 0, 0, 0, CMD_SET_PROTOCOL ^ PROTOCOL_V1};
+uint8_t prio_window[MSG_LEN]; //v1: last bytes received, scanned for stop_all by the rx interrupts
+uint8_t prio_frame[FRAME_LEN]; //v2: bytes since the last delimiter, scanned for stop_all by the rx interrupts
+uint8_t prio_frame_cnt = 0;
+uint8_t prio_uart_ind = 0; //next byte of rcv_uart_buffer to scan
+volatile uint8_t stop_isr_cnt = 0; //stop_all frames applied by the rx interrupts, not yet signalled
+volatile uint8_t stop_isr_mask = 0;
+volatile uint32_t stop_isr_tick = 0;
+volatile uint8_t stop_hold = 0; //motors that reject starts until the frames received before their stop_all are processed
+volatile uint8_t stop_hold_cnt = 0; //stop_all frames applied ahead, not yet processed in order
+static const uint16_t crc16_nibble[16] = {0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+                                          0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF};
+bool ext_events = false; //if enabled by the host, end signals are preceded by a frame with the step count
+
+//multi-frame response: [cmd][word count] followed by word count frames of [cmd][word]
+uint32_t bulk_buffer[BULK_MAX_LEN];
+uint32_t *bulk_src = bulk_buffer; //words to be sent, must not change until sent
+uint16_t bulk_len = 0;
+uint16_t bulk_ind = 0;
+uint16_t bulk_start = 0; //bulk_src is read as a ring starting at bulk_start and wrapping at bulk_wrap
+uint16_t bulk_wrap = 0;
+uint8_t bulk_cmd = 0;
+
+#ifdef STEP_CAPTURE
+//ticks of the rising step edges of a single motor, either the last CAPTURE_LEN edges (ring) or the first ones (one-shot)
+uint32_t capture_buffer[CAPTURE_LEN];
+uint8_t capture_motor = CAPTURE_OFF;
+bool capture_oneshot = false;
+uint16_t capture_decimation = 1; //record every nth edge
+uint16_t capture_skip = 0;
+uint16_t capture_write_ind = 0;
+uint32_t capture_cnt = 0; //number of recorded edges since armed
+#endif
+
+#ifdef PERF_STATS
+const uint32_t STEP_LATE_THRESHOLD = STEP_LATE_THRESHOLD_US * SUB_US_DIV; //in ticks
+uint32_t stats_loop_tick = 0; //start of the current main loop iteration
+uint32_t stats_loop_cnt = 0; //main loop iterations since boot or reset
+uint32_t stats_loop_max = 0; //longest main loop period, i.e. longest gap between consecutive m*step() visits
+uint32_t stats_cmd_max = 0; //longest process_commands_*() call
+uint32_t stats_loop_hist[STATS_HIST_LEN];
+uint32_t stats_late_cnt[4]; //number of late step pulses per motor
+uint32_t stats_late_max[4]; //maximum lateness per motor in ticks
+uint32_t stats_rx_usb_dropped = 0; //bytes dropped due to rx ring overflow
+uint32_t stats_rx_uart_dropped = 0; //bytes overwritten by the circular rx DMA before being read
+uint32_t stats_tx_queue_hwm = 0; //max number of frames waiting in the tx queue
+uint32_t stats_tx_dropped = 0; //frames dropped due to full tx queue
+#endif
 
 const uint32_t min2us = 60000000;
 
+uint32_t step_port_bsrr = 0; //step edges of the current pass in BSRR layout (bits 0-15 set, bits 16-31 reset)
+
 uint32_t m0_tick_delta = 0;
 uint32_t m1_tick_delta = 0;
 uint32_t m2_tick_delta = 0;
@@ -114,64 +213,71 @@ uint32_t m3_tick_delta = 0;
 // ------- START OF MOTOR PINS AND VARIABLES
 
 // -----------------m0---------------------
-const GPIO_Pin m0_enabled_pin = {GPIOB, GPIO_PIN_14};
-const GPIO_Pin m0_dir_pin = {GPIOB, GPIO_PIN_12};
-const GPIO_Pin m0_step_pin = {GPIOB, GPIO_PIN_13};
+static const GPIO_Pin m0_enabled_pin = {GPIOB, GPIO_PIN_14};
+static const GPIO_Pin m0_dir_pin = {GPIOB, GPIO_PIN_12};
+static const GPIO_Pin m0_step_pin = {STEP_GPIO_PORT, GPIO_PIN_13};
 
-bool m0_running = false;
+volatile bool m0_running = false; //also cleared by the rx interrupts, see stop_motors()
 uint32_t m0_tick_last = 0;
 uint32_t m0_steps = 0;
 uint32_t m0_target_steps = 0;
 uint8_t m0_finite_mode = 1; //0 for continuous mode, 1 for finite steps
 bool m0_last_pulse = false;
+uint32_t m0_step_count = 0; //odometer, total number of step pulses since boot (wraps around)
 
 bool m0_enabled_pin_state = true;
 bool m0_dir_pin_state = false;
 uint32_t m0_step_interval = 4000;
 
 // -----------------m1---------------------
-const GPIO_Pin m1_enabled_pin = {GPIOB, GPIO_PIN_11};
-const GPIO_Pin m1_dir_pin = {GPIOB, GPIO_PIN_2};
-const GPIO_Pin m1_step_pin = {GPIOB, GPIO_PIN_10};
+static const GPIO_Pin m1_enabled_pin = {GPIOB, GPIO_PIN_11};
+static const GPIO_Pin m1_dir_pin = {GPIOB, GPIO_PIN_2};
+static const GPIO_Pin m1_step_pin = {STEP_GPIO_PORT, GPIO_PIN_10};
 
-bool m1_running = false;
+volatile bool m1_running = false; //also cleared by the rx interrupts, see stop_motors()
 uint32_t m1_tick_last = 0;
 uint32_t m1_steps = 0;
 uint32_t m1_target_steps = 0;
 uint8_t m1_finite_mode = 1; //0 for continuous mode, 1 for finite steps
 bool m1_last_pulse = false;
+uint32_t m1_step_count = 0; //odometer, total number of step pulses since boot (wraps around)
 
 bool m1_enabled_pin_state = true;
 bool m1_dir_pin_state = false;
 uint32_t m1_step_interval = 4000;
 
 //-----------------m2---------------------
-const GPIO_Pin m2_enabled_pin = {GPIOB, GPIO_PIN_1};
-const GPIO_Pin m2_dir_pin = {GPIOC, GPIO_PIN_5};
-const GPIO_Pin m2_step_pin = {GPIOB, GPIO_PIN_0};
+static const GPIO_Pin m2_enabled_pin = {GPIOB, GPIO_PIN_1};
+static const GPIO_Pin m2_dir_pin = {GPIOC, GPIO_PIN_5};
+static const GPIO_Pin m2_step_pin = {STEP_GPIO_PORT, GPIO_PIN_0};
 
-bool m2_running = false;
+volatile bool m2_running = false; //also cleared by the rx interrupts, see stop_motors()
 uint32_t m2_tick_last = 0;
 uint32_t m2_steps = 0;
 uint32_t m2_target_steps = 0;
 uint8_t m2_finite_mode = 1; //0 for continuous mode, 1 for finite steps
 bool m2_last_pulse = false;
+uint32_t m2_step_count = 0; //odometer, total number of step pulses since boot (wraps around)
 
 bool m2_enabled_pin_state = true;
 bool m2_dir_pin_state = false;
 uint32_t m2_step_interval = 4000;
+uint8_t m2_engine = 0; //1 for finite runs by the pulse engine (TIM3/DMA) instead of the main loop
+uint32_t m2_accel = 0; //pulse engine ramp in steps/s^2, 0 for constant rate
+bool m2_engine_active = false;
 
 //-----------------m3--------------------- //FOR E1: EN D30, DIR D34, STP D36
-const GPIO_Pin m3_enabled_pin = {GPIOD, GPIO_PIN_1};
-const GPIO_Pin m3_dir_pin = {GPIOB, GPIO_PIN_4};
-const GPIO_Pin m3_step_pin = {GPIOB, GPIO_PIN_3};
+static const GPIO_Pin m3_enabled_pin = {GPIOD, GPIO_PIN_1};
+static const GPIO_Pin m3_dir_pin = {GPIOB, GPIO_PIN_4};
+static const GPIO_Pin m3_step_pin = {STEP_GPIO_PORT, GPIO_PIN_3};
 
-bool m3_running = false;
+volatile bool m3_running = false; //also cleared by the rx interrupts, see stop_motors()
 uint32_t m3_tick_last = 0;
 uint32_t m3_steps = 0;
 uint32_t m3_target_steps = 0;
 uint8_t m3_finite_mode = 1; //0 for continuous mode, 1 for finite steps
 bool m3_last_pulse = false;
+uint32_t m3_step_count = 0; //odometer, total number of step pulses since boot (wraps around)
 
 bool m3_enabled_pin_state = true;
 bool m3_dir_pin_state = false;
@@ -240,18 +346,389 @@ void calc_checksum() {
   snd_buffer[MSG_LEN - 1] = checksum;
 }
 
+uint16_t crc16(const uint8_t *data, uint8_t len) {
+  //CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF), nibble-wise to keep the table small
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < len; i++) {
+    crc = (crc << 4) ^ crc16_nibble[(crc >> 12) ^ (data[i] >> 4)];
+    crc = (crc << 4) ^ crc16_nibble[(crc >> 12) ^ (data[i] & 0x0F)];
+  }
+  return crc;
+}
+
+uint8_t cobs_encode(const uint8_t *src, uint8_t len, uint8_t *dst) {
+  //dst needs len + 2 bytes (len < 254), returns the encoded length including the 0x00 delimiter
+  uint8_t code_ind = 0;
+  uint8_t code = 1;
+  uint8_t out = 1;
+  for (uint8_t i = 0; i < len; i++) {
+    if (src[i]) {
+      dst[out++] = src[i];
+      code++;
+    } else {
+      dst[code_ind] = code;
+      code_ind = out++;
+      code = 1;
+    }
+  }
+  dst[code_ind] = code;
+  dst[out++] = 0;
+  return out;
+}
+
+uint8_t cobs_decode(uint8_t *buf, uint8_t len) {
+  //in place, len without the delimiter, returns the decoded length or 0 if malformed
+  uint8_t in = 0;
+  uint8_t out = 0;
+  while (in < len) {
+    uint8_t code = buf[in++];
+    if ((!code) || ((uint16_t) in + code - 1 > len)) {
+      return 0;
+    }
+    for (uint8_t i = 1; i < code; i++) {
+      buf[out++] = buf[in++];
+    }
+    if ((code < 0xFF) && (in < len)) {
+      buf[out++] = 0;
+    }
+  }
+  return out;
+}
+
 bool check_checksum() {
-  //simple 8 bit checksum with XOR
-  //compares to last byte of rcv_buffer
+  //v1: simple 8 bit checksum with XOR, compares to last byte of rcv_buffer
+  //v2: CRC-16 of the 5 message bytes, little endian after them
+  if (protocol == PROTOCOL_V2) {
+    uint16_t crc_rcv;
+    memcpy(&crc_rcv, rcv_buffer + MSG_LEN - 1, 2);
+    return (crc_rcv == crc16(rcv_buffer, MSG_LEN - 1));
+  }
   checksum = rcv_buffer[0] ^ rcv_buffer[1] ^ rcv_buffer[2] ^ rcv_buffer[3] ^ rcv_buffer[4]; //5 bytes
   return (checksum == rcv_buffer[MSG_LEN - 1]);
 }
 
+uint8_t rcv_push(uint8_t cnt, uint8_t byte) {
+  //appends a received byte to the frame in rcv_buffer, returns the new count of the frame bytes
+  //or RCV_READY / RCV_BAD_FRAME once the frame is complete
+  if (protocol == PROTOCOL_V1) {
+    rcv_buffer[cnt++] = byte;
+    return (cnt == MSG_LEN) ? RCV_READY : cnt;
+  }
+  memmove(rcv_v1_window, rcv_v1_window + 1, MSG_LEN - 1);
+  rcv_v1_window[MSG_LEN - 1] = byte;
+  if (!memcmp(rcv_v1_window, PROTOCOL_RESET_FRAME, MSG_LEN)) { //3 consecutive 0x00 never occur in v2
+    protocol = PROTOCOL_V1; //processed as a v1 set_protocol, acked in v1
+    memcpy(rcv_buffer, PROTOCOL_RESET_FRAME, MSG_LEN);
+    return RCV_READY;
+  }
+  if (byte) {
+    if (cnt < FRAME_LEN) { //longer frames are rejected at the delimiter
+      rcv_buffer[cnt++] = byte;
+    }
+    return cnt;
+  }
+  if (!cnt) {
+    return 0; //empty frame, e.g. the leading delimiter of the host
+  }
+  if ((cnt == FRAME_LEN - 1) && (cobs_decode(rcv_buffer, cnt) == MSG_LEN + 1)) {
+    return RCV_READY;
+  }
+  return RCV_BAD_FRAME;
+}
+
+void stop_motors(uint8_t mask, bool disable){
+  //halts the motors of the mask (bit i: motor i) at once, also called from the rx interrupts
+  //the pulse engine is halted here and accounted by the main loop (stop_motors_finish)
+  if (mask & 1) {
+    m0_running = false;
+  }
+  if (mask & 2) {
+    m1_running = false;
+  }
+  if (mask & 4) {
+    m2_running = false;
+#ifdef PULSE_ENGINE
+    PulseEngine_Stop();
+#endif
+  }
+  if (mask & 8) {
+    m3_running = false;
+  }
+  if (!disable) {
+    return;
+  }
+  if (mask & 1) {
+    m0_enabled_pin_state = true;
+    gpio_set(m0_enabled_pin);
+  }
+  if (mask & 2) {
+    m1_enabled_pin_state = true;
+    gpio_set(m1_enabled_pin);
+  }
+  if (mask & 4) {
+    m2_enabled_pin_state = true;
+    gpio_set(m2_enabled_pin);
+  }
+  if (mask & 8) {
+    m3_enabled_pin_state = true;
+    gpio_set(m3_enabled_pin);
+  }
+}
+
+void rx_priority_scan(uint8_t byte){
+  //called by the rx interrupts for every received byte, before it is buffered for the main loop
+  //a stop_all frame is applied right away, ahead of the frames waiting in the rx buffers and even if they are full
+  uint8_t *msg;
+  if (protocol == PROTOCOL_V1) {
+    memmove(prio_window, prio_window + 1, MSG_LEN - 1);
+    prio_window[MSG_LEN - 1] = byte;
+    msg = prio_window;
+    if ((msg[0] ^ msg[1] ^ msg[2] ^ msg[3] ^ msg[4]) != msg[MSG_LEN - 1]) {
+      return;
+    }
+  } else {
+    if (byte) {
+      if (prio_frame_cnt < FRAME_LEN) {
+        prio_frame[prio_frame_cnt++] = byte;
+      }
+      return;
+    }
+    bool frame_ok = (prio_frame_cnt == FRAME_LEN - 1) && (cobs_decode(prio_frame, prio_frame_cnt) == MSG_LEN + 1);
+    prio_frame_cnt = 0;
+    msg = prio_frame;
+    if ((!frame_ok) || (crc16(msg, MSG_LEN - 1) != (msg[MSG_LEN - 1] | (msg[MSG_LEN] << 8)))) {
+      return;
+    }
+  }
+  if ((msg[0] != CMD_STOP_ALL) || (msg[2] != (STOP_ALL_MAGIC & 0xFF)) || (msg[3] != (STOP_ALL_MAGIC >> 8))) {
+    return;
+  }
+  stop_motors(msg[1], msg[4]);
+  stop_isr_tick = tick_now;
+  stop_isr_mask |= msg[1];
+  stop_isr_cnt++;
+}
+
+bool uart_calc_brr(uint32_t baud, uint32_t *brr, bool *over8) {
+  //USART5 BRR for the rate, 16x oversampling where possible, 8x above PCLK / 16
+  uint32_t pclk = HAL_RCC_GetPCLK1Freq();
+  if ((baud < 1200) || (baud > (pclk / 8))) {
+    return false;
+  }
+  uint32_t div = (pclk + (baud / 2)) / baud;
+  uint32_t actual;
+  if (div >= 16) {
+    *over8 = false;
+    *brr = div;
+    actual = pclk / div;
+  } else {
+    div = ((2 * pclk) + (baud / 2)) / baud;
+    *over8 = true;
+    *brr = (div & 0xFFF0) | ((div & 0x000F) >> 1);
+    actual = (2 * pclk) / div;
+  }
+  uint32_t err = (actual > baud) ? (actual - baud) : (baud - actual);
+  return ((err * 100) <= (baud * UART_BAUD_MAX_ERR_PCT));
+}
+
+void uart_set_baudrate(uint32_t baud) {
+  //BRR and OVER8 are writable only while the USART is disabled, the DMA requests stay enabled
+  uint32_t brr;
+  bool over8;
+  if (!uart_calc_brr(baud, &brr, &over8)) {
+    return;
+  }
+  USART5->CR1 &= ~USART_CR1_UE;
+  if (over8) {
+    USART5->CR1 |= USART_CR1_OVER8;
+  } else {
+    USART5->CR1 &= ~USART_CR1_OVER8;
+  }
+  USART5->BRR = brr;
+  USART5->CR1 |= USART_CR1_UE;
+  huart5.Init.BaudRate = baud;
+  huart5.Init.OverSampling = over8 ? UART_OVERSAMPLING_8 : UART_OVERSAMPLING_16;
+  uart_baud = baud;
+  uart_fe_cnt = 0;
+  rcv_uart_cnt = 0; //partial frame at the old rate
+}
+
+void uart_rx_restart() {
+  HAL_UARTEx_ReceiveToIdle_DMA(&huart5, rcv_uart_buffer, UART_BUFFER_LEN);
+  rcv_uart_write_ind = 0;
+  rcv_uart_read_ind = 0;
+  rcv_uart_cnt = 0;
+  prio_uart_ind = 0;
+}
+
+uint8_t snd_queue_cnt(){
+  return (uint8_t) (snd_queue_write_ind - snd_queue_read_ind);
+}
+
+uint8_t snd_queue_free(){
+  return TX_QUEUE_LEN - snd_queue_cnt();
+}
+
 void send_buffer(){
-  calc_checksum();
+  //frames the message with the current protocol and queues it, actual sending is done by process_commands_*
+  if (!snd_queue_free()) {
+#ifdef PERF_STATS
+    stats_tx_dropped++;
+#endif
+    return; //callers check for space beforehand, so this should never happen
+  }
+  uint8_t ind = snd_queue_write_ind & (TX_QUEUE_LEN - 1);
+  if (protocol == PROTOCOL_V2) {
+    uint16_t crc = crc16(snd_buffer, MSG_LEN - 1);
+    memcpy(snd_buffer + MSG_LEN - 1, &crc, 2);
+    snd_queue_len[ind] = cobs_encode(snd_buffer, MSG_LEN + 1, snd_queue[ind]);
+  } else {
+    calc_checksum();
+    memcpy(snd_queue[ind], snd_buffer, MSG_LEN);
+    snd_queue_len[ind] = MSG_LEN;
+  }
+  snd_queue_write_ind++;
+#ifdef PERF_STATS
+  if (snd_queue_cnt() > stats_tx_queue_hwm) {
+    stats_tx_queue_hwm = snd_queue_cnt();
+  }
+#endif
+}
+
+void snd_queue_pop(){
+  //moves the oldest queued frame to the tx buffer and marks it for sending
+  uint8_t ind = snd_queue_read_ind & (TX_QUEUE_LEN - 1);
+  snd_dma_len = snd_queue_len[ind];
+  memcpy(snd_dma_buffer, snd_queue[ind], snd_dma_len);
+  snd_queue_read_ind++;
+  snd_byte_cnt = 0;
+}
+
+void snd_queue_pack(uint8_t max_len){
+  //moves as many whole queued frames as fit in max_len bytes to the tx buffer, in order, and marks them for sending
+  snd_dma_len = 0;
+  while (snd_queue_cnt()) {
+    uint8_t ind = snd_queue_read_ind & (TX_QUEUE_LEN - 1);
+    if ((snd_dma_len + snd_queue_len[ind]) > max_len) {
+      break;
+    }
+    memcpy(snd_dma_buffer + snd_dma_len, snd_queue[ind], snd_queue_len[ind]);
+    snd_dma_len += snd_queue_len[ind];
+    snd_queue_read_ind++;
+  }
   snd_byte_cnt = 0;
 }
 
+void snd_queue_reset(){
+  snd_queue_read_ind = snd_queue_write_ind;
+  snd_byte_cnt = MSG_LEN + 1;
+  bulk_ind = bulk_len;
+}
+
+void send_bulk_ring(uint32_t *src, uint16_t len, uint16_t start, uint16_t wrap){
+  //starts a multi-frame response to the command in rcv_buffer, words are queued one by one by process_commands_*
+  bulk_src = src;
+  bulk_len = len;
+  bulk_ind = 0;
+  bulk_start = start;
+  bulk_wrap = wrap;
+  bulk_cmd = rcv_buffer[0];
+  snd_buffer[0] = bulk_cmd;
+  memcpy(snd_buffer+1,&len,2);
+  snd_buffer[3] = 0;
+  snd_buffer[4] = 0;
+  send_buffer();
+}
+
+void send_bulk(uint32_t *src, uint16_t len){
+  send_bulk_ring(src, len, 0, len);
+}
+
+void send_bulk_next(){
+  uint16_t ind = bulk_start + bulk_ind;
+  if (ind >= bulk_wrap) {
+    ind -= bulk_wrap;
+  }
+  snd_buffer[0] = bulk_cmd;
+  memcpy(snd_buffer+1,&bulk_src[ind],4);
+  send_buffer();
+  bulk_ind++;
+}
+
+#ifdef STEP_CAPTURE
+void capture_edge(uint32_t tick){
+  //call on each step pulse of the captured motor
+  capture_skip++;
+  if (capture_skip < capture_decimation) {
+    return;
+  }
+  capture_skip = 0;
+  if (capture_oneshot && (capture_cnt >= CAPTURE_LEN)) {
+    return; //keep the first edges
+  }
+  capture_buffer[capture_write_ind] = tick;
+  capture_write_ind = (capture_write_ind + 1) & (CAPTURE_LEN - 1);
+  capture_cnt++;
+}
+#endif
+
+#ifdef PERF_STATS
+uint8_t stats_hist_bucket(uint32_t val){
+  //floor(log2(val)), no CLZ on Cortex-M0+
+  uint8_t bucket = 0;
+  while ((val >>= 1) && (bucket < (STATS_HIST_LEN - 1))) {
+    bucket++;
+  }
+  return bucket;
+}
+
+void stats_loop_start(){
+  //call at the beginning of each main loop iteration
+  uint32_t tick_temp = tick_now;
+  uint32_t period = tick_temp - stats_loop_tick;
+  stats_loop_tick = tick_temp;
+  if (stats_loop_cnt) { //first period after boot or reset is meaningless
+    stats_loop_hist[stats_hist_bucket(period)]++;
+    if (period > stats_loop_max) {
+      stats_loop_max = period;
+    }
+  }
+  stats_loop_cnt++;
+}
+
+void stats_cmd_end(){
+  //call right after process_commands_*()
+  uint32_t duration = tick_now - stats_loop_tick;
+  if (duration > stats_cmd_max) {
+    stats_cmd_max = duration;
+  }
+}
+
+void stats_step(uint8_t m_ind, uint32_t tick_delta, uint32_t step_interval){
+  //call on each step pulse
+  uint32_t lateness = tick_delta - step_interval;
+  if (lateness > STEP_LATE_THRESHOLD) {
+    stats_late_cnt[m_ind]++;
+    if (lateness > stats_late_max[m_ind]) {
+      stats_late_max[m_ind] = lateness;
+    }
+  }
+}
+
+void stats_reset(){
+  stats_loop_cnt = 0;
+  stats_loop_max = 0;
+  stats_cmd_max = 0;
+  memset(stats_loop_hist,0,sizeof(stats_loop_hist));
+  memset(stats_late_cnt,0,sizeof(stats_late_cnt));
+  memset(stats_late_max,0,sizeof(stats_late_max));
+  stats_rx_usb_dropped = 0;
+  stats_rx_uart_dropped = 0;
+  stats_tx_queue_hwm = 0;
+  stats_tx_dropped = 0;
+}
+#endif
+
 void err_checksum(){
   snd_buffer[0] = 255;
   send_buffer();
@@ -276,24 +753,50 @@ void signal_start(){
   send_buffer();
 }
 
-void signal_m0_end(){
-  snd_buffer[0] = 200;
+void signal_stop(uint32_t tick){
+  //confirms a stop_all with the tick it was applied at, 1 frame, check snd_queue_free() before calling
+  snd_buffer[0] = 251;
+  memcpy(snd_buffer+1,&tick,4);
   send_buffer();
 }
 
-void signal_m1_end(){
-  snd_buffer[0] = 201;
+void signal_m_end(uint8_t m_ind, uint32_t tick_last, uint32_t step_count){
+  //end of a motor task, always 1 frame (+1 with ext_events), check snd_queue_free() before calling
+  //200-203: tick of the last step pulse, 204-207: odometer of the motor at that moment
+  if (ext_events) {
+    snd_buffer[0] = 204 + m_ind;
+    memcpy(snd_buffer+1,&step_count,4);
+    send_buffer();
+  }
+  snd_buffer[0] = 200 + m_ind;
+  memcpy(snd_buffer+1,&tick_last,4);
   send_buffer();
 }
 
+void signal_m0_end(){
+  signal_m_end(0, m0_tick_last, m0_step_count);
+}
+
+void signal_m1_end(){
+  signal_m_end(1, m1_tick_last, m1_step_count);
+}
+
+#ifdef PULSE_ENGINE
+void m2_engine_stop(){
+  //releases the pin and accounts the pulses issued by the engine
+  uint32_t issued = PulseEngine_Stop();
+  m2_steps -= issued;
+  m2_step_count += issued;
+  m2_engine_active = false;
+}
+#endif
+
 void signal_m2_end(){
-  snd_buffer[0] = 202;
-  send_buffer();
+  signal_m_end(2, m2_tick_last, m2_step_count);
 }
 
 void signal_m3_end(){
-  snd_buffer[0] = 203;
-  send_buffer();
+  signal_m_end(3, m3_tick_last, m3_step_count);
 }
 
 void get_m0_running(){
@@ -303,6 +806,10 @@ void get_m0_running(){
 }
 
 void set_m0_running(){
+  if (rcv_buffer[1] && (stop_hold & 1)) { //sent before a stop_all that is already applied
+    err_cmd();
+    return;
+  }
   if ((bool) m0_running == (bool) rcv_buffer[1]) {
 	    send_ack();
 	    return;
@@ -310,7 +817,7 @@ void set_m0_running(){
   m0_running = rcv_buffer[1];
   if (m0_running) {
     m0_last_pulse = false;
-	HAL_GPIO_WritePin(m0_step_pin.port, m0_step_pin.pin, false);
+	gpio_reset(m0_step_pin);
     m0_tick_last = tick_now - m0_step_interval;
   }
   send_ack();
@@ -369,7 +876,7 @@ void get_m0_dir(){
 
 void set_m0_dir(){
   m0_dir_pin_state = rcv_buffer[1];
-  HAL_GPIO_WritePin(m0_dir_pin.port, m0_dir_pin.pin, m0_dir_pin_state);
+  gpio_write(m0_dir_pin, m0_dir_pin_state);
   send_ack();
 }
 
@@ -381,7 +888,7 @@ void get_m0_enabled(){
 
 void set_m0_enabled(){
   m0_enabled_pin_state = !rcv_buffer[1];
-  HAL_GPIO_WritePin(m0_enabled_pin.port, m0_enabled_pin.pin, m0_enabled_pin_state);
+  gpio_write(m0_enabled_pin, m0_enabled_pin_state);
   send_ack();
 }
 
@@ -392,6 +899,10 @@ void get_m1_running(){
 }
 
 void set_m1_running(){
+  if (rcv_buffer[1] && (stop_hold & 2)) { //sent before a stop_all that is already applied
+    err_cmd();
+    return;
+  }
   if ((bool) m1_running == (bool) rcv_buffer[1]) {
 		send_ack();
 		return;
@@ -399,7 +910,7 @@ void set_m1_running(){
   m1_running = rcv_buffer[1];
   if (m1_running) {
     m1_last_pulse = false;
-    HAL_GPIO_WritePin(m1_step_pin.port, m1_step_pin.pin, false);
+    gpio_reset(m1_step_pin);
     m1_tick_last = tick_now - m1_step_interval;
   }
   send_ack();
@@ -458,7 +969,7 @@ void get_m1_dir(){
 
 void set_m1_dir(){
   m1_dir_pin_state = rcv_buffer[1];
-  HAL_GPIO_WritePin(m1_dir_pin.port, m1_dir_pin.pin, m1_dir_pin_state);
+  gpio_write(m1_dir_pin, m1_dir_pin_state);
   send_ack();
 }
 
@@ -470,7 +981,7 @@ void get_m1_enabled(){
 
 void set_m1_enabled(){
   m1_enabled_pin_state = !rcv_buffer[1];
-  HAL_GPIO_WritePin(m1_enabled_pin.port, m1_enabled_pin.pin, m1_enabled_pin_state);
+  gpio_write(m1_enabled_pin, m1_enabled_pin_state);
   send_ack();
 }
 
@@ -481,21 +992,47 @@ void get_m2_running(){
 }
 
 void set_m2_running(){
+  if (rcv_buffer[1] && (stop_hold & 4)) { //sent before a stop_all that is already applied
+    err_cmd();
+    return;
+  }
   if ((bool) m2_running == (bool) rcv_buffer[1]) {
 		send_ack();
 		return;
   }
   m2_running = rcv_buffer[1];
+#ifdef PULSE_ENGINE
+  if (m2_engine_active) {
+    m2_engine_stop();
+  }
+#endif
   if (m2_running) {
     m2_last_pulse = false;
-	HAL_GPIO_WritePin(m2_step_pin.port, m2_step_pin.pin, false);
+	gpio_reset(m2_step_pin);
     m2_tick_last = tick_now - m2_step_interval;
+#ifdef PULSE_ENGINE
+    if (m2_engine && m2_finite_mode && m2_steps) { //falls back to the main loop if out of the engine range
+      m2_engine_active = PulseEngine_Start(m2_steps, m2_step_interval, m2_accel);
+    }
+#endif
   }
   send_ack();
 }
 
+uint32_t m2_steps_now(){
+  //remaining steps, including the ones already sent by the pulse engine
+  uint32_t m2_steps_temp = m2_steps;
+#ifdef PULSE_ENGINE
+  if (m2_engine_active) {
+    m2_steps_temp -= PulseEngine_GetStepCount();
+  }
+#endif
+  return m2_steps_temp;
+}
+
 void get_m2_steps(){
-  memcpy(snd_buffer+1,&m2_steps,4);
+  uint32_t m2_steps_temp = m2_steps_now();
+  memcpy(snd_buffer+1,&m2_steps_temp,4);
   snd_buffer[0] = rcv_buffer[0];
   send_buffer();
 }
@@ -547,7 +1084,7 @@ void get_m2_dir(){
 
 void set_m2_dir(){
   m2_dir_pin_state = rcv_buffer[1];
-  HAL_GPIO_WritePin(m2_dir_pin.port, m2_dir_pin.pin, m2_dir_pin_state);
+  gpio_write(m2_dir_pin, m2_dir_pin_state);
   send_ack();
 }
 
@@ -559,7 +1096,7 @@ void get_m2_enabled(){
 
 void set_m2_enabled(){
   m2_enabled_pin_state = !rcv_buffer[1];
-  HAL_GPIO_WritePin(m2_enabled_pin.port, m2_enabled_pin.pin, m2_enabled_pin_state);
+  gpio_write(m2_enabled_pin, m2_enabled_pin_state);
   send_ack();
 }
 
@@ -570,6 +1107,10 @@ void get_m3_running(){
 }
 
 void set_m3_running(){
+  if (rcv_buffer[1] && (stop_hold & 8)) { //sent before a stop_all that is already applied
+    err_cmd();
+    return;
+  }
   if ((bool) m3_running == (bool) rcv_buffer[1]) {
 		send_ack();
 		return;
@@ -577,7 +1118,7 @@ void set_m3_running(){
   m3_running = rcv_buffer[1];
   if (m3_running) {
     m3_last_pulse = false;
-	HAL_GPIO_WritePin(m3_step_pin.port, m3_step_pin.pin, false);
+	gpio_reset(m3_step_pin);
     m3_tick_last = tick_now - m3_step_interval;
   }
   send_ack();
@@ -636,7 +1177,7 @@ void get_m3_dir(){
 
 void set_m3_dir(){
   m3_dir_pin_state = rcv_buffer[1];
-  HAL_GPIO_WritePin(m3_dir_pin.port, m3_dir_pin.pin, m3_dir_pin_state);
+  gpio_write(m3_dir_pin, m3_dir_pin_state);
   send_ack();
 }
 
@@ -648,7 +1189,7 @@ void get_m3_enabled(){
 
 void set_m3_enabled(){
   m3_enabled_pin_state = !rcv_buffer[1];
-  HAL_GPIO_WritePin(m3_enabled_pin.port, m3_enabled_pin.pin, m3_enabled_pin_state);
+  gpio_write(m3_enabled_pin, m3_enabled_pin_state);
   send_ack();
 }
 
@@ -753,6 +1294,269 @@ void get_sub_us_divider(){
   send_buffer();
 }
 
+void get_tick(){
+  uint32_t tick_temp = tick_now;
+  memcpy(snd_buffer+1,&tick_temp,4);
+  snd_buffer[0] = rcv_buffer[0];
+  send_buffer();
+}
+
+void set_ext_events(){
+  ext_events = rcv_buffer[1];
+  send_ack();
+}
+
+void get_stats(){
+  //snapshot of the performance counters as a multi-frame response, bit 0 of the argument resets them afterwards
+  //layout (STATS_VERSION 1): version, tick, loop count, loop max, cmd max, usb rx dropped, uart rx dropped,
+  //tx queue hwm, tx dropped, late threshold, 4x late count, 4x late max, STATS_HIST_LEN x loop histogram
+#ifdef PERF_STATS
+  uint16_t len = 0;
+  bulk_buffer[len++] = STATS_VERSION;
+  bulk_buffer[len++] = tick_now;
+  bulk_buffer[len++] = stats_loop_cnt;
+  bulk_buffer[len++] = stats_loop_max;
+  bulk_buffer[len++] = stats_cmd_max;
+  bulk_buffer[len++] = stats_rx_usb_dropped;
+  bulk_buffer[len++] = stats_rx_uart_dropped;
+  bulk_buffer[len++] = stats_tx_queue_hwm;
+  bulk_buffer[len++] = stats_tx_dropped;
+  bulk_buffer[len++] = STEP_LATE_THRESHOLD;
+  memcpy(bulk_buffer+len,stats_late_cnt,sizeof(stats_late_cnt));
+  len += 4;
+  memcpy(bulk_buffer+len,stats_late_max,sizeof(stats_late_max));
+  len += 4;
+  memcpy(bulk_buffer+len,stats_loop_hist,sizeof(stats_loop_hist));
+  len += STATS_HIST_LEN;
+  if (rcv_buffer[1] & 1) {
+    stats_reset();
+  }
+  send_bulk(bulk_buffer, len);
+#else
+  err_cmd();
+#endif
+}
+
+void set_capture(){
+  //arms the step edge capture, byte 1: motor index (CAPTURE_OFF disables), byte 2: 1 for one-shot,
+  //byte 3-4: decimation (record every nth edge, 0 or 1 for all)
+#ifdef STEP_CAPTURE
+  capture_motor = CAPTURE_OFF; //no recording while changing
+  capture_oneshot = rcv_buffer[2];
+  memcpy(&capture_decimation,rcv_buffer+3,2);
+  if (!capture_decimation) {
+    capture_decimation = 1;
+  }
+  capture_skip = capture_decimation - 1; //record the next edge
+  capture_write_ind = 0;
+  capture_cnt = 0;
+  capture_motor = rcv_buffer[1];
+  send_ack();
+#else
+  err_cmd();
+#endif
+}
+
+void get_capture(){
+  //stops the capture and sends the recorded edge ticks as a multi-frame response, oldest first
+#ifdef STEP_CAPTURE
+  capture_motor = CAPTURE_OFF; //buffer must not change while sending, re-arm with set_capture
+  if (capture_cnt > CAPTURE_LEN) { //ring wrapped, oldest edge is at the write index
+    send_bulk_ring(capture_buffer, CAPTURE_LEN, capture_write_ind, CAPTURE_LEN);
+  } else {
+    send_bulk(capture_buffer, capture_cnt);
+  }
+#else
+  err_cmd();
+#endif
+}
+
+void get_m2_engine(){
+#ifdef PULSE_ENGINE
+  snd_buffer[1] = m2_engine;
+  snd_buffer[0] = rcv_buffer[0];
+  send_buffer();
+#else
+  err_cmd();
+#endif
+}
+
+void set_m2_engine(){
+  //applies from the next start, finite mode only
+#ifdef PULSE_ENGINE
+  m2_engine = rcv_buffer[1];
+  send_ack();
+#else
+  err_cmd();
+#endif
+}
+
+void get_m2_accel(){
+#ifdef PULSE_ENGINE
+  memcpy(snd_buffer+1,&m2_accel,4);
+  snd_buffer[0] = rcv_buffer[0];
+  send_buffer();
+#else
+  err_cmd();
+#endif
+}
+
+void set_m2_accel(){
+  //applies from the next start, pulse engine only
+#ifdef PULSE_ENGINE
+  memcpy(&m2_accel,rcv_buffer+1,4);
+  send_ack();
+#else
+  err_cmd();
+#endif
+}
+
+void set_protocol(){
+  //framing of all following frames in both directions, the ack is still framed with the current protocol
+  if ((rcv_buffer[1] != PROTOCOL_V1) && (rcv_buffer[1] != PROTOCOL_V2)) {
+    err_cmd();
+    return;
+  }
+  send_ack();
+  protocol = rcv_buffer[1];
+  memset(rcv_v1_window, 0, MSG_LEN);
+}
+
+void set_baudrate(){
+  //UART link only, acked at the current rate and applied after that
+  //the new rate is kept only if confirmed by set_baudrate with the same rate within UART_BAUD_CONFIRM_TIMEOUT
+  uint32_t baud;
+  uint32_t brr;
+  bool over8;
+  memcpy(&baud,rcv_buffer+1,4);
+  if (usb_link || (!uart_calc_brr(baud, &brr, &over8))) {
+    err_cmd();
+    return;
+  }
+  if (baud == uart_baud) {
+    uart_baud_prev = 0;
+  } else {
+    uart_baud_next = baud;
+  }
+  send_ack();
+}
+
+void get_echo(){
+  //returns the argument, test pattern for link checks
+  memcpy(snd_buffer+1,rcv_buffer+1,4);
+  snd_buffer[0] = rcv_buffer[0];
+  send_buffer();
+}
+
+uint32_t state_flags(uint8_t m_ind, bool running, bool enabled, bool dir, uint8_t finite_mode, uint8_t engine){
+  //bit 0: running, 1: enabled, 2: dir, 3: var ustep support, 4: pulse engine support, 5: pulse engine on,
+  //bit 8-15: finite mode, 16-23: usteps exp
+  uint32_t flags = running | (enabled << 1) | (dir << 2) | (1 << 3) | (finite_mode << 8);
+  flags |= (uint32_t) TMC2209_usteps_exp_bits_to_int(TMC2209_motors[m_ind].CHOPCONF.fields.mres) << 16;
+#ifdef PULSE_ENGINE
+  if (m_ind == 2) {
+    flags |= (1 << 4) | ((engine != 0) << 5);
+  }
+#endif
+  return flags;
+}
+
+void get_state(){
+  //state of all motors as one multi-frame response, read once at connection instead of per motor variable
+  //layout (STATE_VERSION 1): version, sub us divider, tick, motor count,
+  //then per motor: flags (see state_flags), step interval, steps, target steps, accel (m2 only, else 0)
+  uint16_t len = 0;
+  bulk_buffer[len++] = STATE_VERSION;
+  bulk_buffer[len++] = SUB_US_DIV;
+  bulk_buffer[len++] = tick_now;
+  bulk_buffer[len++] = 4;
+  bulk_buffer[len++] = state_flags(0, m0_running, !m0_enabled_pin_state, m0_dir_pin_state, m0_finite_mode, 0);
+  bulk_buffer[len++] = m0_step_interval;
+  bulk_buffer[len++] = m0_steps;
+  bulk_buffer[len++] = m0_target_steps;
+  bulk_buffer[len++] = 0;
+  bulk_buffer[len++] = state_flags(1, m1_running, !m1_enabled_pin_state, m1_dir_pin_state, m1_finite_mode, 0);
+  bulk_buffer[len++] = m1_step_interval;
+  bulk_buffer[len++] = m1_steps;
+  bulk_buffer[len++] = m1_target_steps;
+  bulk_buffer[len++] = 0;
+  bulk_buffer[len++] = state_flags(2, m2_running, !m2_enabled_pin_state, m2_dir_pin_state, m2_finite_mode, m2_engine);
+  bulk_buffer[len++] = m2_step_interval;
+  bulk_buffer[len++] = m2_steps_now();
+  bulk_buffer[len++] = m2_target_steps;
+  bulk_buffer[len++] = m2_accel;
+  bulk_buffer[len++] = state_flags(3, m3_running, !m3_enabled_pin_state, m3_dir_pin_state, m3_finite_mode, 0);
+  bulk_buffer[len++] = m3_step_interval;
+  bulk_buffer[len++] = m3_steps;
+  bulk_buffer[len++] = m3_target_steps;
+  bulk_buffer[len++] = 0;
+  send_bulk(bulk_buffer, len);
+}
+
+void stop_motors_finish(){
+#ifdef PULSE_ENGINE
+  if (m2_engine_active && !m2_running) { //halted by stop_motors, count the pulses it issued
+    m2_engine_stop();
+  }
+#endif
+}
+
+bool stop_isr_signal(){
+  //main loop part of a stop_all applied by the rx interrupts, sent ahead of the replies to the frames before it
+  if (!stop_isr_cnt || !snd_queue_free()) {
+    return false;
+  }
+  __disable_irq();
+  uint32_t tick = stop_isr_tick;
+  stop_hold |= stop_isr_mask;
+  stop_hold_cnt++;
+  stop_isr_mask = 0;
+  stop_isr_cnt--;
+  __enable_irq();
+  stop_motors_finish();
+  signal_stop(tick);
+  return true;
+}
+
+bool stop_hold_release(){
+  //the held starts are released by the in-order copy of the stop_all frame (stop_all), or once the rx buffers are drained
+  //with no frame in progress, i.e. every frame received before the stop_all is processed, as its copy may have been dropped by a full buffer
+  if (!stop_hold_cnt || stop_isr_cnt || rcv_usb_cnt || rcv_uart_cnt
+      || (rcv_usb_write_ind != rcv_usb_read_ind) || (rcv_uart_write_ind != rcv_uart_read_ind)) {
+    return false;
+  }
+  __disable_irq();
+  stop_hold = 0;
+  stop_hold_cnt = 0;
+  __enable_irq();
+  return true;
+}
+
+void stop_all(){
+  //byte 1: motor mask (bit i: motor i), byte 2-3: STOP_ALL_MAGIC, byte 4: 1 to disable the motors as well
+  //replied with signal_stop only, normally already applied and signalled ahead by the rx interrupts (rx_priority_scan)
+  //in order, it releases the starts held back since then
+  uint16_t magic;
+  memcpy(&magic,rcv_buffer+2,2);
+  if (magic != STOP_ALL_MAGIC) {
+    err_cmd();
+    return;
+  }
+  stop_isr_signal(); //in case it is still pending
+  if (stop_hold_cnt) {
+    __disable_irq();
+    stop_hold_cnt--;
+    if (!stop_hold_cnt) {
+      stop_hold = 0;
+    }
+    __enable_irq();
+    return;
+  }
+  stop_motors(rcv_buffer[1], rcv_buffer[4]);
+  stop_motors_finish();
+  signal_stop(tick_now);
+}
+
 void (*cmd_fnc_lst[])() = {
   &get_m0_running,
   &set_m0_running,
@@ -823,33 +1627,52 @@ void (*cmd_fnc_lst[])() = {
   &get_m3_usteps_exp,
   &set_m3_usteps_exp,
   &get_sub_us_divider,
+  &get_tick,
+  &set_ext_events,
+  &get_stats,
+  &set_capture,
+  &get_capture,
+  &get_m2_engine,
+  &set_m2_engine,
+  &get_m2_accel,
+  &set_m2_accel,
+  &set_protocol,
+  &set_baudrate,
+  &get_echo,
+  &get_state,
+  &stop_all,
 };
 
 
 bool process_commands_usb() {
-  if (snd_byte_cnt < MSG_LEN){ //data needs sending
-	  /*
-	  if (snd_byte_cnt){ //if first byte no need delay checking, already flushed
-		  if ((tick_now - snd_last_tick) <= USB_INTERMSG_DELAY) { //otherwise need to wait 1ms between transfers
-			  return false; //wait if this time hasn't elapsed yet
-		  }
+  //replies are paced by the IN transfer complete callback (CDC_TransmitCplt_FS) instead of a fixed delay
+  //frames queued meanwhile are packed into the next transfer, up to one bulk packet
+  if (stop_isr_signal()) {
+    return true;
+  } else if (stop_hold_release()) {
+    return true;
+  } else if (snd_byte_cnt < MSG_LEN){ //data needs sending
+      snd_byte_cnt = MSG_LEN; //before starting, the transfer may complete right away
+	  if (CDC_Transmit_FS(snd_dma_buffer, snd_dma_len) != USBD_OK) {
+		  snd_byte_cnt = 0; //previous transfer not released yet, retry next cycle
+		  return false;
 	  }
-	  CDC_Transmit_FS(&snd_buffer[snd_byte_cnt], 1);
-      snd_byte_cnt++;
-      */
-	  CDC_Transmit_FS(snd_buffer, MSG_LEN);
-      snd_last_tick = tick_now;
-      snd_byte_cnt = MSG_LEN;
 	  return true;
-  } else if (snd_byte_cnt == MSG_LEN){ //all data have been sent, now needs flushing
-	  if ((tick_now - snd_last_tick) <= USB_INTERMSG_DELAY) { //wait 1ms+ to flush
-		  return false; //wait if this time hasn't elapsed yet
-	  }
-    snd_byte_cnt++; //everything flushed, we can move on
+  } else if ((snd_byte_cnt > MSG_LEN) && snd_queue_cnt()){ //endpoint is free, send everything queued so far
+    snd_queue_pack(SND_DMA_BUFFER_LEN);
+    return true;
+  } else if (bulk_ind < bulk_len){ //rest of a multi-frame response, before reading further
+    if (snd_queue_free() <= 2) { //keep room for the motor signals
+      return false;
+    }
+    send_bulk_next();
     return true;
-  } else if (rcv_usb_cnt == MSG_LEN){ //entire package is received, process
+  } else if (snd_queue_free() < 2){ //wait for the transfer in flight before producing more replies
+    return false;
+  } else if (rcv_usb_cnt >= RCV_BAD_FRAME){ //entire package is received, process
+    bool rcv_ready = (rcv_usb_cnt == RCV_READY);
     rcv_usb_cnt = 0;
-    if (check_checksum()){
+    if (rcv_ready && check_checksum()){
       if (rcv_buffer[0] > CMD_COUNT) {
     	  err_cmd();
     	  return true;
@@ -861,9 +1684,8 @@ bool process_commands_usb() {
     return true; //continue reading (if any) on next cycle
   } else if (rcv_usb_write_ind - rcv_usb_read_ind){ //if nothing else to do and need reading
     rcv_last_tick = tick_now;
-	rcv_buffer[rcv_usb_cnt] = rcv_usb_buffer[rcv_usb_read_ind];
+	rcv_usb_cnt = rcv_push(rcv_usb_cnt, rcv_usb_buffer[rcv_usb_read_ind]);
 	rcv_usb_read_ind++;
-    rcv_usb_cnt++;
     return true;
   } else if ((rcv_usb_cnt) && ((tick_now - rcv_last_tick) > SERIAL_INTERBYTE_TIMEOUT)){ //inter-byte timeout
    	  rcv_usb_read_ind = rcv_usb_write_ind;
@@ -875,20 +1697,51 @@ bool process_commands_usb() {
 }
 
 bool process_commands_uart() {
-  if (snd_byte_cnt < MSG_LEN){ //data needs sending
+  if (uart_rx_error) { //any rx error aborts the circular DMA in HAL
+    uart_rx_error = false;
+    if ((uart_fe_cnt >= UART_FE_FALLBACK_CNT) && (uart_baud != UART_BOOT_BAUDRATE)) { //e.g. a new host session at the boot rate
+      uart_baud_prev = 0;
+      uart_set_baudrate(UART_BOOT_BAUDRATE);
+    }
+    uart_rx_restart();
+    return true;
+  }
+  if (stop_isr_signal()) {
+    return true;
+  } else if (stop_hold_release()) {
+    return true;
+  } else if (snd_byte_cnt < MSG_LEN){ //data needs sending
 	  //we can also send one byte at a time
 	  //but with DMA, start sending all at once
 	  //this DMA is not circular
-	  HAL_UART_Transmit_DMA(&huart5, snd_buffer, MSG_LEN);
+	  HAL_UART_Transmit_DMA(&huart5, snd_dma_buffer, snd_dma_len);
       snd_last_tick = tick_now;
       snd_byte_cnt = MSG_LEN;
 	  return true;
   } else if (snd_byte_cnt == MSG_LEN){ //all data have been sent, now needs flushing
 	  //in case of UART, UART tx completed signal
       return true; //return here to wait next cycle for the signal
-  } else if (rcv_uart_cnt == MSG_LEN){ //entire package is received, process
+  } else if (snd_queue_cnt()){ //next queued frame, replies and signals are sent before reading further
+    snd_queue_pop();
+    return true;
+  } else if (bulk_ind < bulk_len){ //rest of a multi-frame response, before reading further
+    send_bulk_next();
+    return true;
+  } else if (uart_baud_next){ //set_baudrate is acked and sent, switch now
+    uart_baud_prev = uart_baud;
+    uart_set_baudrate(uart_baud_next);
+    uart_baud_next = 0;
+    uart_baud_tick = tick_now;
+    return true;
+  } else if (uart_baud_prev && ((tick_now - uart_baud_tick) > UART_BAUD_CONFIRM_TIMEOUT)){ //not confirmed, fall back
+    uart_set_baudrate(uart_baud_prev);
+    uart_baud_prev = 0;
+    return true;
+  } else if (rcv_uart_cnt >= RCV_BAD_FRAME){ //entire package is received, process
+    bool rcv_ready = (rcv_uart_cnt == RCV_READY);
     rcv_uart_cnt = 0;
-    if (check_checksum()){
+    if (rcv_ready && check_checksum()){
+      uart_fe_cnt = 0;
       if (rcv_buffer[0] > CMD_COUNT) {
     	  err_cmd();
     	  return true;
@@ -900,9 +1753,8 @@ bool process_commands_uart() {
     return true; //continue reading (if any) on next cycle
   } else if (rcv_uart_write_ind - rcv_uart_read_ind){ //if nothing else to do and need reading
 	rcv_last_tick = tick_now;
-	rcv_buffer[rcv_uart_cnt] = rcv_uart_buffer[rcv_uart_read_ind];
+	rcv_uart_cnt = rcv_push(rcv_uart_cnt, rcv_uart_buffer[rcv_uart_read_ind]);
 	rcv_uart_read_ind++;
-    rcv_uart_cnt++;
     return true;
   } else if ((rcv_uart_cnt) && ((tick_now - rcv_last_tick) > SERIAL_INTERBYTE_TIMEOUT)) {
 	  rcv_uart_read_ind = rcv_uart_write_ind;
@@ -928,6 +1780,14 @@ void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
 */
 // ###################################### END TMC2209 Functions ######################################
 
+void step_port_flush() {
+  //call after all m*step() of a pass
+  if (step_port_bsrr) {
+    STEP_GPIO_PORT->BSRR = step_port_bsrr;
+    step_port_bsrr = 0;
+  }
+}
+
 void m0step() {
   if (!m0_running){
     return;
@@ -937,22 +1797,31 @@ void m0step() {
     if (m0_last_pulse) { //if high switch to low
       if (m0_tick_delta >= MOTOR_MIN_PULSE_WIDTH) { //check for min. motor driver pulse width
         m0_last_pulse = false;
-	    HAL_GPIO_WritePin(m0_step_pin.port, m0_step_pin.pin, false);
+	    step_reset(m0_step_pin);
         // return;
       } //else return;
     } else if (m0_tick_delta >= m0_step_interval) { //if low, check enough time has passed for high
-      HAL_GPIO_WritePin(m0_step_pin.port, m0_step_pin.pin, true);
+      step_set(m0_step_pin);
       m0_tick_last = tick_now;
       m0_last_pulse = true;
       m0_steps-=m0_finite_mode; //0 for continuous mode, 1 for finite steps
+      m0_step_count++;
+#ifdef PERF_STATS
+      stats_step(0, m0_tick_delta, m0_step_interval);
+#endif
+#ifdef STEP_CAPTURE
+      if (capture_motor == 0) {
+        capture_edge(m0_tick_last);
+      }
+#endif
       // return;
     }
   } else if (m0_last_pulse) {
 	  if (m0_tick_delta >= MOTOR_MIN_PULSE_WIDTH) {
 		m0_last_pulse = false;
-		HAL_GPIO_WritePin(m0_step_pin.port, m0_step_pin.pin, false);
+		step_reset(m0_step_pin);
 	  }
-  } else if (snd_byte_cnt > MSG_LEN) { //if no steps remaining and no message pending
+  } else if (snd_queue_free() >= 2) { //if no steps remaining and there is space for the signal
       m0_running = false; //this will prevent reentering here
       signal_m0_end();
       // return;
@@ -968,22 +1837,31 @@ void m1step() {
     if (m1_last_pulse) { //if high switch to low
       if (m1_tick_delta >= MOTOR_MIN_PULSE_WIDTH) { //check for min. motor driver pulse width
         m1_last_pulse = false;
-	    HAL_GPIO_WritePin(m1_step_pin.port, m1_step_pin.pin, false);
+	    step_reset(m1_step_pin);
         // return;
       } //else return;
     } else if (m1_tick_delta >= m1_step_interval) { //if low, check enough time has passed for high
-      HAL_GPIO_WritePin(m1_step_pin.port, m1_step_pin.pin, true);
+      step_set(m1_step_pin);
       m1_tick_last = tick_now;
       m1_last_pulse = true;
       m1_steps-=m1_finite_mode; //0 for continuous mode, 1 for finite steps
+      m1_step_count++;
+#ifdef PERF_STATS
+      stats_step(1, m1_tick_delta, m1_step_interval);
+#endif
+#ifdef STEP_CAPTURE
+      if (capture_motor == 1) {
+        capture_edge(m1_tick_last);
+      }
+#endif
       // return;
     }
   } else if (m1_last_pulse) {
 	  if (m1_tick_delta >= MOTOR_MIN_PULSE_WIDTH) {
 		m1_last_pulse = false;
-		HAL_GPIO_WritePin(m1_step_pin.port, m1_step_pin.pin, false);
+		step_reset(m1_step_pin);
 	  }
-  } else if (snd_byte_cnt > MSG_LEN) { //if no steps remaining and no message pending
+  } else if (snd_queue_free() >= 2) { //if no steps remaining and there is space for the signal
       m1_running = false; //this will prevent reentering here
       signal_m1_end();
       // return;
@@ -994,27 +1872,45 @@ void m2step() {
   if (!m2_running){
     return;
   }
+#ifdef PULSE_ENGINE
+  if (m2_engine_active) {
+    if (!PulseEngine_IsDone()) {
+      return; //pulses are generated by TIM3
+    }
+    m2_engine_stop(); //m2_steps is 0 now, end is signalled below
+    m2_tick_last = PulseEngine_GetLastStepTick();
+  }
+#endif
   if (m2_steps) {
     m2_tick_delta = (tick_now - m2_tick_last);
     if (m2_last_pulse) { //if high switch to low
       if (m2_tick_delta >= MOTOR_MIN_PULSE_WIDTH) { //check for min. motor driver pulse width
         m2_last_pulse = false;
-	    HAL_GPIO_WritePin(m2_step_pin.port, m2_step_pin.pin, false);
+	    step_reset(m2_step_pin);
         // return;
       } //else return;
     } else if (m2_tick_delta >= m2_step_interval) { //if low, check enough time has passed for high
-      HAL_GPIO_WritePin(m2_step_pin.port, m2_step_pin.pin, true);
+      step_set(m2_step_pin);
       m2_tick_last = tick_now;
       m2_last_pulse = true;
       m2_steps-=m2_finite_mode; //0 for continuous mode, 1 for finite steps
+      m2_step_count++;
+#ifdef PERF_STATS
+      stats_step(2, m2_tick_delta, m2_step_interval);
+#endif
+#ifdef STEP_CAPTURE
+      if (capture_motor == 2) {
+        capture_edge(m2_tick_last);
+      }
+#endif
       // return;
     }
   } else if (m2_last_pulse) {
 	  if (m2_tick_delta >= MOTOR_MIN_PULSE_WIDTH) {
 		m2_last_pulse = false;
-		HAL_GPIO_WritePin(m2_step_pin.port, m2_step_pin.pin, false);
+		step_reset(m2_step_pin);
 	  }
-  } else if (snd_byte_cnt > MSG_LEN) { //if no steps remaining and no message pending
+  } else if (snd_queue_free() >= 2) { //if no steps remaining and there is space for the signal
       m2_running = false; //this will prevent reentering here
       signal_m2_end();
       // return;
@@ -1030,22 +1926,31 @@ void m3step() {
     if (m3_last_pulse) { //if high switch to low
       if (m3_tick_delta >= MOTOR_MIN_PULSE_WIDTH) { //check for min. motor driver pulse width
         m3_last_pulse = false;
-	    HAL_GPIO_WritePin(m3_step_pin.port, m3_step_pin.pin, false);
+	    step_reset(m3_step_pin);
         // return;
       } //else return;
     } else if (m3_tick_delta >= m3_step_interval) { //if low, check enough time has passed for high
-      HAL_GPIO_WritePin(m3_step_pin.port, m3_step_pin.pin, true);
+      step_set(m3_step_pin);
       m3_tick_last = tick_now;
       m3_last_pulse = true;
       m3_steps-=m3_finite_mode; //0 for continuous mode, 1 for finite steps
+      m3_step_count++;
+#ifdef PERF_STATS
+      stats_step(3, m3_tick_delta, m3_step_interval);
+#endif
+#ifdef STEP_CAPTURE
+      if (capture_motor == 3) {
+        capture_edge(m3_tick_last);
+      }
+#endif
       // return;
     }
   } else if (m3_last_pulse) {
 	  if (m3_tick_delta >= MOTOR_MIN_PULSE_WIDTH) {
 		m3_last_pulse = false;
-		HAL_GPIO_WritePin(m3_step_pin.port, m3_step_pin.pin, false);
+		step_reset(m3_step_pin);
 	  }
-  } else if (snd_byte_cnt > MSG_LEN) { //if no steps remaining and no message pending
+  } else if (snd_queue_free() >= 2) { //if no steps remaining and there is space for the signal
       m3_running = false; //this will prevent reentering here
       signal_m3_end();
       // return;
@@ -1054,10 +1959,29 @@ void m3step() {
 
 void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size) {
 	if (huart->Instance == USART5){
+#ifdef PERF_STATS
+		uint16_t pending = (uint8_t) (rcv_uart_write_ind - rcv_uart_read_ind);
+		pending += (uint8_t) ((uint8_t) Size - rcv_uart_write_ind); //new bytes
+		if (pending >= UART_BUFFER_LEN) { //unread bytes were overwritten by the circular DMA
+			stats_rx_uart_dropped += pending - (UART_BUFFER_LEN - 1);
+		}
+#endif
+		while (prio_uart_ind != (uint8_t) Size) {
+			rx_priority_scan(rcv_uart_buffer[prio_uart_ind++]);
+		}
 		rcv_uart_write_ind = (uint8_t) Size; //here size is the position in the buffer, NOT the number of bytes read
 	}
 }
 
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+  if (huart->Instance == USART5) {
+    if (huart->ErrorCode & HAL_UART_ERROR_FE) {
+      uart_fe_cnt++;
+    }
+    uart_rx_error = true;
+  }
+}
+
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
   if (huart->Instance == USART5) { //UART serial to PC
 	  snd_byte_cnt = MSG_LEN + 1; //values > MSG_LEN means tx completed/flushed
@@ -1106,6 +2030,9 @@ void setup() {
   //-----------------------
 
   motor_timer_init();
+#ifdef PULSE_ENGINE
+  PulseEngine_Init(SystemCoreClock / (1000000 * SUB_US_DIV), MOTOR_MIN_PULSE_WIDTH);
+#endif
 
   //tick_now = micros();
 
@@ -1115,7 +2042,7 @@ void setup() {
 #endif
 
 
-  //signal_start();
+  signal_start(); //boot frame, the host proceeds as soon as it arrives instead of waiting a fixed time
 }
 
 /* USER CODE END 0 */
@@ -1168,36 +2095,52 @@ int main(void)
 
     /* USER CODE BEGIN 3 */
 
-	  while (1){ //UART5 serial (115200)
+	  while (1){ //UART5 serial (UART_BOOT_BAUDRATE, raised by set_baudrate)
 		//tick_now defined in macro
 		//tick_now = micros();
 		if (hUsbDeviceFS.dev_state == USBD_STATE_CONFIGURED) { //since no VBUS sensing is possible on STM32G0
 			HAL_UART_DeInit(&huart5);
 			HAL_NVIC_DisableIRQ(DMA1_Channel1_IRQn);
 			HAL_NVIC_DisableIRQ(DMA1_Channel2_3_IRQn);
-			snd_byte_cnt = MSG_LEN + 1; //reset the send state, in case mid message.
+			snd_queue_reset(); //reset the send state, in case mid message.
+			usb_link = true;
+			signal_start(); //ready frame on the new link, read by the host when it opens the port
 			break; //as soon as USB is connected, switch to USB serial
 			//otherwise stay on UART5
 		}
+#ifdef PERF_STATS
+		stats_loop_start();
+#endif
 		//Communicate
 		process_commands_uart();
+#ifdef PERF_STATS
+		stats_cmd_end();
+#endif
 		//Step the motor if it is running and if delta time has passed
 		m0step();
 		m1step();
 		m2step();
 		m3step();
+		step_port_flush();
 	  }
 
 	  while (1){ //USB serial
 		//tick_now defined in macro
 		//tick_now = micros();
+#ifdef PERF_STATS
+		stats_loop_start();
+#endif
 		//Communicate
 		process_commands_usb();
+#ifdef PERF_STATS
+		stats_cmd_end();
+#endif
 		//Step the motor if it is running and if delta time has passed
 		m0step();
 		m1step();
 		m2step();
 		m3step();
+		step_port_flush();
 	  }
 
   }
@@ -0,0 +1,320 @@
+// Copyright 2025 Gun Deniz Akkoc
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// https://github.com/gunakkoc/HiPeristaltic
+
+#include "main.h"
+
+#ifdef PULSE_ENGINE
+#include "pulse_engine.h"
+#include <math.h>
+#include <stddef.h>
+
+#define PE_TIM TIM3
+#define PE_GPIO_PORT GPIOB
+#define PE_GPIO_PIN GPIO_PIN_0
+#define PE_GPIO_AF GPIO_AF1_TIM3
+#define PE_TICK_NOW TIM2->CNT
+
+#define PE_ENTRY_LEN 6 //halfwords per entry, DMA burst to PSC, ARR, RCR (reserved on TIM3), CCR1, CCR2, CCR3
+#define PE_TABLE_LEN 32 //entries, must be even, each half is refilled while the other one is being transferred
+#define PE_HALF_LEN (PE_TABLE_LEN / 2)
+#define PE_MAX_SHIFT 14 //periods longer than 2^16 ticks are prescaled by 2^shift, tick_psc << shift must fit 16 bits
+#define PE_MAX_RAMP_PERIOD ((1UL << 23) - 1) //slowest ramp start period, keeps the fixed point period in 31 bits
+#define PE_FP_SHIFT 8 //fractional bits of the ramp period
+#define PE_PAD_PERIOD 1024 //period of the pulseless entries after the last step
+
+DMA_HandleTypeDef hdma_tim3_up;
+
+static uint16_t pe_table[PE_TABLE_LEN][PE_ENTRY_LEN];
+static uint8_t pe_half_steps[2]; //number of step entries in each half, 0 once only padding remains
+static volatile uint32_t pe_cycles = 0; //number of completed table transfers
+static volatile bool pe_active = false;
+static volatile bool pe_done = false;
+static uint16_t pe_tick_psc = 3;
+static uint32_t pe_pulse_width = 48;
+static uint32_t pe_start_tick = 0;
+static uint32_t pe_steps_issued = 0; //valid after stopping
+
+//ramp generator, trapezoidal profile (D. Austin, "Generate stepper-motor speed profiles in real time")
+static uint32_t pe_total = 0; //number of steps of the run
+static uint32_t pe_generated = 0; //number of periods generated so far
+static uint32_t pe_accel_steps = 0; //length of both acceleration and deceleration
+static uint32_t pe_period_fp = 0; //current period in ticks << PE_FP_SHIFT
+static uint32_t pe_cruise_fp = 0;
+static uint32_t pe_start_fp = 0;
+static uint32_t pe_const_period = 0; //period in ticks of constant rate runs too slow for the fixed point format, 0 for the ramp generator
+static uint32_t pe_last_step_offset = 0; //ticks from the first step to the last step
+
+static uint32_t pe_next_period(void){
+  //period of the next step in ticks
+  uint32_t n = pe_generated;
+  if (n == 0) {
+    pe_period_fp = pe_start_fp;
+  } else if (n < pe_accel_steps) { //c_n = c_(n-1) - 2 c_(n-1) / (4n + 1)
+    pe_period_fp -= (pe_period_fp << 1) / ((n << 2) + 1);
+    if (pe_period_fp < pe_cruise_fp) {
+      pe_period_fp = pe_cruise_fp;
+    }
+  } else if (n >= (pe_total - pe_accel_steps)) { //mirrored, c_(k-1) = c_k + 2 c_k / (4k - 1) with k steps left
+    uint32_t k = pe_total - n;
+    pe_period_fp += (pe_period_fp << 1) / ((k << 2) - 1);
+    if (pe_period_fp > pe_start_fp) {
+      pe_period_fp = pe_start_fp;
+    }
+  } else {
+    pe_period_fp = pe_cruise_fp;
+  }
+  pe_generated++;
+  return pe_period_fp >> PE_FP_SHIFT;
+}
+
+static void pe_fill_entry(uint16_t *entry, uint32_t period, uint32_t pulse_width){
+  uint8_t shift = 0;
+  while (((period >> shift) > 0x10000) && (shift < PE_MAX_SHIFT)) {
+    shift++;
+  }
+  entry[0] = (pe_tick_psc << shift) - 1; //PSC
+  entry[1] = (period >> shift) - 1; //ARR
+  entry[2] = 0;
+  entry[3] = 0;
+  entry[4] = 0;
+  entry[5] = pulse_width >> shift; //CCR3, output is high while CNT < CCR3, 0 for no pulse
+  if (pulse_width && !entry[5]) {
+    entry[5] = 1;
+  }
+}
+
+static void pe_refill(uint8_t half){
+  uint8_t steps = 0;
+  for (uint8_t i = half * PE_HALF_LEN; i < (half + 1) * PE_HALF_LEN; i++) {
+    if (pe_generated < pe_total) {
+      uint32_t period;
+      if (pe_const_period) {
+        period = pe_const_period;
+        pe_generated++;
+      } else {
+        period = pe_next_period();
+      }
+      if (pe_generated < pe_total) { //the period after the last step is not waited for
+        pe_last_step_offset += period;
+      }
+      pe_fill_entry(pe_table[i], period, pe_pulse_width);
+      steps++;
+    } else {
+      pe_fill_entry(pe_table[i], PE_PAD_PERIOD, 0);
+    }
+  }
+  pe_half_steps[half] = steps;
+}
+
+static void pe_set_pin_af(bool af){
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+  GPIO_InitStruct.Pin = PE_GPIO_PIN;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  if (af) {
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    GPIO_InitStruct.Alternate = PE_GPIO_AF;
+  } else {
+    PE_GPIO_PORT->BRR = PE_GPIO_PIN;
+    GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  }
+  HAL_GPIO_Init(PE_GPIO_PORT, &GPIO_InitStruct);
+}
+
+static uint32_t pe_transfer_count(void){
+  //number of entries transferred to the timer since start (entries of the table, without the first step)
+  uint32_t remaining = hdma_tim3_up.Instance->CNDTR;
+  uint32_t pos = ((PE_TABLE_LEN * PE_ENTRY_LEN) - remaining + (PE_ENTRY_LEN - 1)) / PE_ENTRY_LEN; //partial bursts count
+  return (pe_cycles * PE_TABLE_LEN) + pos;
+}
+
+static uint32_t pe_halt(void){
+  //stops the timer and the DMA, returns the number of issued steps
+  //called with the DMA interrupt masked or from it, its half and complete callbacks are off before the teardown
+  pe_active = false;
+  __HAL_DMA_DISABLE_IT(&hdma_tim3_up, DMA_IT_HT | DMA_IT_TC);
+  PE_TIM->CR1 &= ~TIM_CR1_CEN;
+  PE_TIM->DIER &= ~TIM_DIER_UDE;
+  //the first step is loaded before the start, the last transferred entry is waiting in the preload registers
+  uint32_t issued = pe_transfer_count();
+  if (issued > pe_total) {
+    issued = pe_total;
+  }
+  HAL_DMA_Abort(&hdma_tim3_up);
+  PE_TIM->CCMR2 = (PE_TIM->CCMR2 & ~TIM_CCMR2_OC3M) | TIM_CCMR2_OC3M_2; //force inactive, in case stopped within a pulse
+  pe_set_pin_af(false);
+  return issued;
+}
+
+static void pe_half_cplt(uint8_t half){
+  if (!pe_active) {
+    return;
+  }
+  if ((pe_generated >= pe_total) && (pe_half_steps[half] == 0)) {
+    //only padding was transferred, the last step entry was transferred at least PE_HALF_LEN updates ago
+    pe_steps_issued = pe_halt();
+    pe_done = true;
+    return;
+  }
+  pe_refill(half);
+}
+
+static void pe_dma_half_cplt_callback(DMA_HandleTypeDef *hdma){
+  pe_half_cplt(0);
+}
+
+static void pe_dma_cplt_callback(DMA_HandleTypeDef *hdma){
+  pe_cycles++;
+  pe_half_cplt(1);
+}
+
+void PulseEngine_Init(uint16_t tick_psc, uint32_t pulse_width){
+  pe_tick_psc = tick_psc;
+  pe_pulse_width = pulse_width;
+
+  __HAL_RCC_TIM3_CLK_ENABLE();
+  PE_TIM->CR1 = TIM_CR1_ARPE; //ARR preloaded, PSC and CCR3 (OC3PE) are preloaded as well
+  PE_TIM->CCMR2 = TIM_CCMR2_OC3M_2 | TIM_CCMR2_OC3PE; //forced inactive until started
+  PE_TIM->CCER = TIM_CCER_CC3E; //active high
+  PE_TIM->DCR = ((PE_ENTRY_LEN - 1) << TIM_DCR_DBL_Pos) | ((offsetof(TIM_TypeDef, PSC) >> 2) << TIM_DCR_DBA_Pos);
+
+  hdma_tim3_up.Instance = DMA1_Channel4;
+  hdma_tim3_up.Init.Request = DMA_REQUEST_TIM3_UP;
+  hdma_tim3_up.Init.Direction = DMA_MEMORY_TO_PERIPH;
+  hdma_tim3_up.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_tim3_up.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_tim3_up.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+  hdma_tim3_up.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+  hdma_tim3_up.Init.Mode = DMA_CIRCULAR;
+  hdma_tim3_up.Init.Priority = DMA_PRIORITY_VERY_HIGH;
+  if (HAL_DMA_Init(&hdma_tim3_up) != HAL_OK) {
+    while (1);
+  }
+  hdma_tim3_up.XferHalfCpltCallback = pe_dma_half_cplt_callback;
+  hdma_tim3_up.XferCpltCallback = pe_dma_cplt_callback;
+  HAL_NVIC_SetPriority(DMA1_Ch4_7_DMA2_Ch1_5_DMAMUX1_OVR_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Ch4_7_DMA2_Ch1_5_DMAMUX1_OVR_IRQn);
+}
+
+bool PulseEngine_Start(uint32_t steps, uint32_t step_interval, uint32_t accel){
+  if (pe_active || (steps == 0)) {
+    return false;
+  }
+  if ((step_interval <= pe_pulse_width) || ((step_interval >> PE_MAX_SHIFT) > 0x10000)) {
+    return false; //out of range, leave it to the main loop
+  }
+  //ramp, computed once per run
+  uint32_t ticks_per_s = (SystemCoreClock / pe_tick_psc);
+  uint32_t start_period = step_interval;
+  pe_accel_steps = 0;
+  if (accel) {
+    float c0 = 0.676f * (float) ticks_per_s * sqrtf(2.0f / (float) accel);
+    if (c0 > (float) PE_MAX_RAMP_PERIOD) {
+      c0 = (float) PE_MAX_RAMP_PERIOD;
+    }
+    if ((c0 > (float) step_interval) && (step_interval <= PE_MAX_RAMP_PERIOD)) {
+      float v = (float) ticks_per_s / (float) step_interval; //steps/s
+      pe_accel_steps = (uint32_t) ((v * v) / (2.0f * (float) accel)) + 1;
+      if (pe_accel_steps > (steps >> 1)) {
+        pe_accel_steps = steps >> 1; //triangular profile
+      }
+      start_period = (uint32_t) c0;
+    }
+  }
+  pe_total = steps;
+  pe_generated = 0;
+  pe_last_step_offset = 0;
+  pe_start_fp = start_period << PE_FP_SHIFT;
+  pe_cruise_fp = step_interval << PE_FP_SHIFT;
+  if (!pe_accel_steps) {
+    pe_start_fp = pe_cruise_fp;
+  }
+  pe_const_period = 0;
+  if (step_interval > PE_MAX_RAMP_PERIOD) { //constant rate only, period does not fit the fixed point format
+    pe_const_period = step_interval;
+  }
+
+  //the first step is loaded directly, the table holds the following ones
+  uint16_t first[PE_ENTRY_LEN];
+  uint32_t period;
+  if (pe_const_period) {
+    period = pe_const_period;
+    pe_generated = 1;
+  } else {
+    period = pe_next_period();
+  }
+  if (pe_generated < pe_total) {
+    pe_last_step_offset += period;
+  }
+  pe_fill_entry(first, period, pe_pulse_width);
+  pe_refill(0);
+  pe_refill(1);
+
+  pe_cycles = 0;
+  pe_done = false;
+  pe_active = true;
+  PE_TIM->CR1 &= ~TIM_CR1_CEN;
+  PE_TIM->PSC = first[0];
+  PE_TIM->ARR = first[1];
+  PE_TIM->CCR3 = first[5];
+  PE_TIM->CNT = 0;
+  PE_TIM->CCMR2 = (PE_TIM->CCMR2 & ~TIM_CCMR2_OC3M) | TIM_CCMR2_OC3M_2 | TIM_CCMR2_OC3M_1; //PWM mode 1
+  if (HAL_DMA_Start_IT(&hdma_tim3_up, (uint32_t) pe_table, (uint32_t) &PE_TIM->DMAR, PE_TABLE_LEN * PE_ENTRY_LEN) != HAL_OK) {
+    pe_active = false;
+    return false;
+  }
+  PE_TIM->DIER |= TIM_DIER_UDE;
+  PE_TIM->EGR = TIM_EGR_UG; //loads the first step into the shadow registers, the DMA burst preloads the second
+  pe_set_pin_af(true);
+  pe_start_tick = PE_TICK_NOW;
+  PE_TIM->CR1 |= TIM_CR1_CEN;
+  return true;
+}
+
+uint32_t PulseEngine_Stop(void){
+  //also called from the rx interrupts (stop_all), which the DMA interrupt preempts
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (pe_active) {
+    pe_steps_issued = pe_halt();
+  }
+  pe_done = false;
+  uint32_t issued = pe_steps_issued;
+  __set_PRIMASK(primask);
+  return issued;
+}
+
+uint32_t PulseEngine_GetStepCount(void){
+  if (!pe_active) {
+    return pe_steps_issued;
+  }
+  uint32_t issued = pe_transfer_count();
+  return (issued > pe_total) ? pe_total : issued;
+}
+
+uint32_t PulseEngine_GetLastStepTick(void){
+  return pe_start_tick + pe_last_step_offset;
+}
+
+bool PulseEngine_IsActive(void){
+  return pe_active;
+}
+
+bool PulseEngine_IsDone(void){
+  return pe_done;
+}
+
+#endif
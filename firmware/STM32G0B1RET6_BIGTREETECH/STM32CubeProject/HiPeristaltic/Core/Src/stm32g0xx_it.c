@@ -202,5 +202,16 @@ void USART3_4_5_6_LPUART1_IRQHandler(void)
 }
 
 /* USER CODE BEGIN 1 */
+#ifdef PULSE_ENGINE
+extern DMA_HandleTypeDef hdma_tim3_up;
+
+/**
+  * @brief This function handles DMA1 channel 4 to 7, DMA2 channel 1 to 5 and DMAMUX1 overrun interrupts.
+  */
+void DMA1_Ch4_7_DMA2_Ch1_5_DMAMUX1_OVR_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_tim3_up); //pulse engine table refill
+}
+#endif
 
 /* USER CODE END 1 */
@@ -22,6 +22,7 @@
 #include "usbd_cdc_if.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include "main.h"
 
 /* USER CODE END INCLUDE */
 
@@ -36,6 +37,11 @@
 extern uint8_t rcv_usb_buffer[BUFFER_LEN];
 extern uint8_t rcv_usb_write_ind;
 extern uint8_t rcv_usb_read_ind;
+extern uint8_t snd_byte_cnt;
+#ifdef PERF_STATS
+extern uint32_t stats_rx_usb_dropped;
+#endif
+extern void rx_priority_scan(uint8_t byte);
 
 /* USER CODE END PV */
 
@@ -159,6 +165,7 @@ static int8_t CDC_Init_FS(void)
   /* Set Application Buffers */
   USBD_CDC_SetTxBuffer(&hUsbDeviceFS, UserTxBufferFS, 0);
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, UserRxBufferFS);
+  snd_byte_cnt = MSG_LEN + 1; //a transfer in flight before a bus reset never completes
   return (USBD_OK);
   /* USER CODE END 3 */
 }
@@ -266,7 +273,16 @@ static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
+  for (uint32_t i = 0; i<*Len; i++){ //stop_all is applied right away, even if the ring is full
+	  rx_priority_scan(Buf[i]);
+  }
   for (uint32_t i = 0; i<*Len; i++){
+	  if ((uint8_t) (rcv_usb_write_ind - rcv_usb_read_ind) == (uint8_t) (BUFFER_LEN - 1)) { //ring full, drop instead of overwriting
+#ifdef PERF_STATS
+		  stats_rx_usb_dropped += *Len - i;
+#endif
+		  break;
+	  }
 	  rcv_usb_buffer[rcv_usb_write_ind] = Buf[i];
 	  rcv_usb_write_ind++;
   }
@@ -319,6 +335,7 @@ static int8_t CDC_TransmitCplt_FS(uint8_t *Buf, uint32_t *Len, uint8_t epnum)
   UNUSED(Buf);
   UNUSED(Len);
   UNUSED(epnum);
+  snd_byte_cnt = MSG_LEN + 1; //values > MSG_LEN means tx completed, next frames can be sent
   /* USER CODE END 13 */
   return result;
 }
@@ -0,0 +1,115 @@
+# Copyright 2025 Gun Deniz Akkoc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# https://github.com/gunakkoc/HiPeristaltic
+
+# Microbenchmark of the host side frame encoding and decoding (frames/s), e.g. to size command rates on a Raspberry Pi.
+# Without a device, frames are encoded to a null port and decoded from memory, so only the codec and the interface overhead is measured.
+# Decoding includes the dispatch of the decoded acks, with one frame per read and with batches of frames per read (the reader thread drains all available bytes at once).
+# The numpy based codec of earlier versions is measured as a reference.
+# With --port, round trips of get_tick to a connected device are measured as well.
+# Example:
+#   python FrameCodecBenchmark.py --count 100000
+#   python FrameCodecBenchmark.py --port /dev/ttyACM0 --count 2000
+
+import argparse
+import binascii
+import logging
+from time import perf_counter_ns
+import numpy as np
+import HiPeristalticInterface as hpi
+
+class _NullPort():
+    #stands in for serial.Serial, writes are dropped
+    def write(self, data):
+        return len(data)
+
+_BATCH_LEN = 16 #frames per read in the batched decoding
+
+def _legacy_encode_v1(tx_buffer: bytearray, cmd_ind: int, var_type: type, val: int):
+    #the numpy based encoder replaced by the struct based one, for reference
+    tx_buffer[0] = np.uint8(cmd_ind).tobytes()[0]
+    arg_bytes = var_type(val).tobytes()
+    tx_buffer[1:len(arg_bytes)+1] = arg_bytes
+    data = np.frombuffer(tx_buffer, np.uint8)
+    checksum = data[0]
+    for i in range(1, len(tx_buffer) - 1):
+        checksum = checksum ^ data[i]
+    tx_buffer[-1] = checksum
+    return bytes(tx_buffer)
+
+def _legacy_decode_v1(rx_buffer: bytes, var_type: type):
+    data = np.frombuffer(rx_buffer, np.uint8)
+    checksum = data[0]
+    for i in range(1, len(rx_buffer) - 1):
+        checksum = checksum ^ data[i]
+    if checksum != np.uint8(rx_buffer[-1]):
+        return None
+    return np.frombuffer(buffer=rx_buffer[1:-1], dtype=var_type)[0]
+
+def _frame(protocol: int, cmd_ind: int, val: int)->bytes:
+    msg = hpi._FRAME_STRUCTS[np.uint32].pack(cmd_ind, val)
+    if protocol == 2:
+        return bytes(hpi._cobs_encode(msg + binascii.crc_hqx(msg, 0xFFFF).to_bytes(2, "little"), delimited=True)[1:])
+    return msg + bytes([hpi._xor8(msg, 5)])
+
+def _rate(func, count: int)->float:
+    #calls per second
+    t0 = perf_counter_ns()
+    for i in range(count):
+        func(i)
+    return count * 1e9 / (perf_counter_ns() - t0)
+
+def run_codec_benchmark(count: int)->dict:
+    hp = hpi.HiPeristalticInterface()
+    cmd = hp._cmd_map["set_m0_step_interval"]
+    results = {}
+    for protocol in [1, 2]:
+        hp._protocol = protocol
+        hp._serial_com = _NullPort()
+        def encode(i):
+            hpi._FRAME_STRUCTS[cmd.var_type].pack_into(hp._tx_buffer, 0, cmd.cmd_ind, i & 0xFFFFFFFF)
+            hp._write_data()
+        results[f"encode_v{protocol}"] = _rate(encode, count)
+        frames = [_frame(protocol, 253, i) for i in range(256)] #acks
+        results[f"decode_v{protocol}"] = _rate(lambda i: hp._process_rx(bytearray(frames[i & 0xFF])), count)
+        batch = b"".join(frames[:_BATCH_LEN])
+        results[f"decode_v{protocol}_batch"] = _rate(lambda i: hp._process_rx(bytearray(batch)), count // _BATCH_LEN) * _BATCH_LEN
+    tx_buffer = bytearray(hp._MSG_LEN)
+    results["encode_v1_numpy"] = _rate(lambda i: _legacy_encode_v1(tx_buffer, cmd.cmd_ind, cmd.var_type, i & 0xFFFFFFFF), count)
+    frames = [_frame(1, 253, i) for i in range(256)]
+    results["decode_v1_numpy"] = _rate(lambda i: _legacy_decode_v1(frames[i & 0xFF], cmd.var_type), count)
+    return results
+
+def run_device_benchmark(config_fpath: str, serial_port: str, count: int)->float:
+    #get_tick round trips per second, i.e. two frames each
+    hp = hpi.HiPeristalticInterface()
+    hp.load_config(config_fpath)
+    hp.connect(serial_port=serial_port)
+    cmd = hp._cmd_map["get_tick"]
+    return _rate(lambda i: hp._send_get_cmd(cmd_index=cmd.cmd_ind, var_type=cmd.var_type), count)
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Host side frame codec microbenchmark.")
+    parser.add_argument("--count", type=int, default=100000, help="frames per measurement")
+    parser.add_argument("--config", default=None, help="pump config file (toml), default is HiPeristaltic.toml")
+    parser.add_argument("--port", default=None, help="serial port of a device, also measures round trips")
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.WARNING)
+
+    for key, val in run_codec_benchmark(args.count).items():
+        print(f"{key:>16}: {val:>12.0f} frames/s {1e6 / val:>8.2f} us/frame")
+    if not (args.port is None):
+        val = run_device_benchmark(args.config, args.port, args.count)
+        print(f"{'round_trip':>16}: {val:>12.0f} cmds/s {1e6 / val:>8.2f} us/cmd")
@@ -0,0 +1,323 @@
+# Copyright 2025 Gun Deniz Akkoc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# https://github.com/gunakkoc/HiPeristaltic
+
+# Local broker that keeps the serial link(s) open and shares them with any number of client processes over a Unix domain socket.
+# Clients use the same API as HiPeristalticInterface and Pump (public methods and attributes), without the connection delay.
+# Requests of a client are tagged and run concurrently, so a blocking pump call does not hold back the others.
+# Asynchronous events of the MCU (e.g. end of a pump task) are forwarded to every subscribed client.
+# Example:
+#   python HiPeristalticBroker.py --config HiPeristaltic.toml           (or --rack HiPeristalticRack.toml)
+#   client = HiPeristalticClient()
+#   client.pumps[0].pump_volume(target_volume_uL=60, flow_rate_uLpersec=12, direction="cw", blocking=True)
+#
+# Wire format: one JSON object per line.
+#   request:  {"id": int, "pump": pump index or null for the device, "method": str, "args": list, "kwargs": dict}
+#   reply:    {"id": int, "result": value} or {"id": int, "error": str}
+#   event:    {"event": PumpEvent}
+# "getattr"/"setattr" read/write a public attribute, "subscribe" starts the event forwarding to the client.
+
+from concurrent.futures import ThreadPoolExecutor
+from threading import Thread, Lock, Event
+from datetime import timedelta
+from itertools import count
+import argparse
+import tempfile
+import logging
+import socket
+import queue
+import json
+import os
+import numpy as np
+try:
+    from .HiPeristalticInterface import HiPeristalticInterface, PumpEvent
+except ImportError:
+    from HiPeristalticInterface import HiPeristalticInterface, PumpEvent
+
+DEFAULT_SOCKET_PATH = os.path.join(tempfile.gettempdir(), "hiperistaltic.sock")
+_BLOCKED_METHODS = {"connect", "load_config", "set_config", "add_event_listener", "remove_event_listener"} #owned by the broker
+_STOP_METHODS = {"stop_all", "emergency_stop", "stop_all_pumps", "pump_stop"} #never wait behind the busy workers
+
+def _json_default(obj):
+    if isinstance(obj, np.integer):
+        return int(obj)
+    if isinstance(obj, (np.floating, np.bool_)):
+        return obj.item()
+    if isinstance(obj, np.ndarray):
+        return obj.tolist()
+    if isinstance(obj, timedelta):
+        return {"__timedelta_s__": obj.total_seconds()}
+    if isinstance(obj, PumpEvent):
+        return {"__pump_event__": vars(obj)}
+    raise TypeError(f"{type(obj).__name__} is not serializable")
+
+def _json_object_hook(obj: dict):
+    if "__timedelta_s__" in obj:
+        return timedelta(seconds=obj["__timedelta_s__"])
+    if "__pump_event__" in obj:
+        return PumpEvent(**obj["__pump_event__"])
+    return obj
+
+def _encode(msg: dict)->bytes:
+    return (json.dumps(msg, default=_json_default) + "\n").encode()
+
+def _decode(line: bytes)->dict:
+    return json.loads(line, object_hook=_json_object_hook)
+
+class _BrokerConnection():
+    #one client, replies and events are queued and written by a separate thread so that neither blocks the senders
+    def __init__(self, broker, sock: socket.socket):
+        self.broker = broker
+        self.sock = sock
+        self.subscribed = False
+        self._tx_queue = queue.Queue()
+        Thread(target=self._write_thread_func, daemon=True).start()
+        Thread(target=self._read_thread_func, daemon=True).start()
+
+    def send(self, msg: dict):
+        self._tx_queue.put(_encode(msg)) #raises for unserializable results in the sender
+
+    def _write_thread_func(self):
+        while True:
+            data = self._tx_queue.get()
+            if data is None:
+                break
+            try:
+                self.sock.sendall(data)
+            except OSError:
+                break
+
+    def _read_thread_func(self):
+        with self.sock.makefile("rb") as f:
+            for line in f:
+                try:
+                    request = _decode(line)
+                except ValueError:
+                    logging.warning("Broker received a malformed request.")
+                    continue
+                executor = self.broker._stop_executor if (request.get("method") in _STOP_METHODS) else self.broker._executor
+                executor.submit(self.broker._handle_request, self, request)
+        self.subscribed = False
+        self._tx_queue.put(None)
+        self.broker._remove_connection(self)
+        self.sock.close()
+
+class HiPeristalticBroker():
+    driver = None #HiPeristalticInterface or HiPeristalticRack, connected
+    socket_path: str = DEFAULT_SOCKET_PATH
+    _server_sock: socket.socket = None
+    _connections: list = None
+    _lock_connections: Lock
+    _executor: ThreadPoolExecutor = None
+    _stop_executor: ThreadPoolExecutor = None
+
+    def __init__(self, driver, socket_path: str = None, max_workers: int = 32):
+        self.driver = driver
+        if not (socket_path is None):
+            self.socket_path = socket_path
+        self._connections = []
+        self._lock_connections = Lock()
+        self._executor = ThreadPoolExecutor(max_workers=max_workers) #bounds the concurrently running requests of all clients
+        self._stop_executor = ThreadPoolExecutor(max_workers=4) #stop requests, free even when all the workers above block
+        self.driver.add_event_listener(self._on_event)
+
+    def serve_forever(self):
+        if os.path.exists(self.socket_path):
+            if self._broker_alive():
+                raise RuntimeError(f"Another broker is listening on {self.socket_path}.")
+            os.unlink(self.socket_path) #left over by a previous broker
+        self._server_sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._server_sock.bind(self.socket_path)
+        os.chmod(self.socket_path, 0o660) #owner and group only
+        self._server_sock.listen()
+        logging.info(f"Broker listening on {self.socket_path}.")
+        try:
+            while True:
+                sock, _ = self._server_sock.accept()
+                with self._lock_connections:
+                    self._connections.append(_BrokerConnection(self, sock))
+        finally:
+            self._server_sock.close()
+            if os.path.exists(self.socket_path):
+                os.unlink(self.socket_path)
+
+    def _broker_alive(self)->bool:
+        probe = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            probe.connect(self.socket_path)
+            return True
+        except OSError: #refused or not a socket, nothing is listening
+            return False
+        finally:
+            probe.close()
+
+    def _remove_connection(self, connection: _BrokerConnection):
+        with self._lock_connections:
+            if connection in self._connections:
+                self._connections.remove(connection)
+
+    def _on_event(self, event: PumpEvent):
+        #runs in the reader thread of the serial link, only queues
+        with self._lock_connections:
+            for connection in self._connections:
+                if connection.subscribed:
+                    connection.send({"event": event})
+
+    def _handle_request(self, connection: _BrokerConnection, request: dict):
+        req_id = request.get("id")
+        try:
+            method = request["method"]
+            args = request.get("args", [])
+            kwargs = request.get("kwargs", {})
+            target = self.driver if (request.get("pump") is None) else self.driver.pumps[int(request["pump"])]
+            if method == "subscribe":
+                connection.subscribed = True
+                result = True
+            elif method == "getattr":
+                result = self._public_attr(target, args[0], callable_ok=False)
+            elif method == "setattr":
+                self._public_attr(target, args[0], callable_ok=False)
+                setattr(target, args[0], args[1])
+                result = True
+            else:
+                if method in _BLOCKED_METHODS:
+                    raise AttributeError(f"{method} is not available through the broker")
+                result = self._public_attr(target, method, callable_ok=True)(*args, **kwargs)
+            connection.send({"id": req_id, "result": result})
+        except Exception as e:
+            connection.send({"id": req_id, "error": f"{type(e).__name__}: {e}"})
+
+    def _public_attr(self, target, name: str, callable_ok: bool):
+        #only the public API is reachable, methods are called and attributes are read/written, not the other way around
+        if name.startswith("_"):
+            raise AttributeError(f"{name} is private")
+        attr = getattr(target, name)
+        if callable(attr) != callable_ok:
+            raise AttributeError(f"{name} is {'not ' if callable_ok else ''}a method")
+        return attr
+
+class _RemoteObject():
+    #forwards public method calls to the driver (pump_ind None) or to a pump
+    def __init__(self, client, pump_ind: int = None):
+        self._client = client
+        self._pump_ind = pump_ind
+
+    def __getattr__(self, name: str):
+        if name.startswith("_"):
+            raise AttributeError(name)
+        return lambda *args, **kwargs: self._client._call(self._pump_ind, name, *args, **kwargs)
+
+    def get(self, name: str):
+        return self._client._call(self._pump_ind, "getattr", name)
+
+    def set(self, name: str, val):
+        return self._client._call(self._pump_ind, "setattr", name, val)
+
+class HiPeristalticClient(_RemoteObject):
+    """
+    Client of HiPeristalticBroker with the API of HiPeristalticInterface, e.g. client.pumps[0].pump_volume(...).
+    Public attributes are read and written with get(name) and set(name, val), e.g. client.pumps[0].set("uL_per_rev", 61.2).
+    Calls are thread safe and run concurrently on the broker. Broker side errors are raised as exceptions.
+    """
+    pumps: list = None
+    pump_count: int = 0
+
+    def __init__(self, socket_path: str = None):
+        super().__init__(self)
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.connect(DEFAULT_SOCKET_PATH if (socket_path is None) else socket_path)
+        self._lock_send = Lock()
+        self._pending = {}
+        self._ids = count()
+        self._event_listeners = []
+        self._subscribed = False
+        Thread(target=self._read_thread_func, daemon=True).start()
+        self.pump_count = self.get("pump_count")
+        self.pumps = [_RemoteObject(self, i) for i in range(self.pump_count)]
+
+    def close(self):
+        try:
+            self._sock.shutdown(socket.SHUT_RDWR) #also ends the reader thread, which holds the socket open
+        except OSError:
+            pass
+        self._sock.close()
+
+    def _call(self, pump_ind: int, method: str, *args, **kwargs):
+        waiter = [Event(), None]
+        with self._lock_send:
+            req_id = next(self._ids)
+            self._pending[req_id] = waiter
+            self._sock.sendall(_encode({"id": req_id, "pump": pump_ind, "method": method, "args": args, "kwargs": kwargs}))
+        waiter[0].wait()
+        reply = waiter[1]
+        if "error" in reply:
+            raise Exception(reply["error"])
+        return reply["result"]
+
+    def _read_thread_func(self):
+        try:
+            with self._sock.makefile("rb") as f:
+                for line in f:
+                    msg = _decode(line)
+                    if "event" in msg:
+                        for func in list(self._event_listeners):
+                            try:
+                                func(msg["event"])
+                            except Exception as e:
+                                logging.error(f"Event listener failed for {msg['event']}: {e}")
+                        continue
+                    waiter = self._pending.pop(msg.get("id"), None)
+                    if not (waiter is None):
+                        waiter[1] = msg
+                        waiter[0].set()
+        except OSError:
+            pass
+        for waiter in list(self._pending.values()): #broker is gone, fail the waiting calls
+            waiter[1] = {"error": "Connection to the broker is closed."}
+            waiter[0].set()
+        self._pending.clear()
+
+    def add_event_listener(self, func: callable):
+        #func(event: PumpEvent) is called for every asynchronous event of the MCU, from the reader thread of the client
+        self._event_listeners.append(func)
+        if not self._subscribed:
+            self._subscribed = self._call(None, "subscribe")
+
+    def remove_event_listener(self, func: callable):
+        if func in self._event_listeners:
+            self._event_listeners.remove(func)
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Shares the pump board(s) with local clients over a Unix domain socket.")
+    parser.add_argument("--config", default=None, help="pump config file (toml), default is HiPeristaltic.toml")
+    parser.add_argument("--rack", default=None, help="rack config file (toml), used instead of --config")
+    parser.add_argument("--port", default=None, help="serial port, overrides the config (single board only)")
+    parser.add_argument("--socket", default=DEFAULT_SOCKET_PATH, help="Unix domain socket path")
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.INFO)
+
+    if args.rack is None:
+        driver = HiPeristalticInterface()
+        driver.load_config(args.config)
+        driver.connect(serial_port=args.port)
+    else:
+        try:
+            from .HiPeristalticRack import HiPeristalticRack
+        except ImportError:
+            from HiPeristalticRack import HiPeristalticRack
+        driver = HiPeristalticRack()
+        driver.load_config(args.rack)
+        driver.connect()
+    HiPeristalticBroker(driver, socket_path=args.socket).serve_forever()
@@ -0,0 +1,226 @@
+# Copyright 2025 Gun Deniz Akkoc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# https://github.com/gunakkoc/HiPeristaltic
+
+# Unattended gravimetric calibration of the pumps against a lab balance on a serial port.
+# Each pump runs a series of rpms into a vessel on the balance. The weight is read until stable before and after each run,
+# and streamed during the run. uL/rev of each run is the weight gain over the density and the revolutions, and a polynomial
+# in rpm (quadratic by default) is fitted over the runs. The fitted uL/rev at the calibrated rpms is stored as the
+# calibration_curve of the pump, and its value at the middle of the calibrated rpm range as calibration_uL_per_Rev, both saved to the config file.
+# The balance is polled with a weight request, "SI" of MT-SICS (Mettler Toledo) by default, e.g. "\x1bP" for Sartorius.
+# Without a balance, --simulate weighs what the pumps would deliver with a uL/rev dropping with the rpm.
+# Example:
+#   python HiPeristalticCalibration.py --pumps 0 1 --rpms 10 30 50 70 90 --duration 10 --balance-port /dev/ttyUSB1
+#   python HiPeristalticCalibration.py --pumps 0 --simulate --dry-run
+
+from time import perf_counter, sleep
+import argparse
+import logging
+import random
+import re
+import serial
+import numpy as np
+try:
+    from .HiPeristalticInterface import HiPeristalticInterface, Pump
+except ImportError:
+    from HiPeristalticInterface import HiPeristalticInterface, Pump
+
+_UNITS_G = {"mg": 1e-3, "g": 1.0, "kg": 1e3}
+_WEIGHT_RE = re.compile(rb"([-+]?\s*\d+(?:\.\d*)?)\s*(mg|kg|g)?")
+
+class Balance():
+    # weight requests and replies as lines, the first number of a reply is the weight in the unit that follows it (g by default)
+    # replies without a number (e.g. "S I" of MT-SICS while the balance is busy) are invalid readings
+    def __init__(self, port: str, baudrate: int = 9600, request: bytes = b"SI\r\n", timeout_s: float = 1.0):
+        self.request = request
+        self._serial_com = serial.serial_for_url(port, baudrate=baudrate, timeout=timeout_s)
+
+    def read_g(self)->float:
+        #None if the balance did not reply with a weight
+        self._serial_com.reset_input_buffer()
+        self._serial_com.write(self.request)
+        match = _WEIGHT_RE.search(self._serial_com.readline())
+        if match is None:
+            return None
+        unit = (match.group(2) or b"g").decode()
+        return float(match.group(1).replace(b" ", b"")) * _UNITS_G[unit]
+
+    def close(self):
+        self._serial_com.close()
+
+class SimulatedBalance():
+    # weighs what the finite runs of the pumps deliver from their step counts, at the rpm they run,
+    # with uL_per_rev * (1 - drop_per_rpm * rpm) per revolution and gaussian noise on each reading
+    # a run is followed by its remaining steps while running, so runs must not follow each other between two readings
+    def __init__(self, pumps: list, uL_per_rev: float = 60.0, drop_per_rpm: float = 0.001, density_g_per_mL: float = 1.0, noise_g: float = 0.0005):
+        self.pumps = pumps
+        self.uL_per_rev = uL_per_rev
+        self.drop_per_rpm = drop_per_rpm
+        self.density_g_per_mL = density_g_per_mL
+        self.noise_g = noise_g
+        self._weight_g = 0.0
+        self._runs = [None] * len(pumps) #[start, g per step, target steps, steps weighed] of the run followed, by pump
+
+    def _weigh_steps(self, run: list, remaining_steps: int):
+        steps = run[2] - remaining_steps
+        self._weight_g += (steps - run[3]) * run[1]
+        run[3] = steps
+
+    def read_g(self)->float:
+        for i, pump in enumerate(self.pumps):
+            run = self._runs[i]
+            run_since_ns = pump._m_run_since_ns
+            if not ((run is None) or (run[0] == run_since_ns)): #ended
+                self._weigh_steps(run, pump._motor_steps)
+                self._runs[i] = run = None
+            if (run is None) and not (run_since_ns is None):
+                rpm = pump._step_interval_to_rpm(pump._motor_step_interval)
+                g_per_step = self.uL_per_rev * (1 - self.drop_per_rpm * rpm) * self.density_g_per_mL / 1000 / pump._calc_spr()
+                self._runs[i] = run = [run_since_ns, g_per_step, pump._motor_target_steps, 0]
+            if not (run is None):
+                self._weigh_steps(run, pump._get_m_steps(0))
+        return self._weight_g + random.gauss(0, self.noise_g)
+
+    def close(self):
+        pass
+
+def read_stable_g(balance, tolerance_g: float = 0.002, count: int = 5, interval_s: float = 0.2, timeout_s: float = 30)->float:
+    #mean of the first count consecutive readings within tolerance_g, or of the last ones at timeout
+    readings = []
+    t_end = perf_counter() + timeout_s
+    while perf_counter() < t_end:
+        weight_g = balance.read_g()
+        if not (weight_g is None):
+            readings = (readings + [weight_g])[-count:]
+            if (len(readings) == count) and ((max(readings) - min(readings)) <= tolerance_g):
+                return float(np.mean(readings))
+        sleep(interval_s)
+    logging.warning(f"Balance did not settle within {timeout_s} s, readings: {readings}")
+    return float(np.mean(readings)) if (len(readings) > 0) else None
+
+def measure_run(pump: Pump, balance, rpm: float, revs: float, direction: str, density_g_per_mL: float,
+                poll_interval_s: float = 0.1, settle_s: float = 2.0)->dict:
+    #one run of revs revolutions, weighed before and after, the streamed weights give the flow rate during the run
+    weight_start_g = read_stable_g(balance)
+    if not pump.pump_revs(revs=revs, rpm=rpm, direction=direction, blocking=False):
+        raise ValueError(f"Pump cannot run {revs:.2f} revolutions at {rpm} rpm.")
+    t_start = perf_counter()
+    stream = []
+    while not pump.wait_stopped(poll_interval_s):
+        weight_g = balance.read_g()
+        if not (weight_g is None):
+            stream.append((perf_counter() - t_start, weight_g))
+    sleep(settle_s)
+    weight_end_g = read_stable_g(balance)
+    volume_uL = (weight_end_g - weight_start_g) / density_g_per_mL * 1000
+    flow_rate_uLpersec = None
+    if len(stream) >= 4: #slope without the first and last fifth, i.e. the start and the end of the run
+        t, w = np.array(stream).T
+        middle = slice(len(t) // 5, len(t) - len(t) // 5)
+        flow_rate_uLpersec = float(np.polyfit(t[middle], w[middle], 1)[0] / density_g_per_mL * 1000)
+    return {
+        "rpm": rpm,
+        "direction": direction,
+        "revs": revs,
+        "volume_uL": volume_uL,
+        "uL_per_rev": volume_uL / revs,
+        "flow_rate_uLpersec": flow_rate_uLpersec, #measured while running
+        "stream": stream, #(s since the start, g)
+    }
+
+def fit_curve(runs: list, degree: int = 2)->dict:
+    """
+    Fits uL/rev over rpm per direction, by least squares over all runs (repeats of an rpm included).
+    Returns the calibration_curve of the pump: "rpm" (sorted, distinct), "uL_per_rev_<direction>" as the fitted values at those rpms,
+    and "rms_error_uL_per_rev_<direction>" of the runs around the fit.
+    """
+    rpms = sorted(set(run["rpm"] for run in runs))
+    curve = {"rpm": [float(rpm) for rpm in rpms]}
+    for direction in sorted(set(run["direction"] for run in runs)):
+        x = np.array([run["rpm"] for run in runs if run["direction"] == direction], dtype=np.float64)
+        y = np.array([run["uL_per_rev"] for run in runs if run["direction"] == direction], dtype=np.float64)
+        coef = np.polyfit(x, y, min(degree, len(set(x)) - 1))
+        curve[f"uL_per_rev_{direction}"] = [float(val) for val in np.polyval(coef, rpms)]
+        curve[f"rms_error_uL_per_rev_{direction}"] = float(np.sqrt(np.mean((np.polyval(coef, x) - y) ** 2)))
+    return curve
+
+def calibrate_pump(pump: Pump, balance, rpms: list = None, directions: list = None, duration_s: float = 10, repeats: int = 1,
+                   density_g_per_mL: float = 0.998, degree: int = 2, apply: bool = True)->tuple:
+    """
+    Runs each rpm (default: 5 rpms from 10% to 90% of the max rpm) for about duration_s per direction (default: the default direction), repeats times.
+    Returns the calibration curve (see fit_curve) and the runs (see measure_run).
+    If apply is True, the curve is set to the pump, and calibration_uL_per_Rev to the curve at the middle of the calibrated rpm range.
+    """
+    if rpms is None:
+        rpms = [round(float(rpm), 2) for rpm in np.linspace(0.1, 0.9, 5) * pump.get_max_rpm()]
+    if directions is None:
+        directions = [pump.direction_default]
+    directions = [direction.lower() for direction in directions]
+    runs = []
+    for direction in directions:
+        for _ in range(repeats):
+            for rpm in rpms:
+                run = measure_run(pump, balance, rpm=rpm, revs=rpm / 60 * duration_s, direction=direction, density_g_per_mL=density_g_per_mL)
+                logging.info(f"{direction} {rpm} rpm: {run['uL_per_rev']:.3f} uL/rev")
+                runs.append(run)
+    curve = fit_curve(runs, degree)
+    if apply:
+        pump.calibration_curve = curve
+        rpm_mid = (curve["rpm"][0] + curve["rpm"][-1]) / 2 #middle of the calibrated range, not of the rpm list, as rpms may be spaced unevenly
+        pump.uL_per_rev = pump.get_uL_per_rev(rpm_mid, directions[0])
+    return curve, runs
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Gravimetric calibration of the pumps against a lab balance.")
+    parser.add_argument("--config", default=None, help="pump config file (toml), default is HiPeristaltic.toml")
+    parser.add_argument("--rack", default=None, help="rack config file (toml), used instead of --config")
+    parser.add_argument("--port", default=None, help="serial port of the pumps, overrides the config (single board only)")
+    parser.add_argument("--pumps", type=int, nargs="+", default=[0], help="pump indices to calibrate, one after another")
+    parser.add_argument("--rpms", type=float, nargs="+", default=None, help="rpms to run, default: 5 rpms from 10%% to 90%% of the max rpm")
+    parser.add_argument("--directions", nargs="+", default=None, help="cw and/or ccw, default: the default direction of the pump")
+    parser.add_argument("--duration", type=float, default=10, help="duration of each run (s)")
+    parser.add_argument("--repeats", type=int, default=1, help="runs per rpm")
+    parser.add_argument("--degree", type=int, default=2, help="polynomial degree of the fit")
+    parser.add_argument("--density", type=float, default=0.998, help="density of the liquid (g/mL), water at 20 C by default")
+    parser.add_argument("--balance-port", default=None, help="serial port or pyserial URL of the balance")
+    parser.add_argument("--balance-baudrate", type=int, default=9600)
+    parser.add_argument("--balance-request", default="SI", help="weight request sent to the balance, without the line end")
+    parser.add_argument("--simulate", action="store_true", help="use a simulated balance instead of --balance-port")
+    parser.add_argument("--dry-run", action="store_true", help="do not save the results to the config file")
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.INFO)
+
+    if args.rack is None:
+        driver = HiPeristalticInterface()
+        driver.load_config(args.config)
+        driver.connect(serial_port=args.port)
+    else:
+        try:
+            from .HiPeristalticRack import HiPeristalticRack
+        except ImportError:
+            from HiPeristalticRack import HiPeristalticRack
+        driver = HiPeristalticRack()
+        driver.load_config(args.rack)
+        driver.connect()
+    if args.simulate:
+        balance = SimulatedBalance(driver.pumps, density_g_per_mL=args.density)
+    else:
+        balance = Balance(args.balance_port, args.balance_baudrate, args.balance_request.encode().decode("unicode_escape").encode("latin-1") + b"\r\n")
+    for pump_ind in args.pumps:
+        curve, runs = calibrate_pump(driver.pumps[pump_ind], balance, args.rpms, args.directions, args.duration, args.repeats, args.density, args.degree)
+        print(f"Pump {pump_ind}: {curve}")
+    balance.close()
+    if not args.dry_run:
+        driver.save_config()
@@ -14,23 +14,365 @@
 
 # https://github.com/gunakkoc/HiPeristaltic
 
-from threading import Event, Thread, Lock
+from threading import Event, Thread, Lock, RLock
 from datetime import timedelta
-from time import sleep
+from time import sleep, perf_counter_ns, time_ns
+from collections import deque
+from itertools import count
+from bisect import bisect_left
+import queue
+import atexit
 import numpy as np
 import inspect
+import binascii
+import struct
+import mmap
 import serial
 import logging
 import toml
 import sys
 import os
 
+_FRAME_STRUCTS = { #[cmd][argument] of a message without its checksum by argument type, shorter arguments are zero padded
+    np.uint8: struct.Struct("<BB3x"),
+    np.uint16: struct.Struct("<BH2x"),
+    np.uint32: struct.Struct("<BI"),
+    np.int32: struct.Struct("<Bi"),
+}
+_U16 = struct.Struct("<H")
+_U32 = struct.Struct("<I")
+
+def _xor8(data, n: int)->int:
+    #XOR of the first n (<= 8) bytes, folded within a single integer instead of a per-byte loop
+    x = int.from_bytes(data[:n], "little")
+    x ^= x >> 32
+    x ^= x >> 16
+    x ^= x >> 8
+    return x & 0xFF
+
+def _cobs_encode(data: bytes, delimited: bool = False)->bytearray:
+    #consistent overhead byte stuffing, the result contains no 0x00 (frames shorter than 254 bytes)
+    #each run of non-zero bytes is prefixed with its length + 1, the zero following it is implied
+    #delimited adds the 0x00 before and after the frame
+    out = bytearray(b"\x00") if delimited else bytearray()
+    for run in bytes(data).split(b"\x00"):
+        out.append(len(run) + 1)
+        out += run
+    if delimited:
+        out.append(0)
+    return out
+
+def _cobs_decode(data: bytes)->bytes:
+    #inverse of _cobs_encode without the delimiter, None if malformed
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if (code == 0) or (i + code > len(data)):
+            return None
+        out += data[i+1:i+code]
+        i += code
+        if (code < 0xFF) and (i < len(data)):
+            out.append(0)
+    return bytes(out)
+
+def _perf_ns_to_epoch_s(t_ns: int)->float:
+    #converts a perf_counter_ns() timestamp to wall-clock time (seconds since epoch)
+    return (time_ns() - perf_counter_ns() + t_ns) / 1e9
+
+class PumpEvent():
+    # asynchronous event sent by the MCU, such as the end of a motor task
+    pump_ind: int = 0
+    name: str = "end"
+    mcu_tick: int = None #raw MCU timer tick of the event (tick of the last step pulse), None if not reported
+    step_count: int = None #odometer of the motor (total step pulses since MCU boot, wraps at 2^32), None if not reported
+    host_time: float = 0 #event time as seconds since epoch, estimated from mcu_tick if available, otherwise rx_time
+    rx_time: float = 0 #time at which the message was received, seconds since epoch
+
+    def __init__(self, pump_ind: int, name: str, mcu_tick: int = None, step_count: int = None, host_time: float = None, rx_time: float = None):
+        self.pump_ind = pump_ind
+        self.name = name
+        self.mcu_tick = mcu_tick
+        self.step_count = step_count
+        self.rx_time = rx_time
+        self.host_time = rx_time if host_time is None else host_time
+
+    def __repr__(self):
+        return f"PumpEvent(pump_ind={self.pump_ind}, name={self.name}, mcu_tick={self.mcu_tick}, step_count={self.step_count}, host_time={self.host_time:.6f}, rx_time={self.rx_time:.6f})"
+
+class McuClock():
+    # converts MCU timer ticks to host time
+    # host_ns = offset + (tick - ref_tick) * ns_per_tick, where both offset and ns_per_tick (i.e. drift) are
+    # fitted over a window of (host time, tick) samples. Each sample comes from a get_tick round trip and 
+    # the host time is taken as the middle of the round trip, only the samples with the shortest round trips are used.
+    _TICK_WRAP: int = 1 << 32
+    _MIN_FIT_SPAN_S: float = 2.0 #below this span of samples, only the offset is fitted and the nominal rate is used
+
+    def __init__(self, ticks_per_s: float, window: int = 64, best_fraction: float = 0.5):
+        self._lock = Lock()
+        self._ticks_per_s = float(ticks_per_s)
+        self._ns_per_tick_nominal = 1e9 / self._ticks_per_s
+        self._ns_per_tick = self._ns_per_tick_nominal
+        self._samples = deque(maxlen=window) #(rtt_ns, host_mid_ns, unwrapped tick)
+        self._best_fraction = best_fraction
+        self._last_tick = None #last unwrapped tick of a sample
+        self._ref_tick = 0
+        self._ref_host_ns = 0
+        self.sample_count = 0
+        self.min_rtt_ns = None
+
+    def add_sample(self, host_tx_ns: int, host_rx_ns: int, tick: int)->None:
+        rtt_ns = host_rx_ns - host_tx_ns
+        host_mid_ns = host_tx_ns + (rtt_ns // 2)
+        with self._lock:
+            tick = self._unwrap(int(tick))
+            if (self._last_tick is None) or (tick > self._last_tick):
+                self._last_tick = tick
+            self._samples.append((rtt_ns, host_mid_ns, tick))
+            self.sample_count += 1
+            self._fit()
+
+    def _unwrap(self, tick: int)->int:
+        #extends the 32 bit tick to an unbounded one, valid within +-2^31 ticks of the last sample
+        if self._last_tick is None:
+            return tick
+        delta = (tick - self._last_tick) % self._TICK_WRAP
+        if delta >= (self._TICK_WRAP >> 1):
+            delta -= self._TICK_WRAP
+        return self._last_tick + delta
+
+    def _fit(self):
+        samples = sorted(self._samples)
+        n_best = max(2, int(len(samples) * self._best_fraction))
+        best = samples[:n_best]
+        self.min_rtt_ns = samples[0][0]
+        self._ref_tick = best[0][2]
+        x = np.array([b[2] - self._ref_tick for b in best], dtype=np.float64)
+        y = np.array([b[1] for b in best], dtype=np.float64)
+        if (len(best) >= 2) and ((x.max() - x.min()) / self._ticks_per_s >= self._MIN_FIT_SPAN_S):
+            x_mean = x.mean()
+            y_mean = y.mean()
+            self._ns_per_tick = np.sum((x - x_mean) * (y - y_mean)) / np.sum((x - x_mean) ** 2)
+            self._ref_host_ns = y_mean - self._ns_per_tick * x_mean
+        else:
+            self._ns_per_tick = self._ns_per_tick_nominal
+            self._ref_host_ns = np.mean(y - x * self._ns_per_tick)
+
+    def tick_to_host_ns(self, tick: int)->int:
+        #converts a raw MCU tick to perf_counter_ns() timebase
+        with self._lock:
+            if self._last_tick is None:
+                return None
+            tick = self._unwrap(int(tick))
+            return int(self._ref_host_ns + (tick - self._ref_tick) * self._ns_per_tick)
+
+    def tick_to_time(self, tick: int)->float:
+        #converts a raw MCU tick to wall-clock time, seconds since epoch
+        host_ns = self.tick_to_host_ns(tick)
+        if host_ns is None:
+            return None
+        return _perf_ns_to_epoch_s(host_ns)
+
+    def get_drift_ppm(self)->float:
+        #positive if the MCU clock runs slower than the host clock
+        return (self._ns_per_tick / self._ns_per_tick_nominal - 1) * 1e6
+
+    def get_uncertainty_s(self)->float:
+        #half of the fastest round trip, the bound of the offset error of the best sample
+        if self.min_rtt_ns is None:
+            return None
+        return self.min_rtt_ns / 2e9
+
+_LATENCY_BUCKETS_S = (0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 1.0) #command queue and reply times
+_DEPTH_BUCKETS = (0, 1, 2, 4, 8, 16, 32) #commands ahead of a new command
+
+class Histogram():
+    #fixed buckets for the metrics, observed by one thread at a time (e.g. under the send lock) and read without locking
+    bounds: tuple = ()
+    counts: list = None #per bucket (not cumulative), values up to and including the bound, the last one is above all bounds
+    total: float = 0.0 #sum of the observed values
+
+    def __init__(self, bounds: tuple):
+        self.bounds = bounds
+        self.counts = [0] * (len(bounds) + 1)
+
+    def observe(self, val: float):
+        self.counts[bisect_left(self.bounds, val)] += 1
+        self.total += val
+
+    def get_count(self)->int:
+        return sum(self.counts)
+
+class EventLogHandler(logging.Handler):
+    # keeps log writes (e.g. to an SD card) off the reader thread and the send path
+    # records are queued without blocking and written by a background thread to the handlers of the root logger,
+    # i.e. wherever the application logs. A full queue drops the record, the number of drops is logged once it drains.
+    # structured fields given as extra=_fields(pump=0, cmd=2, ...) are appended to the message as key=value
+    def __init__(self, maxsize: int = 1024):
+        super().__init__()
+        self.queue = queue.Queue(maxsize)
+        self.dropped = 0
+        self._thread = None
+
+    def emit(self, record: logging.LogRecord):
+        #called under the lock of the handler, i.e. one thread at a time
+        if self._thread is None:
+            self._thread = Thread(target=self._writer_thread_func, daemon=True)
+            self._thread.start()
+        try:
+            self.queue.put_nowait(record)
+        except queue.Full:
+            self.dropped += 1
+
+    def _write(self, record: logging.LogRecord):
+        fields = getattr(record, "fields", None)
+        if not (fields is None):
+            record.msg = record.getMessage() + " | " + " ".join(f"{key}={val}" for key, val in fields.items())
+            record.args = None
+        logging.getLogger().handle(record)
+
+    def _writer_thread_func(self):
+        reported = 0
+        while True:
+            self._write(self.queue.get())
+            if (self.dropped > reported) and self.queue.empty():
+                logging.getLogger().warning(f"{self.dropped - reported} log records were dropped, the log writer fell behind.")
+                reported = self.dropped
+
+    def flush(self):
+        #writes what is queued from the calling thread, e.g. at exit
+        while True:
+            try:
+                self._write(self.queue.get_nowait())
+            except queue.Empty:
+                return
+
+def _fields(**fields)->dict:
+    return {"fields": fields}
+
+_log = logging.getLogger("HiPeristaltic")
+if len(_log.handlers) == 0: #once per process, the SiLA server may import a second copy of this module
+    _log.addHandler(EventLogHandler())
+    _log.propagate = False
+    atexit.register(_log.handlers[0].flush)
+event_log: EventLogHandler = _log.handlers[0]
+
+class SerialTrace():
+    # binary record of the frames on the serial link in a memory-mapped ring file, replayed or dumped by TraceReplay.py
+    # the file is a header and fixed size slots, the oldest records are overwritten once the ring is full
+    # slots are ordered by their sequence number, so the file stays readable after a crash of the host process
+    # data of a record is the bytes written for TX, the frame without its delimiters for RX, truncated to DATA_MAX_LEN
+    TX: int = 0
+    RX: int = 1
+    RX_CORRUPT: int = 2 #failed the checksum
+    BAUDRATE: int = 3 #host UART rate changed, data is the new rate (uint32)
+    MAGIC: bytes = b"HPTRACE1"
+    HEADER = struct.Struct("<8sIIqq") #magic, slot length, slot count, perf_counter_ns() and time_ns() at the start
+    HEADER_LEN: int = 64
+    RECORD = struct.Struct("<qIBBB") #ns since the start, sequence number + 1 (0: empty or being written), kind, protocol, data length
+    SLOT_LEN: int = 32
+    DATA_MAX_LEN: int = SLOT_LEN - RECORD.size
+
+    def __init__(self, fpath: str, slot_count: int = 65536):
+        self.fpath = fpath
+        self.slot_count = slot_count
+        self._seq = count() #atomic, the writer and the reader thread record at the same time
+        self._start_ns = perf_counter_ns()
+        with open(fpath, "w+b") as f:
+            f.truncate(self.HEADER_LEN + slot_count * self.SLOT_LEN)
+            self._mm = mmap.mmap(f.fileno(), 0)
+        self.HEADER.pack_into(self._mm, 0, self.MAGIC, self.SLOT_LEN, slot_count, self._start_ns, time_ns())
+
+    def record(self, kind: int, protocol: int, data, t_ns: int = None):
+        if t_ns is None:
+            t_ns = perf_counter_ns()
+        seq = next(self._seq)
+        ofs = self.HEADER_LEN + (seq % self.slot_count) * self.SLOT_LEN
+        n = min(len(data), self.DATA_MAX_LEN)
+        try:
+            self.RECORD.pack_into(self._mm, ofs, t_ns - self._start_ns, 0, kind, protocol, n)
+            self._mm[ofs + self.RECORD.size:ofs + self.RECORD.size + n] = bytes(data[:n])
+            _U32.pack_into(self._mm, ofs + 8, (seq + 1) & 0xFFFFFFFF) #valid once complete
+        except ValueError: #closed meanwhile
+            pass
+
+    def close(self):
+        self._mm.flush()
+        self._mm.close()
+
+    @classmethod
+    def read(cls, fpath: str)->tuple:
+        #start time (seconds since epoch) and the records as (ns since the start, kind, protocol, data), oldest first
+        with open(fpath, "rb") as f:
+            buf = f.read()
+        magic, slot_len, slot_count, start_ns, start_epoch_ns = cls.HEADER.unpack_from(buf, 0)
+        if (magic != cls.MAGIC) or (slot_len != cls.SLOT_LEN):
+            raise ValueError(f"{fpath} is not a serial trace.")
+        records = []
+        for i in range(slot_count):
+            ofs = cls.HEADER_LEN + i * slot_len
+            t_ns, seq, kind, protocol, n = cls.RECORD.unpack_from(buf, ofs)
+            if seq > 0:
+                records.append((seq, t_ns, kind, protocol, buf[ofs + cls.RECORD.size:ofs + cls.RECORD.size + n]))
+        records.sort()
+        return start_epoch_ns / 1e9, [record[1:] for record in records]
+
+class DispensePlan():
+    # finite run chosen by Pump.plan_volume(), run with Pump.pump_plan()
+    # limited_by is the constraint that set the step interval: "max_rpm", "max_flow_rate" (peak of the calibration curve), "flow_rate",
+    # "min_step_interval" or "step_rate_budget"
+    # candidates has one dict per microstep exponent considered, with "rejected" as the reason it could not be used (None if it could)
+    pump_ind: int = 0
+    target_volume_uL: float = 0
+    volume_uL: float = 0 #delivered volume, i.e. target volume rounded to whole steps
+    direction: str = "cw"
+    rpm: float = 0
+    flow_rate_uLpersec: float = 0
+    usteps_exp: int = None #None if the microstepping of the motor is fixed
+    step_interval: int = 0 #in MCU ticks
+    steps: int = 0
+    step_rate: float = 0 #steps/s at full speed
+    resolution_uL: float = 0 #volume of one step
+    accel_rpm_per_s: float = 0 #ramp, 0 for constant rate
+    profile: str = "constant" #"constant", "trapezoid" or "triangle"
+    duration_s: float = 0 #expected, ramps included
+    limited_by: str = None
+    candidates: list = None
+
+    def __init__(self, **fields):
+        for key, val in fields.items():
+            setattr(self, key, val)
+
+    def explain(self)->str:
+        if self.steps == 0:
+            lines = [f"Pump {self.pump_ind}: no microstepping can deliver {self.target_volume_uL:.4g} uL {self.direction}"]
+        else:
+            lines = [f"Pump {self.pump_ind}: {self.volume_uL:.4g} uL ({self.target_volume_uL:.4g} uL requested) {self.direction} in {self.duration_s:.3f} s "
+                     f"at {self.rpm:.4g} rpm ({self.flow_rate_uLpersec:.4g} uL/s), usteps exp {self.usteps_exp}, {self.steps} steps of {self.resolution_uL:.4g} uL, "
+                     f"{self.step_rate:.0f} steps/s, {self.profile} profile, limited by {self.limited_by}"]
+        for c in self.candidates:
+            if c["rejected"] is None:
+                lines.append(f"  usteps exp {c['usteps_exp']}: {c['duration_s']:.3f} s at {c['rpm']:.4g} rpm, {c['step_rate']:.0f} steps/s, "
+                             f"{c['resolution_uL']:.4g} uL/step, limited by {c['limited_by']}")
+            else:
+                lines.append(f"  usteps exp {c['usteps_exp']}: {c['rejected']}")
+        return "\n".join(lines)
+
+    def __repr__(self):
+        return (f"DispensePlan(pump_ind={self.pump_ind}, volume_uL={self.volume_uL}, rpm={self.rpm}, usteps_exp={self.usteps_exp}, "
+                f"steps={self.steps}, duration_s={self.duration_s}, limited_by={self.limited_by})")
+
 class Pump():
 
     ### Public variables
 
     uL_per_rev: float = 60.0 #calibration factor
+    calibration_curve: dict = None #measured uL/rev by rpm, "rpm" and "uL_per_rev_cw" and/or "uL_per_rev_ccw" lists, see HiPeristalticCalibration.py
+                                   #used instead of uL_per_rev if set, replace the dict (instead of modifying it) to change the curve
     direction_default: str = 'CW'
+    last_event: PumpEvent = None #last asynchronous event of the pump, e.g. end of a finite run with its MCU timestamp
+    state_max_age_s: float = 0.1 #default staleness bound of the remaining steps while running, see get_state()
+    volume_resolution_uL: float = None #largest volume of one step accepted by plan_volume(), None for any
 
     ### Constants
     
@@ -50,16 +392,33 @@ class Pump():
     _motor_enabled: bool = False
     _motor_finite_mode: bool = False
     _motor_step_interval: np.uint32 = 2000
+    _curve_src: dict = None #calibration_curve as of _curve_knots
+    _curve_knots: dict = None #(rpms, uL/rev) lists by direction (True: cw), sorted by rpm
+    _CURVE_SOLVE_TOL: float = 1e-12 #relative rpm tolerance of the flow rate to rpm bisection
+    _PLAN_TIE: float = 0.01 #plans within this fraction of the shortest duration are equally fast, the lowest step rate is taken among them
     _motor_usteps: int = 1
     _motor_min_step_interval: np.uint32 = 24 #in ticks
     _motor_max_steps: np.uint32 = np.iinfo(np.uint32).max - 2
     _motor_var_ustep_support: bool = False #variable microstepping support
     _motor_max_ustep_exp: int = 8 #max microstepping, exponent of 2
     _motor_min_ustep_exp: int = 0 #min microstepping, exponent of 2
+    _motor_engine_support: bool = False #hardware pulse engine (timer + DMA) for finite runs, m2 only
+    _motor_engine: bool = False
+    _motor_accel: np.uint32 = 0 #pulse engine ramp in steps/s^2, 0 for constant rate
+    _motor_steps: np.uint32 = 0 #remaining steps, counts down only while running in finite mode
+    _motor_target_steps: np.uint32 = 0
+    _accel_rpm_per_s: float = 0.0 #ramp of finite runs, applied only with the pulse engine
     _min_to_mcu_ticks: np.float64 = 0 #minutes to mcu ticks conversion factor
     _sub_us_divider: np.float64 = 1
     _event_motor_stopped: Event
     _func_pump_send_cmd: callable
+    _STATE_FIELDS: tuple = ("running", "enabled", "dir", "step_interval", "finite_mode", "usteps", "engine", "accel", "steps", "target_steps")
+    _state_time_ns: dict = None #perf_counter_ns() at which each cached field was last known to match the MCU, 0 if unknown
+    _stop_seq: int = 0 #incremented by every stop, a start acked before a stop does not override it
+    _lock_state: Lock #cache updates, never held during a command since the reader thread takes it as well
+    _lock_motor: RLock #command sequences of the pump (start, stop, rate change), one caller at a time
+    _m_run_ns: int = 0 #time spent running before the current run, for the metrics
+    _m_run_since_ns: int = None #start of the current run, None if not running
 
     def __init__(self, motor_ind: int, sub_us_divider: np.float64 = None,
                  uL_per_rev: float = None, gear_ratio: float = None, motor_usteps: int = None, max_rpm: float = None, direction_default: str = None,
@@ -85,6 +444,9 @@ class Pump():
         self._func_pump_send_cmd = func_pump_send_cmd
 
         self._event_motor_stopped = Event()
+        self._state_time_ns = dict.fromkeys(self._STATE_FIELDS, 0)
+        self._lock_state = Lock()
+        self._lock_motor = RLock()
         # self._read_initial_variables() #this is done in the HiPeristalticInterface class
 
     ### Public functions
@@ -97,6 +459,18 @@ class Pump():
             max_rpm_2 = self._step_interval_to_rpm(self._motor_min_step_interval)
         return min(self._max_rpm, max_rpm_2)
     
+    def get_acceleration_rpm_per_s(self)->float:
+        return self._accel_rpm_per_s
+    
+    def set_acceleration_rpm_per_s(self, accel_rpm_per_s: float)->bool:
+        #start and stop ramps of finite runs, 0 for instant start and stop, applied from the next run
+        if accel_rpm_per_s < 0:
+            return False
+        if (accel_rpm_per_s > 0) and (not self._motor_engine_support):
+            return False
+        self._accel_rpm_per_s = float(accel_rpm_per_s)
+        return True
+    
     def get_min_rpm(self)->float:
         if self._motor_var_ustep_support: #assume max microstepping for the slowest speed
             min_rpm = self._step_interval_to_rpm_precise(self._motor_max_step_interval,
@@ -109,57 +483,105 @@ class Pump():
 
     def get_running(self)->bool:
         return self._motor_running
-    
+
+    def wait_stopped(self, timeout_s: float = None)->bool:
+        #waits for the end or a stop of the current run without polling the MCU, False if still running after timeout_s
+        #unlike blocking runs, does not consume the stop, so any number of threads can wait for the same run
+        if not self._motor_running:
+            return True
+        self._event_motor_stopped.wait(timeout_s)
+        return not self._motor_running
+
     def get_flow_rate_uLpersec(self)->float:
         rpm = self._step_interval_to_rpm(self._motor_step_interval)
-        flow_rate_uLpersec = self.rpm_to_flow_rate_uLpersec(rpm)
+        flow_rate_uLpersec = (rpm / 60) * self._uL_per_rev_at(rpm, self._motor_dir)
         return flow_rate_uLpersec
     
     def set_flow_rate_uLpersec(self, flow_rate_uLpersec: float)->bool: #works even while running
-        rpm = self.flow_rate_uLpersec_to_rpm(flow_rate_uLpersec)
+        rpm = self._flow_rate_to_rpm(flow_rate_uLpersec, self._motor_dir)
+        if rpm is None:
+            return False
         return self._motor_change_rpm(rpm)
     
-    def get_remaining_volume_uL(self)->float:
-        return (self._get_m_steps() / self._calc_spr()) * self.uL_per_rev
+    def get_remaining_volume_uL(self, max_age_s: float = None)->float:
+        #max_age_s: see get_state()
+        return (self._get_m_steps(self._state_max_age(max_age_s)) / self._calc_spr()) * self._run_uL_per_rev()
     
-    def get_remaining_time(self)->timedelta:
-        return timedelta(seconds=(self.get_remaining_volume_uL()) / self.get_flow_rate_uLpersec())
+    def get_remaining_time(self, max_age_s: float = None)->timedelta:
+        return timedelta(seconds=(self.get_remaining_volume_uL(max_age_s)) / self.get_flow_rate_uLpersec())
     
-    def get_target_volume_uL(self)->float:
-        return (self._get_m_target_steps() / self._calc_spr()) * self.uL_per_rev
+    def get_target_volume_uL(self, max_age_s: float = None)->float:
+        return (self._get_m_target_steps(self._state_max_age(max_age_s)) / self._calc_spr()) * self._run_uL_per_rev()
     
-    def rpm_to_flow_rate_uLpersec(self, rpm: float)->float:
-        return (rpm / 60) * self.uL_per_rev #one can set calibration uLperRev as 60 uL/rev then rpm = flow_rate(uL/s)
+    def get_state(self, max_age_s: float = None)->dict:
+        """
+        Device state of the pump as cached by the host, kept up to date by the acks of its commands and the events of the MCU.
+        Only the remaining steps change on the MCU on their own (while running in finite mode), they are read from the MCU if
+        older than max_age_s (default: state_max_age_s). Other fields are read only if unknown. max_age_s = 0 reads all fields.
+        Returns the fields and "age_s", the age of each field in seconds.
+        """
+        max_age_s = self._state_max_age(max_age_s)
+        if max_age_s <= 0:
+            self._read_initial_variables()
+        self._get_m_steps(max_age_s)
+        self._get_m_target_steps(max_age_s)
+        with self._lock_state:
+            state = {name: getattr(self, "_motor_" + name) for name in self._STATE_FIELDS}
+            now_ns = perf_counter_ns()
+            state["age_s"] = {name: ((now_ns - t) / 1e9 if t else None) for name, t in self._state_time_ns.items()}
+        return state
     
-    def flow_rate_uLpersec_to_rpm(self, flow_rate_uLpersec: float)->float:
-        return (flow_rate_uLpersec / self.uL_per_rev) * 60
+    def get_uL_per_rev(self, rpm: float = None, direction: str = None)->float:
+        #calibration at rpm in direction (default: direction_default), or at the rpm and direction set on the motor if rpm is None
+        #interpolated in calibration_curve, constant beyond its ends, uL_per_rev without a curve
+        if rpm is None:
+            return self._run_uL_per_rev()
+        return self._uL_per_rev_at(rpm, self._dir_str2bool(direction))
+
+    def rpm_to_flow_rate_uLpersec(self, rpm: float, direction: str = None)->float:
+        return (rpm / 60) * self._uL_per_rev_at(rpm, self._dir_str2bool(direction)) #one can set calibration uLperRev as 60 uL/rev then rpm = flow_rate(uL/s)
+    
+    def flow_rate_uLpersec_to_rpm(self, flow_rate_uLpersec: float, direction: str = None)->float:
+        #None if the calibration curve cannot reach the flow rate below the max rpm
+        return self._flow_rate_to_rpm(flow_rate_uLpersec, self._dir_str2bool(direction))
     
-    def get_max_volume_uL(self)->float:
+    def get_max_volume_uL(self, direction: str = None)->float:
+        #at any rpm, i.e. with the lowest uL/rev of the calibration curve
         if self._motor_var_ustep_support:
             usteps = np.power(2,self._motor_min_ustep_exp) #assume min microstepping for max volume
         else:
             usteps = self._motor_usteps
         calc_spr = self._motor_base_spr * usteps * self._gear_ratio
-        return (self._motor_max_steps / calc_spr) * self.uL_per_rev
+        return (self._motor_max_steps / calc_spr) * min(self._curve_values(self._dir_str2bool(direction)))
     
-    def get_min_volume_uL(self)->float:
+    def get_min_volume_uL(self, direction: str = None)->float:
+        #at any rpm, i.e. with the highest uL/rev of the calibration curve
         if self._motor_var_ustep_support:
             usteps = np.power(2,self._motor_max_ustep_exp) #assume max microstepping for min volume
         else:
             usteps = self._motor_usteps
         calc_spr = self._motor_base_spr * usteps * self._gear_ratio
-        return (1 / calc_spr) * self.uL_per_rev
+        return (1 / calc_spr) * max(self._curve_values(self._dir_str2bool(direction)))
     
-    def get_max_flow_rate_uLpersec(self)->float:
-        return self.rpm_to_flow_rate_uLpersec(self.get_max_rpm())
+    def get_max_flow_rate_uLpersec(self, direction: str = None)->float:
+        #at the peak of the flow rate if the calibration curve has one below the max rpm
+        dir = self._dir_str2bool(direction)
+        rpm = self._curve_peak_rpm(dir, self.get_max_rpm())
+        return (rpm / 60) * self._uL_per_rev_at(rpm, dir)
     
-    def get_min_flow_rate_uLpersec(self)->float:
-        return self.rpm_to_flow_rate_uLpersec(self.get_min_rpm())
+    def get_min_flow_rate_uLpersec(self, direction: str = None)->float:
+        return self.rpm_to_flow_rate_uLpersec(self.get_min_rpm(), direction)
     
     def pump_volume_rpm(self, target_volume_uL: float, rpm: float, direction: str = None, blocking: bool = False)->bool:
         if target_volume_uL <= 0:
             return False
-        revs = target_volume_uL / self.uL_per_rev #number of revolutions
+        revs = target_volume_uL / self._uL_per_rev_at(rpm, self._dir_str2bool(direction)) #number of revolutions
+        return self.pump_revs(revs=revs,rpm=rpm,direction=direction,blocking=blocking)
+
+    def pump_revs(self, revs: float, rpm: float, direction: str = None, blocking: bool = False)->bool:
+        #independent of the calibration, e.g. to calibrate
+        if revs <= 0:
+            return False
         max_revs = self._motor_max_steps / self._calc_spr()
         if revs >= max_revs:
             return False
@@ -174,10 +596,107 @@ class Pump():
         return result
 
     def pump_volume(self, target_volume_uL: float, flow_rate_uLpersec: float, direction: str = None, blocking: bool = False)->bool:
-        rpm = (flow_rate_uLpersec / self.uL_per_rev) * 60 #revolutions per minute
+        rpm = self.flow_rate_uLpersec_to_rpm(flow_rate_uLpersec, direction) #revolutions per minute
+        if rpm is None:
+            return False
         result = self.pump_volume_rpm(target_volume_uL=target_volume_uL,rpm=rpm,direction=direction,blocking=blocking)
         return result
 
+    def plan_volume(self, target_volume_uL: float, flow_rate_uLpersec: float = None, direction: str = None,
+                    resolution_uL: float = None, step_rate_limit: float = None)->DispensePlan:
+        """
+        Picks the microstep exponent and rpm that deliver target_volume_uL in the shortest time, ramps of the pulse engine included.
+        The rpm is at most the max rpm, and the rpm of flow_rate_uLpersec if given. A step is at most resolution_uL
+        (default: volume_resolution_uL), and the step rate at most step_rate_limit steps/s unless the pulse engine steps the motor,
+        see HiPeristalticInterface.plan_dispense(). Equally fast exponents (see _PLAN_TIE) are settled by the lowest step rate.
+        If no exponent can deliver the volume, steps of the plan is 0 and its candidates tell why, see DispensePlan.explain().
+        """
+        dir = self._dir_str2bool(direction)
+        if resolution_uL is None:
+            resolution_uL = self.volume_resolution_uL
+        ticks_per_s = self._min_to_mcu_ticks / 60
+        rpm_cap, rpm_limit = self._max_rpm, "max_rpm"
+        rpm_peak = self._curve_peak_rpm(dir, self._max_rpm)
+        if rpm_peak < rpm_cap: #faster runs deliver less
+            rpm_cap, rpm_limit = rpm_peak, "max_flow_rate"
+        if not (flow_rate_uLpersec is None):
+            rpm_flow = self._flow_rate_to_rpm(flow_rate_uLpersec, dir) #None above the max flow rate
+            if not (rpm_flow is None) and (rpm_flow < rpm_cap):
+                rpm_cap, rpm_limit = rpm_flow, "flow_rate"
+        accel = self._accel_rpm_per_s if self._motor_engine_support else 0.0
+        if self._motor_var_ustep_support:
+            ustep_exps = range(self._motor_min_ustep_exp, self._motor_max_ustep_exp+1)
+        else:
+            ustep_exps = [None]
+        candidates = []
+        for ustep_exp in ustep_exps:
+            c = {"usteps_exp": ustep_exp, "rejected": None}
+            candidates.append(c)
+            spr = self._calc_spr() if (ustep_exp is None) else self._motor_base_spr * np.power(2,ustep_exp) * self._gear_ratio
+            #the longest of the shortest step intervals allowed by each constraint
+            limits = [(int(np.ceil(self._min_to_mcu_ticks / (rpm_cap * spr))), rpm_limit),
+                      (int(np.ceil(self._motor_min_step_interval)), "min_step_interval")]
+            if not ((step_rate_limit is None) or self._motor_engine_support):
+                if step_rate_limit <= 0:
+                    c["rejected"] = "no step rate left in the step rate budget"
+                    continue
+                limits.append((int(np.ceil(ticks_per_s / step_rate_limit)), "step_rate_budget"))
+            step_interval, limited_by = max(limits, key=lambda limit: limit[0])
+            if self._step_interval_to_rpm_precise(step_interval,spr) >= self._max_rpm: #the max rpm itself is excluded
+                step_interval += 1
+            if step_interval > self._motor_max_step_interval:
+                c["rejected"] = "slower than the longest step interval"
+                continue
+            rpm = float(self._step_interval_to_rpm_precise(step_interval,spr))
+            step_uL = self._uL_per_rev_at(rpm, dir) / spr
+            steps = int(np.round(target_volume_uL / step_uL))
+            step_rate = ticks_per_s / step_interval
+            c.update(rpm=rpm, step_interval=step_interval, steps=steps, step_rate=step_rate, resolution_uL=step_uL, limited_by=limited_by)
+            if not ((resolution_uL is None) or (step_uL <= resolution_uL)):
+                c["rejected"] = f"steps of {step_uL:.4g} uL are coarser than the resolution of {resolution_uL:.4g} uL"
+                continue
+            if steps < 1:
+                c["rejected"] = "less than one step"
+                continue
+            if steps > self._motor_max_steps:
+                c["rejected"] = "more steps than the motor can count"
+                continue
+            #trapezoidal ramp of the pulse engine (both ramps v^2/2a steps long), triangular if the run is too short to reach full speed
+            accel_steps = accel / 60 * spr
+            if accel_steps <= 0:
+                c["profile"], c["duration_s"] = "constant", steps / step_rate
+            elif step_rate * step_rate / accel_steps <= steps:
+                c["profile"], c["duration_s"] = "trapezoid", steps / step_rate + step_rate / accel_steps
+            else:
+                c["profile"], c["duration_s"] = "triangle", 2 * np.sqrt(steps / accel_steps)
+        usable = [c for c in candidates if c["rejected"] is None]
+        plan = DispensePlan(pump_ind=self._motor_ind, target_volume_uL=target_volume_uL, direction="cw" if dir else "ccw",
+                            accel_rpm_per_s=accel, candidates=candidates)
+        if len(usable) == 0:
+            return plan
+        fastest_s = min(c["duration_s"] for c in usable)
+        best = min((c for c in usable if c["duration_s"] <= fastest_s * (1 + self._PLAN_TIE)), key=lambda c: c["step_rate"])
+        plan.rpm = best["rpm"]
+        plan.usteps_exp = best["usteps_exp"]
+        plan.step_interval = best["step_interval"]
+        plan.steps = best["steps"]
+        plan.step_rate = best["step_rate"]
+        plan.resolution_uL = best["resolution_uL"]
+        plan.volume_uL = best["steps"] * best["resolution_uL"]
+        plan.flow_rate_uLpersec = best["step_rate"] * best["resolution_uL"]
+        plan.profile = best["profile"]
+        plan.duration_s = float(best["duration_s"])
+        plan.limited_by = best["limited_by"]
+        return plan
+
+    def pump_plan(self, plan: DispensePlan, blocking: bool = False)->bool:
+        #runs a plan of this pump, with its microstepping instead of the one picked by pump_volume()
+        if (plan is None) or (plan.pump_ind != self._motor_ind) or (plan.steps <= 0):
+            return False
+        spr = self._calc_spr() if (plan.usteps_exp is None) else self._motor_base_spr * np.power(2,plan.usteps_exp) * self._gear_ratio
+        return self._motor_start_finite(rpm=plan.rpm,dir=self._dir_str2bool(plan.direction),revs=plan.steps / spr,
+                                        blocking=blocking,ustep_exp=plan.usteps_exp)
+
     def pump_timedelta(self, duration: timedelta, flow_rate_uLpersec: float, direction: str = None, blocking: bool = False)->bool:
         if duration.total_seconds() <= 0:
             return False
@@ -187,7 +706,7 @@ class Pump():
     def pump_timedelta_rpm(self, duration: timedelta, rpm: float, direction: str = None, blocking: bool = False)->bool:
         if duration.total_seconds() <= 0:
             return False
-        vol_uL = (rpm / 60) * self.uL_per_rev * duration.total_seconds()
+        vol_uL = self.rpm_to_flow_rate_uLpersec(rpm, direction) * duration.total_seconds()
         return self.pump_volume_rpm(target_volume_uL=vol_uL,rpm=rpm,direction=direction,blocking=blocking)
     
     def pump_duration(self, duration_sec: float, flow_rate_uLpersec: float, direction: str = None, blocking: bool = False)->bool:
@@ -199,7 +718,7 @@ class Pump():
     def pump_duration_rpm(self, duration_sec: float, rpm: float, direction: str = None, blocking: bool = False)->bool:
         if duration_sec <= 0:
             return False
-        vol_uL = (rpm / 60) * self.uL_per_rev * duration_sec
+        vol_uL = self.rpm_to_flow_rate_uLpersec(rpm, direction) * duration_sec
         return self.pump_volume_rpm(target_volume_uL=vol_uL,rpm=rpm,direction=direction,blocking=blocking)
     
     def pump_continuous_rpm(self, rpm: float, direction: str)->bool:
@@ -214,7 +733,9 @@ class Pump():
         return result
 
     def pump_continuous(self, flow_rate_uLpersec: float, direction: str)->bool:
-        rpm = (flow_rate_uLpersec / self.uL_per_rev) * 60 #revolutions per minute
+        rpm = self.flow_rate_uLpersec_to_rpm(flow_rate_uLpersec, direction) #revolutions per minute
+        if rpm is None:
+            return False
         result = self.pump_continuous_rpm(rpm=rpm,direction=direction)
         return result
     
@@ -241,6 +762,10 @@ class Pump():
         return np.uint32(np.round(self._min_to_mcu_ticks / (rpm * self._calc_spr())))
     
     def _motor_change_rpm(self, rpm: float)->bool:
+        with self._lock_motor:
+            return self._motor_change_rpm_locked(rpm)
+
+    def _motor_change_rpm_locked(self, rpm: float)->bool:
         if rpm < 0:
             return False
         if rpm >= self._max_rpm:
@@ -288,8 +813,13 @@ class Pump():
         return True
 
     def _motor_start_continuous(self,rpm,dir=True):
+        with self._lock_motor:
+            return self._motor_start_continuous_locked(rpm,dir)
+
+    def _motor_start_continuous_locked(self,rpm,dir):
         if self._motor_running:
             return False
+        stop_seq = self._stop_seq
         if rpm <= 0:
             return False
         if rpm >= self._max_rpm:
@@ -311,17 +841,30 @@ class Pump():
         self._set_m_finite_mode(0) #0 for continuous mode, 1 for finite steps
         self._set_m_step_interval(step_interval)
         self._set_m_steps(1) #any value > 0
-        self._set_m_running(True)
-        return True
+        if self._stop_seq != stop_seq: #stop_all meanwhile
+            return False
+        return self._set_m_running(True)
     
-    def _motor_start_finite(self,rpm,dir,revs,blocking=True):
+    def _motor_start_finite(self,rpm,dir,revs,blocking=True,ustep_exp=None):
+        with self._lock_motor:
+            result = self._motor_start_finite_locked(rpm,dir,revs,ustep_exp)
+        if result and blocking:
+            self._event_motor_stopped.wait()
+            self._event_motor_stopped.clear()
+        return result
+
+    def _motor_start_finite_locked(self,rpm,dir,revs,ustep_exp=None):
+        #ustep_exp overrides the microstepping picked for the rpm, e.g. of a DispensePlan
         if self._motor_running:
             return False
+        stop_seq = self._stop_seq
         if rpm <= 0:
             return False
         if rpm >= self._max_rpm:
             return False
-        if self._motor_var_ustep_support:
+        if self._motor_var_ustep_support and not (ustep_exp is None):
+            self._set_m_usteps_exp(ustep_exp)
+        elif self._motor_var_ustep_support:
             optimal_ustep_exp = self._calc_finite_optimal_usteps_exp(base_spr=self._motor_base_spr,gear_ratio=self._gear_ratio,rpm=rpm,revs=revs)
             if optimal_ustep_exp < 0: #even with min ustep, max number of steps is exceeded or step delay out of range
                 return False
@@ -341,19 +884,21 @@ class Pump():
         self._set_m_finite_mode(1) #0 for continuous mode, 1 for finite steps
         self._set_m_step_interval(step_interval)
         self._set_m_steps(step_count)
-        self._set_m_running(True)
-
-        if blocking:
-            self._event_motor_stopped.wait()
-            self._event_motor_stopped.clear()
-        return True
+        if self._motor_engine_support:
+            self._set_m_engine(True)
+            self._set_m_accel(min(np.round(self._accel_rpm_per_s / 60 * spr), np.iinfo(np.uint32).max))
+        if self._stop_seq != stop_seq: #stop_all meanwhile
+            return False
+        return self._set_m_running(True)
     
     def _motor_stop(self):
-        self._set_m_running(False)
+        with self._lock_motor:
+            self._set_m_running(False)
         return True
     
     def _motor_resume(self, blocking=False):
-        self._set_m_running(True)
+        with self._lock_motor:
+            self._set_m_running(True)
         if blocking and (self._motor_finite_mode == 1):
             self._event_motor_stopped.wait()
             self._event_motor_stopped.clear()
@@ -417,20 +962,96 @@ class Pump():
         self._get_m_step_interval()
         self._get_m_finite_mode()
         self._get_m_usteps_exp()
+        self._get_m_engine()
+        if self._motor_engine_support:
+            self._get_m_accel()
+    
+    def _apply_state(self, words: list, time_ns: int = None, stop_seq: int = None):
+        #same as _read_initial_variables, from the words of this motor in the get_state response
+        #flags, step interval, steps, target steps, accel
+        #running and steps are skipped if the pump stopped since stop_seq, i.e. the state was read before its end event
+        flags = words[0]
+        self._motor_var_ustep_support = bool(flags & 8)
+        self._motor_engine_support = bool(flags & 16)
+        self._state_update(time_ns, enabled=bool(flags & 2), dir=bool(flags & 4) != bool(self._motor_dir_inverse),
+                           step_interval=words[1], finite_mode=(flags >> 8) & 0xFF, usteps=np.power(2,np.uint32((flags >> 16) & 0xFF)),
+                           engine=bool(flags & 32), accel=words[4], target_steps=words[3])
+        self._state_update(time_ns, stop_seq, running=bool(flags & 1), steps=words[2])
+    
+    ### Device state cache
+
+    def _state_update(self, time_ns: int = None, stop_seq: int = None, **fields):
+        #sets cached fields at once, e.g. state_update(running=True), time_ns is when the values were valid on the MCU
+        #with stop_seq (_stop_seq before the read), values read before a stop that was processed meanwhile are dropped
+        if time_ns is None:
+            time_ns = perf_counter_ns()
+        with self._lock_state:
+            if not ((stop_seq is None) or (stop_seq == self._stop_seq)):
+                return
+            if ("running" in fields) and (bool(fields["running"]) != (not (self._m_run_since_ns is None))):
+                if fields["running"]:
+                    self._m_run_since_ns = time_ns
+                else:
+                    self._m_run_ns += max(time_ns - self._m_run_since_ns, 0)
+                    self._m_run_since_ns = None
+            for name, val in fields.items():
+                setattr(self, "_motor_" + name, val)
+                self._state_time_ns[name] = time_ns
+
+    def get_running_s(self)->float:
+        #total running time since connecting, e.g. for the duty cycle
+        with self._lock_state:
+            run_ns = self._m_run_ns if (self._m_run_since_ns is None) else self._m_run_ns + perf_counter_ns() - self._m_run_since_ns
+        return run_ns / 1e9
+
+    def _state_invalidate(self, *names):
+        with self._lock_state:
+            for name in names:
+                self._state_time_ns[name] = 0
+
+    def _state_fresh(self, name: str, max_age_s: float)->bool:
+        #unknown fields and max_age_s <= 0 are never fresh, steps age only while they count down
+        t = self._state_time_ns[name]
+        if (t == 0) or (max_age_s <= 0):
+            return False
+        if (name == "steps") and self._motor_running and self._motor_finite_mode:
+            return (perf_counter_ns() - t) <= (max_age_s * 1e9)
+        return True
+
+    def _state_max_age(self, max_age_s: float = None)->float:
+        return self.state_max_age_s if (max_age_s is None) else max_age_s
     
     ### Signals from the MCU (i.e., end of motor task)
     
-    def _signal_m_stopped(self)->bool:
+    def _signal_m_stopped(self, event: PumpEvent = None)->bool:
         #called by the HiPeristalticInterface class, pointed per Pump class after initalization
-        self._motor_running = False
+        #a finite run ends with all its steps done
+        if not (event is None):
+            self.last_event = event
+        with self._lock_state:
+            self._stop_seq += 1
+        self._state_update(running=False, steps=0)
+        self._event_motor_stopped.set()
+        return True
+    
+    def _signal_m_halted(self, event: PumpEvent = None, disabled: bool = False)->bool:
+        #stopped by stop_all of the HiPeristalticInterface class, somewhere before the end of its run
+        if not (event is None):
+            self.last_event = event
+        self._state_update(running=False)
+        if disabled:
+            self._state_update(enabled=False)
+        self._state_invalidate("steps")
         self._event_motor_stopped.set()
         return True
     
     ### Parameters below are to be in sync with MCU
 
     def _get_m_running(self)->bool:
+        stop_seq = self._stop_seq
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3])
-        self._motor_running = bool(result)
+        if not (result is None):
+            self._state_update(None, stop_seq, running=bool(result))
         return result
 
     def _set_m_running(self, val)->bool:
@@ -438,16 +1059,23 @@ class Pump():
             return True
         if bool(val):
             self._event_motor_stopped.clear()
-        else:
-            self._event_motor_stopped.set()
+        stop_seq = self._stop_seq
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3], val=val)
-        if result:
-            self._motor_running = bool(val)
+        if result and bool(val):
+            self._state_update(None, stop_seq, running=True) #dropped if the run already ended, its end event may follow the ack at once
+        elif result:
+            with self._lock_state:
+                self._stop_seq += 1
+            self._state_update(running=False)
+            self._state_invalidate("steps") #stopped somewhere in between
+        if not bool(val): #after the state, waiters see the pump stopped
+            self._event_motor_stopped.set()
         return result
     
     def _get_m_enabled(self)->bool:
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3])
-        self._motor_enabled = bool(result)
+        if not (result is None):
+            self._state_update(enabled=bool(result))
         return result
 
     def _set_m_enabled(self, val)->bool:
@@ -455,31 +1083,34 @@ class Pump():
             return True
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3], val=val)
         if result:
-            self._motor_enabled = bool(val)
+            self._state_update(enabled=bool(val))
         if self._motor_enabled == False:
             self._motor_stop()
         return result
     
     def _get_m_dir(self)->bool:
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3])
+        if result is None:
+            return result
         if self._motor_dir_inverse:
             result = not bool(result)
-        self._motor_dir = bool(result)
+        self._state_update(dir=bool(result))
         return result
 
     def _set_m_dir(self, val)->bool:
+        #val and the cache are the direction of the pump, the MCU gets the pin state
         if bool(val) == bool(self._motor_dir):
             return True
-        if self._motor_dir_inverse:
-            val = not bool(val)
-        result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3], val=val)
+        pin_state = (not bool(val)) if self._motor_dir_inverse else val
+        result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3], val=pin_state)
         if result:
-            self._motor_dir = val
+            self._state_update(dir=bool(val))
         return result
     
     def _get_m_step_interval(self)->np.uint32:
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3])
-        self._motor_step_interval = result
+        if not (result is None):
+            self._state_update(step_interval=result)
         return result
     
     def _set_m_step_interval(self, val)->bool:
@@ -487,12 +1118,13 @@ class Pump():
             return True
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3], val=val)
         if result:
-            self._motor_step_interval = val
+            self._state_update(step_interval=val)
         return result
     
     def _get_m_finite_mode(self)->np.uint8:
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3])
-        self._motor_finite_mode = result
+        if not (result is None):
+            self._state_update(finite_mode=result)
         return result
 
     def _set_m_finite_mode(self, val)->bool:
@@ -501,7 +1133,7 @@ class Pump():
             return True
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3], val=val)
         if result:
-            self._motor_finite_mode = val
+            self._state_update(finite_mode=val)
         return result
     
     def _get_m_var_ustep_support(self)->bool: #variable microstepping support
@@ -511,7 +1143,8 @@ class Pump():
     
     def _get_m_usteps_exp(self)->np.uint8: #microstepping exponent of 2
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3])
-        self._motor_usteps = np.power(2,np.uint32(result))
+        if not (result is None):
+            self._state_update(usteps=np.power(2,np.uint32(result)))
         return result
     
     def _set_m_usteps_exp(self,val)->bool: #microstepping exponent of 2
@@ -521,25 +1154,70 @@ class Pump():
             return True
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3], val=val)
         if result:
-            self._motor_usteps = np.power(2,np.uint32(val))
+            self._state_update(usteps=np.power(2,np.uint32(val)))
+        return result
+    
+    def _get_m_engine(self)->np.uint8:
+        #None from firmwares without the pulse engine, False for motors without a command
+        result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3])
+        self._motor_engine_support = not ((result is None) or (result is False))
+        self._state_update(engine=self._motor_engine_support and bool(result))
+        return result
+    
+    def _set_m_engine(self, val)->bool:
+        if not self._motor_engine_support:
+            return False
+        if bool(val) == bool(self._motor_engine):
+            return True
+        result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3], val=val)
+        if result:
+            self._state_update(engine=bool(val))
+        return result
+    
+    def _get_m_accel(self)->np.uint32:
+        result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3])
+        if not (result is None):
+            self._state_update(accel=result)
+        return result
+    
+    def _set_m_accel(self, val)->bool:
+        if np.uint32(val) == np.uint32(self._motor_accel):
+            return True
+        result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3], val=val)
+        if result:
+            self._state_update(accel=val)
         return result
     
-    ### Parameters below are not to be in sync with MCU
+    ### Parameters below change on the MCU while running, served from the cache within max_age_s (0 always reads)
 
-    def _get_m_steps(self)->np.uint32:
+    def _get_m_steps(self, max_age_s: float = 0)->np.uint32:
+        if self._state_fresh("steps", max_age_s):
+            return self._motor_steps
+        time_ns = perf_counter_ns() #the reply is at least this recent
+        stop_seq = self._stop_seq
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3])
+        if not (result is None):
+            self._state_update(time_ns, stop_seq, steps=result)
         return result
     
     def _set_m_steps(self, val)->bool:
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3], val=val)
+        if result: #the MCU sets the target as well
+            self._state_update(steps=val, target_steps=val)
         return result
 
-    def _get_m_target_steps(self)->np.uint32:
+    def _get_m_target_steps(self, max_age_s: float = 0)->np.uint32:
+        if self._state_fresh("target_steps", max_age_s):
+            return self._motor_target_steps
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3])
+        if not (result is None):
+            self._state_update(target_steps=result)
         return result
     
     def _set_m_target_steps(self, val)->bool:
         result = self._pump_send_cmd(fnc_name=inspect.stack()[0][3], val=val)
+        if result:
+            self._state_update(target_steps=val)
         return result
     
     ### Private pump functions
@@ -573,10 +1251,79 @@ class Pump():
             return True
 
     def _volume_uL_to_revs(self, volume_uL: float)->float:
-        return volume_uL / self.uL_per_rev
+        return volume_uL / self._run_uL_per_rev()
 
     def _revs_to_volume_uL(self, revs: float)->float:
-        return revs * self.uL_per_rev
+        return revs * self._run_uL_per_rev()
+
+    def _curve_values(self, dir: bool)->list:
+        #uL/rev of the calibration curve in the direction, [uL_per_rev] without a curve
+        curve = self.calibration_curve
+        if curve is None:
+            return [self.uL_per_rev]
+        if not (self._curve_src is curve):
+            rpms = [float(rpm) for rpm in curve["rpm"]]
+            vals_cw = curve.get("uL_per_rev_cw", curve.get("uL_per_rev_ccw")) #a direction without its own curve uses the other one
+            vals_ccw = curve.get("uL_per_rev_ccw", vals_cw)
+            order = sorted(range(len(rpms)), key=rpms.__getitem__)
+            self._curve_knots = {
+                True: ([rpms[i] for i in order], [float(vals_cw[i]) for i in order]),
+                False: ([rpms[i] for i in order], [float(vals_ccw[i]) for i in order]),
+            }
+            self._curve_src = curve
+        return self._curve_knots[bool(dir)][1]
+
+    def _uL_per_rev_at(self, rpm: float, dir: bool)->float:
+        #linear interpolation between the knots of the calibration curve, constant beyond its ends
+        vals = self._curve_values(dir)
+        if len(vals) == 1:
+            return vals[0]
+        rpms = self._curve_knots[bool(dir)][0]
+        i = bisect_left(rpms, rpm)
+        if i == 0:
+            return vals[0]
+        if i == len(rpms):
+            return vals[-1]
+        return vals[i - 1] + (rpm - rpms[i - 1]) * (vals[i] - vals[i - 1]) / (rpms[i] - rpms[i - 1])
+
+    def _run_uL_per_rev(self)->float:
+        #at the rpm and in the direction set on the motor
+        if (self.calibration_curve is None) or (self._motor_step_interval <= 0):
+            return self.uL_per_rev
+        return self._uL_per_rev_at(self._step_interval_to_rpm(self._motor_step_interval), self._motor_dir)
+
+    def _curve_peak_rpm(self, dir: bool, rpm_max: float)->float:
+        #end of the rising part of rpm * uL/rev(rpm) from 0 rpm, rpm_max if it rises up to there
+        #uL/rev is constant outside the knots and linear between them, so the flow rate peaks only at the vertex of a segment falling steeply enough
+        vals = self._curve_values(dir)
+        if len(vals) == 1:
+            return rpm_max
+        rpms = self._curve_knots[bool(dir)][0]
+        for i in range(1, len(rpms)):
+            if rpms[i - 1] >= rpm_max:
+                break
+            slope = (vals[i] - vals[i - 1]) / (rpms[i] - rpms[i - 1])
+            if slope < 0: #flow rate ~ rpm * (intercept + slope * rpm), vertex at -intercept / (2 * slope)
+                rpm_vertex = -(vals[i - 1] - slope * rpms[i - 1]) / (2 * slope)
+                if rpm_vertex < rpms[i]:
+                    return min(max(rpm_vertex, rpms[i - 1]), rpm_max)
+        return rpm_max
+
+    def _flow_rate_to_rpm(self, flow_rate_uLpersec: float, dir: bool)->float:
+        #bisection over the rising part of the flow rate (see _curve_peak_rpm) up to the max rpm, None if the flow rate is not reached there
+        if self.calibration_curve is None:
+            return (flow_rate_uLpersec / self.uL_per_rev) * 60
+        lo = 0.0
+        hi = self._curve_peak_rpm(dir, self._max_rpm)
+        if (hi / 60) * self._uL_per_rev_at(hi, dir) < flow_rate_uLpersec:
+            return None
+        while (hi - lo) > self._CURVE_SOLVE_TOL * hi:
+            mid = 0.5 * (lo + hi)
+            if (mid / 60) * self._uL_per_rev_at(mid, dir) < flow_rate_uLpersec:
+                lo = mid
+            else:
+                hi = mid
+        return 0.5 * (lo + hi)
     
     def _pump_send_cmd(self, fnc_name:str, val=None)->bool:
         #_m_ serves as a wildcard for motor index, replaced with _m0_, _m1_, _m2_ etc.
@@ -592,12 +1339,14 @@ class HiPeristalticInterface():
     pump_count: int = 4
     pumps: list[Pump] = []
     config: dict = None
+    step_rate_budget: float = None #steps/s of all software-stepped pumps together, None for no limit, see measure_step_rate_budget()
 
     ### Private variables
     _serial_com: serial.Serial = None
     _serial_port: str = "COM13"
-    _serial_baudrate: int = 115200
+    _serial_baudrate: int = 115200 #ceiling, the UART link starts at _UART_BOOT_BAUDRATE and is raised up to this
     _serial_inter_byte_timeout_s: float = 0.5 #seconds
+    _serial_low_latency: bool = True #Linux low latency settings of the serial port, where available
     _rx_buffer: bytearray
     _tx_buffer: bytearray
     _lock_send: Lock
@@ -609,11 +1358,57 @@ class HiPeristalticInterface():
     _thread_msg_rcv: Thread = None
     _rx_error_cnt: int = 0
     _rx_total_error_cnt: int = 0
+    _rx_time_ns: int = 0 #perf_counter_ns() at which the last message was read
     _last_config_fpath: str = None
+    _pending_reply: str = None #"get", "set", "bulk" or "stop" while a command waits for its reply
+
+    ### Metrics, see HiPeristalticMetrics.py, plain counters each written by one thread at a time (send lock holder or reader thread)
+    _CMD_KINDS: tuple = ("set", "get", "bulk", "stop")
+    _m_queue_s: dict = None #Histogram of the wait for the send lock, by command kind
+    _m_reply_s: dict = None #Histogram from writing the command to its reply (or failure), by command kind
+    _m_failed: dict = None #commands without a valid reply (error reply, corrupted reply or timeout), by command kind
+    _m_queue_depth: Histogram = None #commands ahead of each command, including the one in progress
+    _m_tickets = None #drawn by each command before waiting for the send lock (itertools.count, atomic)
+    _m_cmd_done: int = 0
+    _m_tx_frames: int = 0
+    _m_rx_frames: int = 0
+    _m_reply_timeouts: int = 0
+    _m_mcu_rx_errors: int = 0 #frames that reached the MCU corrupted (checksum error replies)
+    _lock_write: RLock #whole frames to the port, shared by the normal and the priority path
+    _stop_all_support: bool = False
+    _stop_all_pending: deque = None #(pump mask, disable, Event) of the stop_all frames sent, in order, until confirmed
+    _STOP_ALL_MAGIC: int = 0x5AA5 #bytes 2-3 of the stop_all argument, lets the MCU find the frame ahead of the others
+    _stop_all_timeout_s: float = 0.1 #stop_all fails if not confirmed within this time
+    _bulk_cmd_ind: int = None #command index of the pending multi-frame response
+    _bulk_len: int = None #number of words of the pending multi-frame response, None until its first frame
+    _bulk_words: list = None
+    _cmd_failed: bool = False #set if the MCU replied to the pending command with an error
+    _reply_timeout_s: float = 2.0 #a pending command fails if the MCU stays silent this long
+    _conn_probe_interval_s: float = 0.05 #the MCU is probed this often at connection until it replies
+    _conn_drain_timeout_s: float = 0.02 #replies to earlier probes are discarded until the link is silent this long
+    _protocol: int = 1 #framing in use, 1: fixed 6 byte frames with XOR checksum, 2: COBS frames with CRC-16
+    _protocol_version: int = 2 #framing requested at connection, firmwares without v2 stay at v1
+    _UART_BOOT_BAUDRATE: int = 115200 #rate of the MCU after reset
+    _UART_BAUDRATES: list = [4000000, 3000000, 2000000, 1000000, 921600, 460800, 230400] #tried from the fastest
+    _UART_BAUD_CONFIRM_TIMEOUT_S: float = 1.0 #the MCU falls back to the previous rate unless confirmed within this time
+    _LINK_TEST_PATTERNS: list = [0x55AA55AA, 0x00FF00FF, 0xFFFFFFFF, 0x00000000, 0x0F1E2D3C, 0xC3A5F00F]
+    _tx_holdoff_ns: int = 0 #v1 only, no message is sent before this perf_counter_ns() after a checksum error
+    _trace: SerialTrace = None #frames on the link while a trace is recorded, see start_trace()
+
+    mcu_clock: McuClock = None #MCU tick to host time conversion, None if the firmware does not report ticks
+    event_history: deque = None #last asynchronous events of all pumps, oldest first
+    _mcu_tick_support: bool = False
+    _ext_events_support: bool = False
+    _clock_sync_interval_s: float = 1.0 #must be well below 2^31 MCU ticks (134 s with 16 ticks/us)
+    _thread_clock_sync: Thread = None
+    _pending_end_steps: dict = None #step counts received ahead of the end signals, by motor index
+    _event_listeners: list = None
 
     _sub_us_divider: np.float64 = 1
 
     _MSG_LEN: int = 6 #number of bytes in a message
+    _FRAME_MAX_LEN: int = 64 #v2 frames longer than this are junk
+    _PROTOCOL_RESET_FRAME: bytes = bytes([78, 1, 0, 0, 0, 78 ^ 1]) #v1 set_protocol(1), recognized by the MCU in v2 as well
     _ARG_LEN: int = 4 #number of bytes of an argument in a message
 
     _rcv_msg_table:dict[np.uint8,callable] = {}
@@ -696,6 +1491,27 @@ class HiPeristalticInterface():
     _cmd_map['get_m3_usteps_exp'] = CommandStructure(cmd_ind=66, var_type=np.uint8)
     _cmd_map['set_m3_usteps_exp'] = CommandStructure(cmd_ind=67, var_type=np.uint8)
     _cmd_map['get_sub_us_divider'] = CommandStructure(cmd_ind=68, var_type=np.uint32)
+    _cmd_map['get_tick'] = CommandStructure(cmd_ind=69, var_type=np.uint32)
+    _cmd_map['set_ext_events'] = CommandStructure(cmd_ind=70, var_type=np.uint8)
+    _cmd_map['get_stats'] = CommandStructure(cmd_ind=71, var_type=np.uint8) #multi-frame response, arg bit 0 resets the counters
+    _cmd_map['set_capture'] = CommandStructure(cmd_ind=72, var_type=np.uint32) #byte 0: motor index, byte 1: one-shot, byte 2-3: decimation
+    _cmd_map['get_capture'] = CommandStructure(cmd_ind=73, var_type=np.uint8) #multi-frame response
+    _CAPTURE_OFF = 255
+    _cmd_map['get_m2_engine'] = CommandStructure(cmd_ind=74, var_type=np.uint8) #pulse engine, only m2 has a timer channel on its step pin
+    _cmd_map['set_m2_engine'] = CommandStructure(cmd_ind=75, var_type=np.uint8)
+    _cmd_map['get_m2_accel'] = CommandStructure(cmd_ind=76, var_type=np.uint32) #steps/s^2
+    _cmd_map['set_m2_accel'] = CommandStructure(cmd_ind=77, var_type=np.uint32)
+    _cmd_map['set_protocol'] = CommandStructure(cmd_ind=78, var_type=np.uint8) #acked with the old framing, switches both directions
+    _cmd_map['set_baudrate'] = CommandStructure(cmd_ind=79, var_type=np.uint32) #UART only, acked at the old rate, confirmed by repeating at the new rate
+    _cmd_map['get_echo'] = CommandStructure(cmd_ind=80, var_type=np.uint32) #replies with the argument
+    _cmd_map['get_state'] = CommandStructure(cmd_ind=81, var_type=np.uint8) #multi-frame response, state of all motors
+    _cmd_map['stop_all'] = CommandStructure(cmd_ind=82, var_type=np.uint32) #priority path, replied with signal 251 instead of an ack
+
+    _STATS_HIST_LEN = 16
+    _STATS_FIELDS_V1 = ["version", "mcu_tick", "loop_count", "loop_period_max", "cmd_duration_max", "rx_usb_dropped", 
+                        "rx_uart_dropped", "tx_queue_high_water", "tx_dropped", "late_threshold"] #followed by late steps, late max and histogram
+    _STATE_HEADER_LEN = 4 #version, sub us divider, tick, motor count
+    _STATE_MOTOR_LEN = 5 #flags, step interval, steps, target steps, accel
 
     def __init__(self, serial_port=None, serial_baudrate=None, pump_count:int = None):
         if not (serial_port is None):
@@ -706,44 +1522,63 @@ class HiPeristalticInterface():
             self.pump_count = pump_count
         self._lock_config = Lock()
         self._lock_send = Lock()
+        self._m_queue_s = {kind: Histogram(_LATENCY_BUCKETS_S) for kind in self._CMD_KINDS}
+        self._m_reply_s = {kind: Histogram(_LATENCY_BUCKETS_S) for kind in self._CMD_KINDS}
+        self._m_failed = dict.fromkeys(self._CMD_KINDS, 0)
+        self._m_queue_depth = Histogram(_DEPTH_BUCKETS)
+        self._m_tickets = count()
+        self._lock_write = RLock()
+        self._stop_all_pending = deque()
         self._rx_buffer = bytearray(self._MSG_LEN)
-        self._tx_buffer = bytearray(self._MSG_LEN)
+        self._tx_buffer = bytearray(self._MSG_LEN + 1) #v2 messages carry a 2 byte CRC instead of the checksum byte
         self._event_signal_booted_rcv = Event()
         self._event_ack_rcv = Event()
         self._event_msg_rcv = Event()
         self._event_msg_processed = Event()
+        self._pending_end_steps = {}
+        self._event_listeners = []
+        self.event_history = deque(maxlen=256)
         self._rcv_msg_table = { #first byte (uint8) of rx_buffer
             255: self._msg_checksum_err,
             254: self._msg_cmd_err,
             253: self._msg_ack,
             252: self._msg_signal_booted,
+            251: self._msg_signal_stop,
             #from 200 to 252 are for motor signals such as completion of a task
             #these must be appended when the pump classes are initialized
+            #200-203: end of motor task with the tick of the last step, 204-207: odometer preceding the end signal
+            #251: stop_all applied, with its tick
         }
 
     def connect(self,serial_port=None,serial_baudrate=None,conn_delay_s:float=3):
         """
         Initiate serial connection to the pump.
         Creates a new connection regardless of the current status.
+        conn_delay_s is the longest wait for the MCU to boot, connection proceeds as soon as it replies.
         """
         try:
             if not (serial_port is None):
                 self._serial_port = serial_port
             if not (serial_baudrate is None):
                 self._serial_baudrate = serial_baudrate
-            self._serial_com = serial.Serial(port=self._serial_port,baudrate=self._serial_baudrate,inter_byte_timeout=self._serial_inter_byte_timeout_s)
-            sleep(conn_delay_s) #might be necessary for Arduino to boot up, may not be required for others
-            self._serial_com.read_all() #clear the buffer in case it contains junk
+            baudrate = min(self._serial_baudrate, self._UART_BOOT_BAUDRATE) #the MCU starts at the boot rate, raised below
+            self._serial_com = serial.Serial(port=self._serial_port,baudrate=baudrate,inter_byte_timeout=self._serial_inter_byte_timeout_s)
+            self._trace_baudrate()
+            if self._serial_low_latency:
+                self._set_low_latency()
+            self._protocol = 1
+            if not self._wait_ready(conn_delay_s):
+                _log.warning(f"No reply from the MCU within {conn_delay_s} s.")
             self._thread_msg_rcv = Thread(target=self._read_data_thread_func)
             self._thread_msg_rcv.daemon = True
             self._thread_msg_rcv.start()
-            # one can also check the start signal here but it needs to be enabled in the firmware
-            # self.event_start_signal_received.wait()
-            # self.event_start_signal_received.clear()
-
             self.status = "Connected"
-            logging.info('Connected to the microcontroller.')
+            _log.info('Connected to the microcontroller.')
             self._get_sub_us_divider()
+            if (self._protocol_version >= 2) and (not self._set_protocol(2)):
+                _log.info("Firmware does not support the v2 framing, using v1.")
+            if self._serial_baudrate > self._serial_com.baudrate:
+                self._negotiate_baudrate()
 
             self.pumps = []
             for i in range(self.pump_count):
@@ -754,84 +1589,196 @@ class HiPeristalticInterface():
                     func_pump_send_cmd = self._send_cmd_from_table, 
                     )
                     )
-                self._rcv_msg_table[200+i] = self.pumps[i]._signal_m_stopped #assign the finished signal function to the corresponding motor index
+                #assign the finished signal functions to the corresponding motor index
+                self._rcv_msg_table[200+i] = lambda i=i: self._msg_signal_m_end(i)
+                self._rcv_msg_table[204+i] = lambda i=i: self._msg_signal_m_end_steps(i)
 
             #MUST BE CALLED AFTER PUMP OBJECTS ARE CREATED
             self._apply_pump_config_pre(self.config)
-            for i in range(self.pump_count):
-                self.pumps[i]._read_initial_variables()
+            self._read_initial_state()
             self._apply_pump_config_post(self.config)
-            logging.info(f"{self.pump_count} pumps have been initalized.")
+            self._init_mcu_clock()
+            self._stop_all_support = self._probe_stop_all()
+            _log.info(f"{self.pump_count} pumps have been initalized.")
             return True
         except serial.SerialException as e:
             self.status = "Disconnected"
-            logging.critical(f"Could not connect to the microcontroller of the pump. No start signal received. {e}")
+            _log.critical(f"Could not connect to the microcontroller of the pump. No start signal received. {e}")
             raise Exception(f"Could not connect to the microcontroller of the pump. No start signal received.{e}")
             return False
         except Exception as e:
             self.status = "Disconnected"
-            logging.critical(f"Could not connect to the microcontroller of the pump. {e}")
+            _log.critical(f"Could not connect to the microcontroller of the pump. {e}")
             raise Exception(f"Could not connect to the microcontroller of the pump. {e}")
             return False
         
-    def _calc_rx_checksum8(self):
-        data = np.frombuffer(self._rx_buffer,np.uint8)
-        checksum = data[0]
-        for i in range(1,self._MSG_LEN - 1): #-1 for excluding the last byte
-            checksum = checksum ^ data[i]
-        return checksum #return single byte of checksum
-    
-    def _calc_tx_checksum8(self):
-        data = np.frombuffer(self._tx_buffer,np.uint8)
-        checksum = data[0]
-        for i in range(1,self._MSG_LEN - 1): #-1 for excluding the last byte
-            checksum = checksum ^ data[i]
-        return checksum #return single byte of checksum
-    
+    def _wait_ready(self, timeout_s: float)->bool:
+        #probes with the protocol reset frame until the MCU replies (or its boot frame arrives) instead of a fixed boot delay
+        #an MCU left in v2 by a previous session returns to v1, firmwares without protocol support reply with an error
+        #runs before the reader thread, replies are discarded
+        self._serial_com.timeout = self._conn_probe_interval_s
+        deadline_ns = perf_counter_ns() + int(timeout_s * 1e9)
+        ready = False
+        while (not ready) and (perf_counter_ns() < deadline_ns):
+            self._trace_frame(SerialTrace.TX, self._PROTOCOL_RESET_FRAME)
+            self._serial_com.write(self._PROTOCOL_RESET_FRAME)
+            ready = self._trace_raw_rx(self._serial_com.read(self._MSG_LEN)) > 0
+        self._serial_com.timeout = self._conn_drain_timeout_s
+        while self._trace_raw_rx(self._serial_com.read(max(1, self._serial_com.in_waiting))) > 0: #late replies to earlier probes
+            pass
+        self._serial_com.timeout = None
+        return ready
+
+    def _read_initial_state(self)->bool:
+        #firmwares without get_state are read per pump variable
+        if self.refresh_state():
+            return True
+        for i in range(self.pump_count):
+            self.pumps[i]._read_initial_variables()
+        return False
+
     def _check_rx_checksum8(self):
-        checksum_rx = np.uint8(self._rx_buffer[-1]) #last byte is the checksum
-        checksum_calc = self._calc_rx_checksum8()
-        if checksum_calc == checksum_rx:
+        if _xor8(self._rx_buffer, self._MSG_LEN - 1) == self._rx_buffer[self._MSG_LEN - 1]: #last byte is the checksum
             self._rx_error_cnt = 0
             return True
         self._rx_error_cnt += 1
         self._rx_total_error_cnt += 1
-        logging.critical(f"MCU sent a message with wrong cheksum. Consecutive error count: {self._rx_error_cnt} | Total error count: {self._rx_total_error_cnt}")
+        _log.critical("MCU sent a message with wrong cheksum.", extra=_fields(frame=self._rx_buffer.hex(), errors=self._rx_error_cnt, total_errors=self._rx_total_error_cnt))
         # raise Exception("MCU sent a message with wrong cheksum.")
         return False
         
     def _write_data(self):
-        #writes tx_buffer after setting the last byte to calculated checksum8
-        self._tx_buffer[-1] = self._calc_tx_checksum8()
-        self._serial_com.write(self._tx_buffer)
+        #v1: writes tx_buffer after setting the last byte to calculated checksum8
+        #v2: writes the 5 message bytes of tx_buffer and their CRC-16 as a COBS frame between 0x00 delimiters,
+        #the leading delimiter terminates any junk the MCU may have received before
+        wait_ns = self._tx_holdoff_ns - perf_counter_ns()
+        if wait_ns > 0:
+            sleep(wait_ns / 1e9)
+        self._write_frame(self._tx_buffer)
+
+    def _write_frame(self, buffer: bytearray):
+        #frames the 5 message bytes of buffer with the current protocol, buffer must hold MSG_LEN + 1 bytes
+        if self._protocol == 2:
+            _U16.pack_into(buffer, self._MSG_LEN - 1, binascii.crc_hqx(buffer[:self._MSG_LEN - 1], 0xFFFF))
+            data = _cobs_encode(buffer, delimited=True)
+        else:
+            buffer[self._MSG_LEN - 1] = _xor8(buffer, self._MSG_LEN - 1)
+            data = buffer[:self._MSG_LEN]
+        with self._lock_write:
+            if not (self._trace is None): #ahead of the write, so that the reply is always recorded after it
+                self._trace_frame(SerialTrace.TX, data)
+            self._serial_com.write(data)
+            self._m_tx_frames += 1
     
-    def _read_data(self):
-        try:
-            self._rx_buffer = self._serial_com.read(self._MSG_LEN) #operates with inter_byte_timeout
-            if len(self._rx_buffer) < self._MSG_LEN: #probably junk during UART initalization
-                sleep(0.01)
-                return False #ignore the junk
-        except:
-            sleep(0.01)
+    def _decode_frame_v2(self, frame)->bool:
+        #frame is the COBS encoded message without its 0x00 delimiter, a corrupted frame costs only itself
+        msg = _cobs_decode(frame)
+        if (msg is None) or (len(msg) != self._MSG_LEN + 1) or (binascii.crc_hqx(msg[:-2], 0xFFFF) != _U16.unpack_from(msg, self._MSG_LEN - 1)[0]):
+            self._rx_error_cnt += 1
+            self._rx_total_error_cnt += 1
+            _log.critical("MCU sent a corrupted frame.", extra=_fields(frame=bytes(frame).hex(), errors=self._rx_error_cnt, total_errors=self._rx_total_error_cnt))
             return False
-        if self._check_rx_checksum8():
-            return True
-        return False
+        self._rx_error_cnt = 0
+        self._rx_buffer[:] = msg[:self._MSG_LEN] #same layout as v1, the message parsers ignore the last byte
+        return True
+    
+    def _process_rx(self, rx: bytearray):
+        #decodes and dispatches every complete frame in rx, the incomplete rest is kept for the next read
+        #the framing is checked per frame, as an ack of set_protocol switches it for the frames right after
+        ind = 0
+        while True:
+            if self._protocol == 2:
+                end = rx.find(0, ind)
+                if end < 0:
+                    if (len(rx) - ind) > self._FRAME_MAX_LEN: #junk without delimiter
+                        ind = len(rx)
+                    break
+                frame_ok = (end > ind) and self._decode_frame_v2(rx[ind:end]) #consecutive delimiters are empty frames
+                if (end > ind) and not (self._trace is None):
+                    self._trace_frame(SerialTrace.RX if frame_ok else SerialTrace.RX_CORRUPT, rx[ind:end], self._rx_time_ns)
+                ind = end + 1
+            else:
+                if (len(rx) - ind) < self._MSG_LEN:
+                    break
+                self._rx_buffer[:] = rx[ind:ind + self._MSG_LEN]
+                ind += self._MSG_LEN
+                frame_ok = self._check_rx_checksum8()
+                if not (self._trace is None):
+                    self._trace_frame(SerialTrace.RX if frame_ok else SerialTrace.RX_CORRUPT, self._rx_buffer, self._rx_time_ns)
+            if frame_ok:
+                self._dispatch_msg()
+        del rx[:ind]
+    
+    def _dispatch_msg(self):
+        self._m_rx_frames += 1
+        msg_ind = self._rx_buffer[0]
+        if msg_ind in self._rcv_msg_table: #if the message is an ack, err, end of motor task signal, or start signal
+            func = self._rcv_msg_table.get(msg_ind)
+            result = func()
+        elif msg_ind >= 200: #if not one of the reserved 200-252 signals, then unknown message
+            self._msg_unknown()
+        elif (self._pending_reply == "bulk") and (msg_ind == self._bulk_cmd_ind): #part of a multi-frame response
+            self._msg_bulk()
+        elif (self._pending_reply == "get") and (msg_ind == self._tx_buffer[0]): #the response of the pending get command
+            self._event_msg_rcv.set()
+            self._event_msg_processed.wait(self._reply_timeout_s) #the sender may have given up meanwhile
+            self._event_msg_processed.clear()
+        else: #e.g. a late response of a timed out command
+            _log.warning("Dropped a response without a pending command.", extra=_fields(cmd=msg_ind, val=_U32.unpack_from(self._rx_buffer, 1)[0]))
         
     def _read_data_thread_func(self):
+        #blocks until data arrives, then takes everything available at once, no polling delay
+        rx = bytearray()
+        inter_byte_timeout_ns = self._serial_inter_byte_timeout_s * 1e9
         while (True):
-            if self._read_data():
-                msg_ind = self._rx_buffer[0]
-                if msg_ind in self._rcv_msg_table: #if the message is an ack, err, end of motor task signal, or start signal
-                    func = self._rcv_msg_table.get(msg_ind)
-                    result = func()
-                elif msg_ind >= 200: #if not one of the reserved 200-252 signals, then unknown message
-                    self._msg_unknown()
-                else: #if the message is a response of a get command
-                    self._event_msg_rcv.set()
-                    self._event_msg_processed.wait()
-                    self._event_msg_processed.clear()
-            sleep(0.001) #read data should block, but just in case for frequent errors
+            try:
+                data = self._serial_com.read(max(1, self._serial_com.in_waiting))
+            except: #e.g. the port is closed
+                sleep(0.01)
+                continue
+            if len(data) == 0:
+                continue
+            rx_time_ns = perf_counter_ns()
+            if (self._protocol == 1) and ((rx_time_ns - self._rx_time_ns) > inter_byte_timeout_ns):
+                rx.clear() #v1 realigns on silence like the MCU, a partial frame before it is junk (e.g. during UART initalization)
+            self._rx_time_ns = rx_time_ns
+            rx += data
+            self._process_rx(rx)
+
+    def _trace_frame(self, kind: int, data, t_ns: int = None):
+        trace = self._trace #may be stopped by another thread meanwhile
+        if not (trace is None):
+            trace.record(kind, self._protocol, data, t_ns)
+
+    def _trace_raw_rx(self, data: bytes)->int:
+        #replies read before the reader thread starts, recorded as v1 frames, returns len(data)
+        if not (self._trace is None):
+            t_ns = perf_counter_ns()
+            for i in range(0, len(data), self._MSG_LEN):
+                self._trace_frame(SerialTrace.RX, data[i:i + self._MSG_LEN], t_ns)
+        return len(data)
+
+    def _trace_baudrate(self):
+        if not ((self._trace is None) or (self._serial_com is None)):
+            self._trace_frame(SerialTrace.BAUDRATE, _U32.pack(int(self._serial_com.baudrate)))
+
+    def _set_low_latency(self)->bool:
+        #Linux only, best effort: ASYNC_LOW_LATENCY for UARTs and 1 ms latency timer for usb-serial adapters (16 ms by default for FTDI)
+        result = False
+        try:
+            self._serial_com.set_low_latency_mode(True)
+            result = True
+        except Exception: #not supported by the platform or the driver (e.g. USB CDC)
+            pass
+        latency_timer_fpath = f"/sys/bus/usb-serial/devices/{os.path.basename(os.path.realpath(self._serial_port))}/latency_timer"
+        if os.path.exists(latency_timer_fpath):
+            try:
+                with open(latency_timer_fpath, "w") as f:
+                    f.write("1")
+                result = True
+            except OSError:
+                _log.info(f"No permission to set {latency_timer_fpath} to 1 ms.")
+        return result
 
     def _send_cmd_from_table(self,fnc_name:str,val = None):
         #lookup the command from function name
@@ -851,34 +1798,52 @@ class HiPeristalticInterface():
     def _send_set_cmd(self,cmd_index: np.uint8,var_type: type, val):
         #send the set message
         #byte 0 is the command index, byte 1 to 4 are the value bytes, byte 5 is the checksum (dealt by write func)
-        self._lock_send.acquire()
-        self._tx_buffer[0] = np.uint8(cmd_index).tobytes()[0]
-        arg_bytes = var_type(val).tobytes()
-        len_bytes = len(arg_bytes)
-        if len_bytes <= self._ARG_LEN:
-            self._tx_buffer[1:len_bytes+1] = arg_bytes
-            self._write_data() #send the tx_buffer with the checksum 
-            #wait for the acknowledgement message
-            self._event_ack_rcv.wait()
-            self._event_ack_rcv.clear()
-        self._lock_send.release()
-        return True
+        #returns False if the MCU replied with an error (e.g. command not supported by the firmware)
+        self._acquire_send("set")
+        _FRAME_STRUCTS[var_type].pack_into(self._tx_buffer, 0, cmd_index, int(val))
+        self._cmd_failed = False
+        self._pending_reply = "set"
+        self._event_ack_rcv.clear()
+        tx_time_ns = perf_counter_ns()
+        self._write_data() #send the tx_buffer with the checksum 
+        #wait for the acknowledgement message
+        self._wait_reply(self._event_ack_rcv)
+        self._event_ack_rcv.clear()
+        self._pending_reply = None
+        result = not self._cmd_failed
+        self._release_send("set", tx_time_ns)
+        return result
     
-    def _send_get_cmd(self,cmd_index:np.uint8,var_type:type):
-        #send the get message
-        self._lock_send.acquire()
-        self._tx_buffer[0] = np.uint8(cmd_index).tobytes()[0]
+    def _send_get_cmd(self,cmd_index:np.uint8,var_type:type,val=None):
+        return self._send_get_cmd_timed(cmd_index=cmd_index,var_type=var_type,val=val)[0]
+
+    def _send_get_cmd_timed(self,cmd_index:np.uint8,var_type:type,val=None):
+        #send the get message, val is an optional argument of the same type as the response
+        #returns the response (None if the MCU replied with an error) and the perf_counter_ns() of sending and receiving
+        self._acquire_send("get")
+        _FRAME_STRUCTS[var_type].pack_into(self._tx_buffer, 0, cmd_index, 0 if (val is None) else int(val))
+        self._cmd_failed = False
+        self._pending_reply = "get"
+        self._event_msg_rcv.clear()
+        self._event_msg_processed.clear()
+        tx_time_ns = perf_counter_ns()
         self._write_data()
         #wait for the response
-        self._event_msg_rcv.wait()
+        self._wait_reply(self._event_msg_rcv)
+        self._pending_reply = None
+        rx_time_ns = self._rx_time_ns
+        if self._cmd_failed: #error message instead of the response, or timed out, nothing to process
+            self._event_msg_rcv.clear()
+            self._event_msg_processed.set() #in case the response arrived meanwhile
+            self._release_send("get", tx_time_ns)
+            return None, tx_time_ns, rx_time_ns
         #process the response
-        response = np.frombuffer(buffer=self._rx_buffer[1:-1],dtype=var_type)
-        response = response[0]
+        response = _FRAME_STRUCTS[var_type].unpack_from(self._rx_buffer)[1]
         #reset the event flags
         self._event_msg_rcv.clear()
         self._event_msg_processed.set()
-        self._lock_send.release()
-        return response
+        self._release_send("get", tx_time_ns)
+        return response, tx_time_ns, rx_time_ns
     
     def _get_sub_us_divider(self):
         result = self._send_cmd_from_table(inspect.stack()[0][3].lstrip("_"))
@@ -886,39 +1851,392 @@ class HiPeristalticInterface():
         #min2us = 60000000.0 = 6e7
         return result
     
+    def _send_bulk_cmd(self,cmd_index:np.uint8,var_type:type,val=0):
+        #send a command with a multi-frame response: [cmd][word count] followed by word count frames of [cmd][uint32]
+        #returns the list of words, None if the MCU replied with an error
+        self._acquire_send("bulk")
+        _FRAME_STRUCTS[var_type].pack_into(self._tx_buffer, 0, cmd_index, int(val))
+        self._bulk_cmd_ind = int(cmd_index)
+        self._bulk_len = None
+        self._bulk_words = []
+        self._cmd_failed = False
+        self._pending_reply = "bulk"
+        self._event_msg_rcv.clear()
+        tx_time_ns = perf_counter_ns()
+        self._write_data()
+        #wait for all the words
+        self._wait_reply(self._event_msg_rcv)
+        self._event_msg_rcv.clear()
+        self._pending_reply = None
+        result = None if self._cmd_failed else self._bulk_words
+        self._release_send("bulk", tx_time_ns)
+        return result
+
+    def _acquire_send(self, kind: str):
+        #takes the send lock, recording the commands ahead and the wait
+        depth = next(self._m_tickets) - self._m_cmd_done
+        t_ns = perf_counter_ns()
+        self._lock_send.acquire()
+        self._m_queue_depth.observe(depth)
+        self._m_queue_s[kind].observe((perf_counter_ns() - t_ns) / 1e9)
+
+    def _release_send(self, kind: str, tx_time_ns: int):
+        #records the reply time of the command and releases the send lock
+        self._m_reply_s[kind].observe((perf_counter_ns() - tx_time_ns) / 1e9)
+        if self._cmd_failed:
+            self._m_failed[kind] += 1
+        self._m_cmd_done += 1
+        self._lock_send.release()
+
+    def _wait_reply(self, event: Event)->bool:
+        #waits while the MCU keeps sending (e.g. long multi-frame responses), the pending command fails after a silent timeout
+        while not event.wait(self._reply_timeout_s):
+            if (perf_counter_ns() - self._rx_time_ns) > (self._reply_timeout_s * 1e9):
+                self._cmd_failed = True
+                self._m_reply_timeouts += 1
+                _log.critical("No reply from the MCU.", extra=_fields(cmd=self._tx_buffer[0], val=_U32.unpack_from(self._tx_buffer, 1)[0]))
+                return False
+        return True
+
+    def _check_link(self, timeout_s: float = 0.2)->bool:
+        #echoes test patterns with alternating, all-zero and all-one bits
+        timeout_s_prev = self._reply_timeout_s
+        self._reply_timeout_s = timeout_s
+        try:
+            cmd = self._cmd_map["get_echo"]
+            for pattern in self._LINK_TEST_PATTERNS:
+                if self._send_get_cmd(cmd_index=cmd.cmd_ind,var_type=cmd.var_type,val=pattern) != pattern:
+                    return False
+            return True
+        finally:
+            self._reply_timeout_s = timeout_s_prev
+
+    def _negotiate_baudrate(self)->int:
+        #raises the UART rate to the fastest one up to serial_baudrate that passes the link check
+        #USB links and older firmwares reject set_baudrate, the rate stays as is
+        for baudrate in self._UART_BAUDRATES:
+            baudrate_prev = self._serial_com.baudrate
+            if (baudrate > self._serial_baudrate) or (baudrate <= baudrate_prev):
+                continue
+            if not self._send_cmd_from_table("set_baudrate", baudrate):
+                break
+            self._serial_com.baudrate = baudrate
+            self._trace_baudrate()
+            sleep(0.01) #MCU switches after its ack is sent
+            if self._check_link() and self._send_cmd_from_table("set_baudrate", baudrate): #repeating the rate confirms it
+                _log.info(f"UART link at {baudrate} baud.")
+                return baudrate
+            _log.warning(f"UART link check failed at {baudrate} baud.")
+            self._serial_com.baudrate = baudrate_prev
+            self._trace_baudrate()
+            sleep(self._UART_BAUD_CONFIRM_TIMEOUT_S + 0.1) #MCU falls back on its own
+            if not self._check_link(timeout_s=self._reply_timeout_s):
+                raise Exception(f"Lost the UART link after a failed switch to {baudrate} baud.")
+        return self._serial_com.baudrate
+
+    def _set_protocol(self, version: int)->bool:
+        #the MCU acks with the current framing, the reader thread switches on that ack (see _msg_ack)
+        return bool(self._send_cmd_from_table("set_protocol", version))
+
+    def _msg_bulk(self):
+        value = _U32.unpack_from(self._rx_buffer, 1)[0]
+        if self._bulk_len is None: #first frame is the number of words to follow
+            self._bulk_len = value
+        else:
+            self._bulk_words.append(value)
+        if len(self._bulk_words) >= self._bulk_len:
+            self._event_msg_rcv.set()
+        return True
+
+    def _release_pending_cmd(self):
+        #an error reply ends the pending command, the waiting sender returns a failure
+        self._cmd_failed = True
+        if (self._pending_reply == "get") or (self._pending_reply == "bulk"):
+            self._event_msg_rcv.set()
+        elif (self._pending_reply == "stop") and (len(self._stop_all_pending) > 0):
+            self._stop_all_pending.popleft()[2].set()
+        elif self._pending_reply == "set":
+            self._event_ack_rcv.set()
+
     def _msg_checksum_err(self):
-        logging.critical("MCU received a message with a wrong checksum.")
+        self._m_mcu_rx_errors += 1
+        self._release_pending_cmd()
+        _log.critical("MCU received a message with a wrong checksum.", extra=_fields(cmd=self._tx_buffer[0], val=_U32.unpack_from(self._tx_buffer, 1)[0]))
         # raise Exception("MCU received a message with a wrong checksum.")
-        print(f"Waiting {self._serial_inter_byte_timeout_s * 2} seconds for buffer reset.")
-        sleep(self._serial_inter_byte_timeout_s * 2)
+        if self._protocol == 1: #the MCU realigns after its inter-byte timeout, hold back the next message but keep reading
+            self._tx_holdoff_ns = perf_counter_ns() + int(self._serial_inter_byte_timeout_s * 2 * 1e9)
         return False
 
     def _msg_cmd_err(self):
-        logging.critical("MCU received a message with wrong or unsupported command.")
+        self._release_pending_cmd()
+        _log.critical("MCU received a message with wrong or unsupported command.", extra=_fields(cmd=self._tx_buffer[0], val=_U32.unpack_from(self._tx_buffer, 1)[0]))
         # raise Exception("MCU received a message with wrong or unsupported command.")
         # print("Waiting 1.5seconds for buffer reset.")
         # sleep(1.5)
         return False
     
     def _msg_ack(self):
+        if (self._pending_reply == "set") and (self._tx_buffer[0] == self._cmd_map["set_protocol"].cmd_ind):
+            self._protocol = int(self._tx_buffer[1]) #following frames, including the next one read, use the new framing
         self._event_ack_rcv.set()
         return True
 
+    def _msg_signal_stop(self):
+        #confirms the oldest pending stop_all, the pumps of its mask stopped on the tick of the signal
+        if len(self._stop_all_pending) == 0:
+            _log.warning("Stop signal without a pending stop_all.", extra=_fields(tick=_U32.unpack_from(self._rx_buffer, 1)[0]))
+            return False
+        mask, disable, event_done = self._stop_all_pending.popleft()
+        rx_time = _perf_ns_to_epoch_s(self._rx_time_ns)
+        mcu_tick = _U32.unpack_from(self._rx_buffer, 1)[0]
+        host_time = self.mcu_clock.tick_to_time(mcu_tick) if self._mcu_tick_support else None
+        for i in range(self.pump_count):
+            if mask & (1 << i):
+                event = PumpEvent(pump_ind=i, name="stop", mcu_tick=mcu_tick, host_time=host_time, rx_time=rx_time)
+                self.pumps[i]._signal_m_halted(event, disable)
+                self._dispatch_event(event)
+        event_done.set()
+        return True
+
     def _msg_signal_booted(self):
         self._event_signal_booted_rcv.set()
         return True
 
     def _msg_unknown(self):
-        logging.critical("MCU sent an unknown message.")
+        _log.critical("MCU sent an unknown message.", extra=_fields(frame=self._rx_buffer.hex()))
         # raise Exception("Received an unknown message.")
         return False
+
+    def _msg_signal_m_end_steps(self, motor_ind: int):
+        #odometer of the motor, sent right before its end signal if extended events are enabled
+        self._pending_end_steps[motor_ind] = _U32.unpack_from(self._rx_buffer, 1)[0]
+        return True
+
+    def _msg_signal_m_end(self, motor_ind: int):
+        rx_time = _perf_ns_to_epoch_s(self._rx_time_ns)
+        step_count = self._pending_end_steps.pop(motor_ind, None)
+        mcu_tick = None
+        host_time = None
+        if self._mcu_tick_support: #older firmwares leave junk in the value bytes
+            mcu_tick = _U32.unpack_from(self._rx_buffer, 1)[0]
+            host_time = self.mcu_clock.tick_to_time(mcu_tick)
+        event = PumpEvent(pump_ind=motor_ind, name="end", mcu_tick=mcu_tick, step_count=step_count, host_time=host_time, rx_time=rx_time)
+        self.pumps[motor_ind]._signal_m_stopped(event)
+        self._dispatch_event(event)
+        return True
+
+    def _dispatch_event(self, event: PumpEvent):
+        #runs in the reader thread, listeners must return quickly
+        self.event_history.append(event)
+        for func in list(self._event_listeners):
+            try:
+                func(event)
+            except Exception as e:
+                _log.error(f"Event listener failed for {event}: {e}")
+
+    def add_event_listener(self, func: callable):
+        #func(event: PumpEvent) is called for every asynchronous event of the MCU, from the reader thread
+        self._event_listeners.append(func)
+
+    def remove_event_listener(self, func: callable):
+        if func in self._event_listeners:
+            self._event_listeners.remove(func)
+
+    ### MCU clock
+
+    def _init_mcu_clock(self)->bool:
+        cmd = self._cmd_map["get_tick"]
+        if self._send_get_cmd(cmd_index=cmd.cmd_ind,var_type=cmd.var_type) is None:
+            self._mcu_tick_support = False
+            _log.info("Firmware does not report its ticks, event times will be the host receive times.")
+            return False
+        self.mcu_clock = McuClock(ticks_per_s=self._sub_us_divider * 1e6)
+        for _ in range(8): #initial estimate, refined by the sync thread
+            self._sync_mcu_clock()
+        self._mcu_tick_support = True
+        self._ext_events_support = self._send_cmd_from_table("set_ext_events", 1)
+        if (self._thread_clock_sync is None) or (not self._thread_clock_sync.is_alive()):
+            self._thread_clock_sync = Thread(target=self._clock_sync_thread_func)
+            self._thread_clock_sync.daemon = True
+            self._thread_clock_sync.start()
+        return True
+
+    def _sync_mcu_clock(self)->bool:
+        cmd = self._cmd_map["get_tick"]
+        tick, tx_time_ns, rx_time_ns = self._send_get_cmd_timed(cmd_index=cmd.cmd_ind,var_type=cmd.var_type)
+        if tick is None:
+            return False
+        self.mcu_clock.add_sample(tx_time_ns, rx_time_ns, int(tick))
+        return True
+
+    def _clock_sync_thread_func(self):
+        while (True):
+            sleep(self._clock_sync_interval_s)
+            try:
+                self._sync_mcu_clock()
+            except Exception as e:
+                _log.error(f"MCU clock sync failed: {e}")
+
+    def get_stats(self, reset: bool = False)->dict:
+        """
+        Reads the performance counters of the firmware, times are in microseconds.
+        loop_period_max is the longest gap between consecutive visits of the step functions,
+        cmd_duration_max is the longest command processing (including driver configuration over UART).
+        late_steps and late_max are per pump, a step is late if it is issued late_threshold after its interval.
+        loop_period_hist[i] counts the main loop periods within [2^i, 2^(i+1)) ticks, see loop_period_hist_edges.
+        Returns None if the firmware does not support it.
+        If reset is True, the counters are cleared after reading.
+        """
+        cmd = self._cmd_map["get_stats"]
+        words = self._send_bulk_cmd(cmd_index=cmd.cmd_ind,var_type=cmd.var_type,val=int(reset))
+        if (words is None) or (len(words) == 0) or (words[0] != 1):
+            return None
+        n = len(self._STATS_FIELDS_V1)
+        stats = dict(zip(self._STATS_FIELDS_V1, words[:n]))
+        stats["late_steps"] = words[n:n+4]
+        stats["late_max"] = words[n+4:n+8]
+        stats["loop_period_hist"] = words[n+8:n+8+self._STATS_HIST_LEN]
+        #ticks to us
+        ticks_per_us = float(self._sub_us_divider)
+        for key in ["loop_period_max", "cmd_duration_max", "late_threshold"]:
+            stats[key] = stats[key] / ticks_per_us
+        stats["late_max"] = [x / ticks_per_us for x in stats["late_max"]]
+        stats["loop_period_hist_edges"] = [(2**i) / ticks_per_us for i in range(self._STATS_HIST_LEN + 1)]
+        stats["late_steps"] = stats["late_steps"][:self.pump_count]
+        stats["late_max"] = stats["late_max"][:self.pump_count]
+        return stats
+
+    def measure_step_rate_budget(self, sample_s: float = 1.0, headroom: float = 0.5)->float:
+        """
+        Counts the passes of the firmware main loop over sample_s (see get_stats) and sets step_rate_budget to headroom times
+        the passes per second, i.e. one step per pass across the pumps stepped by the loop (the pulse engine is not).
+        The loop slows down with the steps it issues and the commands it serves, hence measured while idle with headroom for both.
+        Returns the budget, None if the firmware has no performance counters or the counters could not be read.
+        """
+        if self.get_stats(reset=True) is None:
+            return None
+        t_start_ns = perf_counter_ns()
+        sleep(sample_s)
+        stats = self.get_stats()
+        if stats is None: #lost the reply, no count to derive it from
+            return None
+        loops_per_s = stats["loop_count"] / ((perf_counter_ns() - t_start_ns) / 1e9)
+        self.step_rate_budget = headroom * loops_per_s
+        _log.info(f"Step rate budget: {self.step_rate_budget:.0f} steps/s ({loops_per_s:.0f} loop passes/s).")
+        return self.step_rate_budget
+
+    def get_step_rate_in_use(self, exclude_ind: int = None)->float:
+        #steps/s of the running pumps stepped by the main loop, from the cache
+        ticks_per_s = float(self._sub_us_divider) * 1e6
+        return sum(ticks_per_s / float(pump._motor_step_interval) for i, pump in enumerate(self.pumps[:self.pump_count])
+                   if pump._motor_running and (pump._motor_step_interval > 0) and not (pump._motor_engine and pump._motor_finite_mode) and (i != exclude_ind))
+
+    def plan_dispense(self, pump_ind: int, target_volume_uL: float, flow_rate_uLpersec: float = None, direction: str = None,
+                      resolution_uL: float = None)->DispensePlan:
+        """
+        Fastest run of target_volume_uL for the pump (0 indexed), see Pump.plan_volume(), within the part of step_rate_budget
+        not taken by the other running pumps. flow_rate_uLpersec caps the flow rate, the max rpm of the pump does otherwise.
+        Returns None if the pump index is out of range, see DispensePlan.explain() for the choice.
+        """
+        if (pump_ind < 0) or (pump_ind >= self.pump_count):
+            return None
+        step_rate_limit = None
+        if not (self.step_rate_budget is None):
+            step_rate_limit = self.step_rate_budget - self.get_step_rate_in_use(exclude_ind=pump_ind)
+        return self.pumps[pump_ind].plan_volume(target_volume_uL, flow_rate_uLpersec, direction, resolution_uL, step_rate_limit)
+
+    def dispense(self, pump_ind: int, target_volume_uL: float, flow_rate_uLpersec: float = None, direction: str = None,
+                 resolution_uL: float = None, blocking: bool = False)->DispensePlan:
+        #plans and runs, returns the plan that runs or None if it could not start
+        plan = self.plan_dispense(pump_ind, target_volume_uL, flow_rate_uLpersec, direction, resolution_uL)
+        if (plan is None) or (plan.steps <= 0):
+            return None
+        _log.info(f"Dispense plan: {plan}", extra=_fields(pump=pump_ind))
+        if not self.pumps[pump_ind].pump_plan(plan, blocking=blocking):
+            return None
+        return plan
+
+    def start_step_capture(self, pump_ind: int, decimation: int = 1, oneshot: bool = False)->bool:
+        """
+        Arms the step edge capture of the firmware for the pump (0 indexed), recording the MCU tick of each step pulse.
+        By default the last edges are kept (ring), with oneshot=True the first edges after arming are kept instead.
+        With decimation n, every nth edge is recorded. Only one pump can be captured at a time, arming again clears the buffer.
+        Returns False if the firmware does not support it.
+        """
+        if (pump_ind < 0) or (pump_ind >= self.pump_count):
+            return False
+        decimation = int(min(max(decimation, 1), 0xFFFF))
+        arg = pump_ind | (int(bool(oneshot)) << 8) | (decimation << 16)
+        return self._send_cmd_from_table("set_capture", arg)
+
+    def stop_step_capture(self)->bool:
+        return self._send_cmd_from_table("set_capture", self._CAPTURE_OFF)
+
+    def read_step_capture(self)->np.ndarray:
+        """
+        Stops the step edge capture and returns the recorded raw MCU ticks (uint32, oldest first).
+        Ticks wrap around at 2^32, there are get_sub_us_divider() ticks per microsecond.
+        Returns None if the firmware does not support it.
+        """
+        cmd = self._cmd_map["get_capture"]
+        words = self._send_bulk_cmd(cmd_index=cmd.cmd_ind,var_type=cmd.var_type)
+        if words is None:
+            return None
+        return np.array(words, dtype=np.uint32)
+
+    def start_trace(self, fpath: str, slot_count: int = 65536)->SerialTrace:
+        """
+        Records every frame on the serial link with its perf_counter_ns() timestamp into a memory-mapped ring file of slot_count frames
+        (32 bytes each), replayed or dumped by TraceReplay.py. Started before connect(), the connection handshake is recorded as well.
+        A running trace is replaced.
+        """
+        self.stop_trace()
+        trace = SerialTrace(fpath, slot_count)
+        self._trace = trace
+        self._trace_baudrate()
+        return trace
+
+    def stop_trace(self):
+        trace = self._trace
+        self._trace = None
+        if not (trace is None):
+            trace.close()
+
+    def refresh_state(self)->bool:
+        """
+        Reads the device state of all pumps with one multi-frame response, e.g. before a burst of status queries.
+        Returns False if the firmware does not support it, pumps then read what they need one by one (see Pump.get_state()).
+        """
+        cmd = self._cmd_map["get_state"]
+        time_ns = perf_counter_ns() #the state is at least this recent
+        stop_seqs = [pump._stop_seq for pump in self.pumps]
+        words = self._send_bulk_cmd(cmd_index=cmd.cmd_ind,var_type=cmd.var_type)
+        if (words is None) or (len(words) < self._STATE_HEADER_LEN) or (words[0] != 1) or (words[3] < self.pump_count):
+            return False
+        for i in range(self.pump_count):
+            ind = self._STATE_HEADER_LEN + i * self._STATE_MOTOR_LEN
+            self.pumps[i]._apply_state(words[ind:ind + self._STATE_MOTOR_LEN], time_ns, stop_seqs[i])
+        return True
+
+    def get_sub_us_divider(self)->int:
+        #number of MCU ticks per microsecond
+        return int(self._sub_us_divider)
+
+    def mcu_tick_to_time(self, tick: int)->float:
+        #converts an MCU tick (e.g. PumpEvent.mcu_tick) to seconds since epoch, None if not supported
+        if self.mcu_clock is None:
+            return None
+        return self.mcu_clock.tick_to_time(tick)
     
-    def save_config(self, fpath:str=None):
-        self._lock_config.acquire()
+    def get_config(self)->dict:
+        #current settings in the layout of the config file
         config = {
             "device": {
                 "serial_port": self._serial_port,
                 "serial_baudrate": self._serial_baudrate,
+                "clock_sync_interval_s": self._clock_sync_interval_s,
+                "protocol_version": self._protocol_version,
+                "serial_low_latency": self._serial_low_latency,
             },
             "pump_count": self.pump_count,
         }
@@ -936,19 +2254,29 @@ class HiPeristalticInterface():
                 "motor_var_ustep_support": self.pumps[i]._motor_var_ustep_support,
                 "motor_max_ustep_exp": self.pumps[i]._motor_max_ustep_exp,
                 "motor_min_ustep_exp": self.pumps[i]._motor_min_ustep_exp,
+                "acceleration_rpm_per_s": self.pumps[i]._accel_rpm_per_s,
             }
+            if not (self.pumps[i].calibration_curve is None):
+                config["pumps"]["pump"+str(i)]["calibration_curve"] = self.pumps[i].calibration_curve
+            if not (self.pumps[i].volume_resolution_uL is None):
+                config["pumps"]["pump"+str(i)]["volume_resolution_uL"] = self.pumps[i].volume_resolution_uL
+        if not (self.step_rate_budget is None):
+            config["device"]["step_rate_budget"] = self.step_rate_budget
+        return config
+
+    def save_config(self, fpath:str=None):
+        self._lock_config.acquire()
+        config = self.get_config()
         if fpath is None:
             if self._last_config_fpath is None:
                 self._last_config_fpath = os.path.dirname(__file__) + "/HiPeristaltic.toml"
         else:
             self._last_config_fpath = fpath
         try:
-            with open(fpath, 'w') as f:
+            with open(self._last_config_fpath, 'w') as f:
                 toml.dump(config, f)
-            fpath = self._last_config_fpath
         except Exception as e:
-            logging.critical(f"Error writing settings: {e}")
-            print(f"Error writing settings: {e}")
+            _log.critical(f"Error writing settings: {e}")
         self._lock_config.release()
 
     def load_config(self, fpath:str=None):
@@ -957,16 +2285,25 @@ class HiPeristalticInterface():
         self._last_config_fpath = fpath
         self._lock_config.acquire()
         if not os.path.exists(fpath):
-            logging.critical(f"Config file not found at {fpath}.")
-            print(f"Config file not found at {fpath}.")
+            _log.critical(f"Config file not found at {fpath}.")
             self._lock_config.release()
             raise Exception(f"Config file not found at {fpath}.")
         with open(fpath, 'r') as f:
             config = toml.load(f)
-            self._serial_port = config["device"]["serial_port"]
-            self._serial_baudrate = config["device"]["serial_baudrate"]
-            self.pump_count = config["pump_count"]
-            self.config = config
+        self._lock_config.release()
+        return self.set_config(config)
+
+    def set_config(self, config: dict)->dict:
+        #settings in the layout of the config file, e.g. one board of a rack (see HiPeristalticRack), applied at connect()
+        self._lock_config.acquire()
+        self._serial_port = config["device"]["serial_port"]
+        self._serial_baudrate = config["device"]["serial_baudrate"]
+        self._clock_sync_interval_s = config["device"].get("clock_sync_interval_s", self._clock_sync_interval_s)
+        self._protocol_version = config["device"].get("protocol_version", self._protocol_version)
+        self._serial_low_latency = config["device"].get("serial_low_latency", self._serial_low_latency)
+        self.step_rate_budget = config["device"].get("step_rate_budget", self.step_rate_budget)
+        self.pump_count = config["pump_count"]
+        self.config = config
         self._lock_config.release()
         return config
     
@@ -980,6 +2317,8 @@ class HiPeristalticInterface():
             self.pumps[i].direction_default = config["pumps"]["pump"+str(i)]["direction_default"]
             self.pumps[i]._max_rpm = config["pumps"]["pump"+str(i)]["max_rpm"]
             self.pumps[i]._motor_dir_inverse = config["pumps"]["pump"+str(i)]["motor_dir_inverse"]
+            self.pumps[i].calibration_curve = config["pumps"]["pump"+str(i)].get("calibration_curve", None)
+            self.pumps[i].volume_resolution_uL = config["pumps"]["pump"+str(i)].get("volume_resolution_uL", None)
         return True
     
     def _apply_pump_config_post(self, config: dict):
@@ -987,33 +2326,85 @@ class HiPeristalticInterface():
             self.pumps[i]._motor_var_ustep_support = (self.pumps[i]._motor_var_ustep_support and config["pumps"]["pump"+str(i)]["motor_var_ustep_support"])
             if not self.pumps[i]._motor_var_ustep_support:
                 self.pumps[i]._motor_usteps = config["pumps"]["pump"+str(i)]["motor_usteps"]
+            accel = config["pumps"]["pump"+str(i)].get("acceleration_rpm_per_s", 0.0)
+            if not self.pumps[i].set_acceleration_rpm_per_s(accel):
+                _log.warning(f"Pump {i} has no pulse engine, acceleration_rpm_per_s is ignored.")
         return True
     
+    def _send_stop_all(self, mask: int, disable: bool)->Event:
+        #priority path: bypasses _lock_send, the frame is written between two frames of the normal path
+        #returns the event set once the MCU confirmed it
+        for i in range(self.pump_count):
+            if mask & (1 << i):
+                with self.pumps[i]._lock_state:
+                    self.pumps[i]._stop_seq += 1 #start sequences in progress give up
+        cmd = self._cmd_map["stop_all"]
+        buffer = bytearray(self._MSG_LEN + 1)
+        _FRAME_STRUCTS[cmd.var_type].pack_into(buffer, 0, cmd.cmd_ind, mask | (self._STOP_ALL_MAGIC << 8) | (int(disable) << 24))
+        event_done = Event()
+        with self._lock_write: #same order of frames and confirmations
+            self._stop_all_pending.append((mask, disable, event_done))
+            self._write_frame(buffer)
+        return event_done
+
+    def _probe_stop_all(self)->bool:
+        #an empty mask stops nothing, firmwares without stop_all reply with an error
+        self._acquire_send("stop")
+        self._cmd_failed = False
+        self._pending_reply = "stop"
+        tx_time_ns = perf_counter_ns()
+        result = self._send_stop_all(0, False).wait(self._reply_timeout_s) and (not self._cmd_failed)
+        self._cmd_failed = not result
+        self._pending_reply = None
+        self._stop_all_pending.clear()
+        self._release_send("stop", tx_time_ns)
+        return result
+
+    def stop_all(self, pump_inds: list = None, disable: bool = False)->bool:
+        """
+        Stops all pumps (or the ones in pump_inds) on the same MCU tick, ahead of the commands waiting on the host and on the MCU, e.g. for spills.
+        With disable, the motors are disabled as well. Starts sent before the stop are rejected by the MCU.
+        Returns True once the MCU confirmed the stop, False without confirmation or on firmwares without the command (see stop_all_pumps()).
+        """
+        if not self._stop_all_support:
+            return False
+        if pump_inds is None:
+            pump_inds = range(self.pump_count)
+        mask = 0
+        for i in pump_inds:
+            mask |= 1 << i
+        if self._send_stop_all(mask, disable).wait(self._stop_all_timeout_s):
+            return True
+        _log.critical("MCU did not confirm the stop.")
+        return False
+
     def emergency_stop(self):
+        #all pumps at once through the priority path, one by one on firmwares without it
+        if self.stop_all(disable=True):
+            _log.info("All pumps have been disabled due to emergency stop command.")
+            return True
         result = True
         for i in range(self.pump_count):
             try:
                 result = (result and self.pumps[i]._set_m_enabled(False))
             except:
-                logging.critical(f"Could not emergency stop the pump {i}.")
-                print(f"Could not emergency stop the pump {i}.")
+                _log.critical("Could not emergency stop the pump.", extra=_fields(pump=i))
             if result == False:
-                logging.critical(f"Could not emergency stop the pump {i}.")
-                print(f"Could not emergency stop the pump {i}.")
+                _log.critical("Could not emergency stop the pump.", extra=_fields(pump=i))
             else:
-                logging.info(f"Pump {i} has been disabled due to emergency stop command.")
-                print(f"Pump {i} has been disabled due to emergency stop command.")
+                _log.info("Pump has been disabled due to emergency stop command.", extra=_fields(pump=i))
         return result
     
     def stop_all_pumps(self):
+        if self.stop_all():
+            return True
         result = True
         for i in range(self.pump_count):
             try:
                 self.pumps[i].pump_stop()
             except:
                 result = False
-                logging.critical(f"Could not stop the pump {i}.")
-                print(f"Could not stop the pump {i}.")
+                _log.critical("Could not stop the pump.", extra=_fields(pump=i))
         return result
 
 #test code
@@ -0,0 +1,169 @@
+# Copyright 2025 Gun Deniz Akkoc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# https://github.com/gunakkoc/HiPeristaltic
+
+# Metrics of the serial link(s) and the pumps in the Prometheus text format, served over local HTTP for scraping.
+# The interface records them on the fly (counters and fixed bucket histograms, no locks on the send path), they are only
+# formatted here when scraped. Nothing is sent to the MCU for a scrape.
+#   hiperistaltic_cmd_queue_seconds      wait for the serial link before a command is sent, i.e. contention between callers
+#   hiperistaltic_cmd_reply_seconds      command written to reply received, i.e. link and MCU latency
+#   hiperistaltic_cmd_queue_depth        commands ahead of a new command
+#   hiperistaltic_cmd_failed_total       commands without a valid reply, hiperistaltic_reply_timeouts_total of them by timeout
+#   hiperistaltic_rx_errors_total        corrupted frames from the MCU, hiperistaltic_mcu_rx_errors_total corrupted frames to the MCU
+#   hiperistaltic_pump_running_seconds_total, e.g. rate() of it is the duty cycle of a pump
+# Example:
+#   python HiPeristalticMetrics.py --config HiPeristaltic.toml --http-port 9464
+#   curl http://127.0.0.1:9464/metrics
+
+from http.server import ThreadingHTTPServer, BaseHTTPRequestHandler
+from threading import Thread
+import argparse
+import logging
+try:
+    from .HiPeristalticInterface import HiPeristalticInterface, Histogram, event_log
+except ImportError:
+    from HiPeristalticInterface import HiPeristalticInterface, Histogram, event_log
+
+DEFAULT_METRICS_PORT = 9464
+_PREFIX = "hiperistaltic_"
+
+def _labels(labels: dict)->str:
+    if len(labels) == 0:
+        return ""
+    return "{" + ",".join(f'{key}="{val}"' for key, val in labels.items()) + "}"
+
+class _MetricsText():
+    #collects the samples of each metric, written out grouped by metric with a single TYPE line
+    def __init__(self):
+        self._metrics = {}
+
+    def add(self, name: str, metric_type: str, help_text: str, val, **labels):
+        self._metrics.setdefault(name, (metric_type, help_text, []))[2].append(f"{_PREFIX}{name}{_labels(labels)} {val}")
+
+    def add_histogram(self, name: str, help_text: str, hist: Histogram, **labels):
+        lines = self._metrics.setdefault(name, ("histogram", help_text, []))[2]
+        cumulative = 0
+        for bound, cnt in zip(hist.bounds, hist.counts):
+            cumulative += cnt
+            lines.append(f"{_PREFIX}{name}_bucket{_labels({**labels, 'le': bound})} {cumulative}")
+        cumulative += hist.counts[-1]
+        lines.append(f"{_PREFIX}{name}_bucket{_labels({**labels, 'le': '+Inf'})} {cumulative}")
+        lines.append(f"{_PREFIX}{name}_sum{_labels(labels)} {hist.total}")
+        lines.append(f"{_PREFIX}{name}_count{_labels(labels)} {cumulative}")
+
+    def text(self)->str:
+        out = []
+        for name, (metric_type, help_text, lines) in self._metrics.items():
+            out.append(f"# HELP {_PREFIX}{name} {help_text}")
+            out.append(f"# TYPE {_PREFIX}{name} {metric_type}")
+            out.extend(lines)
+        return "\n".join(out) + "\n"
+
+def render_metrics(driver)->str:
+    #driver is a HiPeristalticInterface or a HiPeristalticRack, pumps are labeled with their index in driver.pumps
+    boards = driver.boards if hasattr(driver, "boards") else [driver]
+    m = _MetricsText()
+    pump_ind = 0
+    for board_ind, board in enumerate(boards):
+        b = str(board_ind)
+        m.add("connected", "gauge", "1 if the serial link of the board is connected.", int(board.status == "Connected"), board=b)
+        for kind in board._CMD_KINDS:
+            m.add_histogram("cmd_queue_seconds", "Wait for the serial link before a command is sent.", board._m_queue_s[kind], board=b, kind=kind)
+        for kind in board._CMD_KINDS:
+            m.add_histogram("cmd_reply_seconds", "Time from writing a command to its reply.", board._m_reply_s[kind], board=b, kind=kind)
+        m.add_histogram("cmd_queue_depth", "Commands ahead of a new command, including the one in progress.", board._m_queue_depth, board=b)
+        for kind in board._CMD_KINDS:
+            m.add("cmd_failed_total", "counter", "Commands without a valid reply.", board._m_failed[kind], board=b, kind=kind)
+        m.add("reply_timeouts_total", "counter", "Commands that got no reply in time.", board._m_reply_timeouts, board=b)
+        m.add("tx_frames_total", "counter", "Frames written to the MCU.", board._m_tx_frames, board=b)
+        m.add("rx_frames_total", "counter", "Valid frames received from the MCU.", board._m_rx_frames, board=b)
+        m.add("rx_errors_total", "counter", "Corrupted frames received from the MCU.", board._rx_total_error_cnt, board=b)
+        m.add("rx_consecutive_errors", "gauge", "Corrupted frames received from the MCU since the last valid one.", board._rx_error_cnt, board=b)
+        m.add("mcu_rx_errors_total", "counter", "Frames that reached the MCU corrupted.", board._m_mcu_rx_errors, board=b)
+        if board._mcu_tick_support:
+            m.add("mcu_clock_drift_ppm", "gauge", "Drift of the MCU clock against the host clock.", board.mcu_clock.get_drift_ppm(), board=b)
+            uncertainty_s = board.mcu_clock.get_uncertainty_s()
+            if not (uncertainty_s is None):
+                m.add("mcu_clock_uncertainty_seconds", "gauge", "Uncertainty of MCU event timestamps.", uncertainty_s, board=b)
+        for i in range(board.pump_count):
+            pump = board.pumps[i]
+            p = str(pump_ind)
+            m.add("pump_running", "gauge", "1 if the pump is running.", int(pump.get_running()), pump=p, board=b)
+            m.add("pump_running_seconds_total", "counter", "Time the pump spent running.", pump.get_running_s(), pump=p, board=b)
+            pump_ind += 1
+    m.add("log_dropped_total", "counter", "Log records dropped because the log writer fell behind.", event_log.dropped)
+    return m.text()
+
+class _MetricsHandler(BaseHTTPRequestHandler):
+    driver = None
+
+    def do_GET(self):
+        if self.path.split("?")[0] != "/metrics":
+            self.send_error(404)
+            return
+        body = render_metrics(self.driver).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain; version=0.0.4; charset=utf-8")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass #scrapes are too frequent for the log
+
+class MetricsServer():
+    """
+    Serves render_metrics(driver) at http://host:port/metrics from a daemon thread.
+    Binds to the local host only by default, the metrics are not meant to leave the machine without a scraper in between.
+    """
+    def __init__(self, driver, port: int = DEFAULT_METRICS_PORT, host: str = "127.0.0.1"):
+        handler = type("MetricsHandler", (_MetricsHandler,), {"driver": driver})
+        self._httpd = ThreadingHTTPServer((host, port), handler)
+        self._httpd.daemon_threads = True
+        self._thread = None
+
+    def start(self):
+        self._thread = Thread(target=self._httpd.serve_forever, daemon=True)
+        self._thread.start()
+        logging.info(f"Metrics served at http://{self._httpd.server_address[0]}:{self._httpd.server_address[1]}/metrics")
+
+    def stop(self):
+        self._httpd.shutdown()
+        self._httpd.server_close()
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Serves the metrics of the pump board(s) in the Prometheus text format.")
+    parser.add_argument("--config", default=None, help="pump config file (toml), default is HiPeristaltic.toml")
+    parser.add_argument("--rack", default=None, help="rack config file (toml), used instead of --config")
+    parser.add_argument("--port", default=None, help="serial port, overrides the config (single board only)")
+    parser.add_argument("--http-port", type=int, default=DEFAULT_METRICS_PORT, help="HTTP port of the metrics")
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.INFO)
+
+    if args.rack is None:
+        driver = HiPeristalticInterface()
+        driver.load_config(args.config)
+        driver.connect(serial_port=args.port)
+    else:
+        try:
+            from .HiPeristalticRack import HiPeristalticRack
+        except ImportError:
+            from HiPeristalticRack import HiPeristalticRack
+        driver = HiPeristalticRack()
+        driver.load_config(args.rack)
+        driver.connect()
+    server = MetricsServer(driver, port=args.http_port)
+    server.start()
+    server._thread.join()
@@ -0,0 +1,195 @@
+# Copyright 2025 Gun Deniz Akkoc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# https://github.com/gunakkoc/HiPeristaltic
+
+# Several HiPeristaltic boards behind one flat list of pumps, e.g. to serve a whole rack with a single SiLA server.
+# The boards are defined in one config file (HiPeristalticRack.toml), each [[boards]] entry has the layout of HiPeristaltic.toml.
+# Pumps are numbered in the order of the boards, i.e. the first pump of the second board follows the last pump of the first board.
+# Each board keeps its own serial port, reader thread and command lock, so commands to pumps of different boards run in parallel
+# when they are called from different threads (e.g. SiLA command instances).
+
+from concurrent.futures import ThreadPoolExecutor
+from collections import deque
+from threading import Lock
+from copy import copy
+import logging
+import toml
+import os
+try:
+    from .HiPeristalticInterface import HiPeristalticInterface, Pump, PumpEvent
+except ImportError:
+    from HiPeristalticInterface import HiPeristalticInterface, Pump, PumpEvent
+
+class HiPeristalticRack():
+    status: str = "Disconnected"
+    pump_count: int = 0
+    pumps: list[Pump] = None #all pumps of all boards, in board order
+    boards: list[HiPeristalticInterface] = None
+    config: dict = None
+    event_history: deque = None #last asynchronous events of all boards with rack pump indices, oldest first
+
+    _pump_map: list = None #(board, pump index on the board) by rack pump index
+    _event_listeners: list = None
+    _lock_config: Lock
+    _last_config_fpath: str = None
+
+    def __init__(self):
+        self.pumps = []
+        self.boards = []
+        self._pump_map = []
+        self._event_listeners = []
+        self.event_history = deque(maxlen=256)
+        self._lock_config = Lock()
+
+    def _run_parallel(self, func: callable)->list:
+        #calls func(board) for all boards at once, returns the results in board order, exceptions are returned instead of raised
+        if len(self.boards) == 0:
+            return []
+        with ThreadPoolExecutor(max_workers=len(self.boards)) as executor:
+            futures = [executor.submit(func, board) for board in self.boards]
+        results = []
+        for future in futures:
+            try:
+                results.append(future.result())
+            except Exception as e:
+                results.append(e)
+        return results
+
+    def connect(self, conn_delay_s: float = 3):
+        """
+        Connects all boards in parallel and builds the flat pump list.
+        Raises if any board fails, after closing the ones that connected.
+        """
+        results = self._run_parallel(lambda board: board.connect(conn_delay_s=conn_delay_s))
+        errors = [f"{board._serial_port}: {result}" for board, result in zip(self.boards, results) if isinstance(result, Exception)]
+        if len(errors) > 0:
+            for board in self.boards:
+                if not (board._serial_com is None):
+                    board._serial_com.close()
+            self.status = "Disconnected"
+            logging.critical(f"Could not connect to the boards of the rack. {errors}")
+            raise Exception(f"Could not connect to the boards of the rack. {errors}")
+        self.pumps = []
+        self._pump_map = []
+        for board in self.boards:
+            board.add_event_listener(lambda event, offset=len(self.pumps): self._on_board_event(event, offset))
+            for i in range(board.pump_count):
+                self.pumps.append(board.pumps[i])
+                self._pump_map.append((board, i))
+        self.pump_count = len(self.pumps)
+        self.status = "Connected"
+        logging.info(f"{len(self.boards)} boards with {self.pump_count} pumps have been initalized.")
+        return True
+
+    def get_board(self, pump_ind: int):
+        #board of a pump and the index of the pump on that board
+        return self._pump_map[pump_ind]
+
+    ### Events
+
+    def _on_board_event(self, event: PumpEvent, offset: int):
+        #runs in the reader thread of the board, listeners must return quickly
+        event = copy(event)
+        event.pump_ind += offset
+        self.event_history.append(event)
+        for func in list(self._event_listeners):
+            try:
+                func(event)
+            except Exception as e:
+                logging.error(f"Event listener failed for {event}: {e}")
+
+    def add_event_listener(self, func: callable):
+        #func(event: PumpEvent) is called for every asynchronous event of any board, with the rack pump index
+        self._event_listeners.append(func)
+
+    def remove_event_listener(self, func: callable):
+        if func in self._event_listeners:
+            self._event_listeners.remove(func)
+
+    ### Config
+
+    def get_config(self)->dict:
+        return {"boards": [board.get_config() for board in self.boards]}
+
+    def save_config(self, fpath: str = None):
+        self._lock_config.acquire()
+        config = self.get_config()
+        if fpath is None:
+            if self._last_config_fpath is None:
+                self._last_config_fpath = os.path.dirname(__file__) + "/HiPeristalticRack.toml"
+        else:
+            self._last_config_fpath = fpath
+        try:
+            with open(self._last_config_fpath, 'w') as f:
+                toml.dump(config, f)
+        except Exception as e:
+            logging.critical(f"Error writing settings: {e}")
+        self._lock_config.release()
+
+    def load_config(self, fpath: str = None):
+        if fpath is None:
+            fpath = os.path.dirname(__file__) + "/HiPeristalticRack.toml"
+        self._last_config_fpath = fpath
+        if not os.path.exists(fpath):
+            logging.critical(f"Config file not found at {fpath}.")
+            raise Exception(f"Config file not found at {fpath}.")
+        with open(fpath, 'r') as f:
+            config = toml.load(f)
+        return self.set_config(config)
+
+    def set_config(self, config: dict)->dict:
+        #creates one interface per [[boards]] entry, applied at connect()
+        self._lock_config.acquire()
+        self.boards = []
+        for board_config in config["boards"]:
+            board = HiPeristalticInterface()
+            board.set_config(board_config)
+            self.boards.append(board)
+        self.pump_count = sum(board.pump_count for board in self.boards)
+        self.config = config
+        self._lock_config.release()
+        return config
+
+    ### All pumps
+
+    def stop_all(self, pump_inds: list = None, disable: bool = False)->bool:
+        #priority stop of the boards at once, pump_inds are rack indices, see HiPeristalticInterface.stop_all()
+        if pump_inds is None:
+            pump_inds = range(self.pump_count)
+        board_pump_inds = {}
+        for i in pump_inds:
+            board, board_pump_ind = self._pump_map[i]
+            board_pump_inds.setdefault(board, []).append(board_pump_ind)
+        results = self._run_parallel(lambda board: board.stop_all(board_pump_inds[board], disable) if (board in board_pump_inds) else True)
+        return all((result is True) for result in results)
+
+    def emergency_stop(self):
+        #all boards at once
+        results = self._run_parallel(lambda board: board.emergency_stop())
+        return all((result is True) for result in results)
+
+    def stop_all_pumps(self):
+        results = self._run_parallel(lambda board: board.stop_all_pumps())
+        return all((result is True) for result in results)
+
+#test code
+if __name__ == "__main__":
+    test = HiPeristalticRack()
+    test.load_config()
+    test.connect()
+    print(f"{len(test.boards)} boards, {test.pump_count} pumps")
+    for i in range(test.pump_count):
+        board, board_pump_ind = test.get_board(i)
+        print(f"Pump {i}: {board._serial_port} pump {board_pump_ind}, max flow rate (uL/s): {test.pumps[i].get_max_flow_rate_uLpersec()}")
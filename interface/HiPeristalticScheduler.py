@@ -0,0 +1,273 @@
+# Copyright 2025 Gun Deniz Akkoc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# https://github.com/gunakkoc/HiPeristaltic
+
+# Host side dispense scheduler that keeps each pump busy with queued jobs back to back.
+# Jobs wait in one queue per pump. The next job starts as soon as the pump finishes the previous one (end event of the MCU, no polling).
+# Order within a queue: higher priority first, then earliest deadline first (jobs without a deadline last), then submission order.
+# A job with not_before (host epoch seconds) does not start earlier, the other jobs of its pump may run meanwhile.
+# Consecutive jobs share the parameters already on the MCU (direction, step interval, mode), only the changed ones are written,
+# so a job with the same flow rate and direction as the previous one costs two frames (steps and start).
+# Works with a HiPeristalticInterface or a HiPeristalticRack (rack pump indices).
+# Example:
+#   scheduler = HiPeristalticScheduler(hp)
+#   scheduler.add_event_listener(print)
+#   job = scheduler.submit(pump_ind=0, volume_uL=50, flow_rate_uLpersec=10, deadline=time() + 60)
+#   job.wait()
+#   print(job.state, job.dispensed_uL, job.late, scheduler.get_utilization())
+
+from threading import Thread, Condition, Event
+from itertools import count
+from time import time
+import logging
+import math
+
+class DispenseJob():
+    job_id: int = 0
+    pump_ind: int = 0
+    volume_uL: float = 0.0
+    flow_rate_uLpersec: float = 0.0
+    direction: str = None #None for the default direction of the pump
+    not_before: float = None #earliest start, host epoch seconds
+    deadline: float = None #latest end, host epoch seconds, only used for ordering
+    priority: int = 0 #higher runs first, regardless of deadlines
+    state: str = "queued" #queued, running, finished, stopped (by another command), failed (rejected by the pump), cancelled
+    submit_time: float = None
+    start_time: float = None #when the MCU acknowledged the start
+    end_time: float = None
+    dispensed_uL: float = None #volume pumped by the job, less than volume_uL if stopped
+
+    def __init__(self, job_id: int, pump_ind: int, volume_uL: float, flow_rate_uLpersec: float, direction: str = None,
+                 not_before: float = None, deadline: float = None, priority: int = 0):
+        self.job_id = job_id
+        self.pump_ind = pump_ind
+        self.volume_uL = volume_uL
+        self.flow_rate_uLpersec = flow_rate_uLpersec
+        self.direction = direction
+        self.not_before = not_before
+        self.deadline = deadline
+        self.priority = priority
+        self.submit_time = time()
+        self._event_done = Event()
+
+    def __repr__(self):
+        return f"DispenseJob(job_id={self.job_id}, pump_ind={self.pump_ind}, volume_uL={self.volume_uL}, state={self.state})"
+
+    @property
+    def late(self)->bool:
+        #ended after its deadline, or still not ended past it
+        if self.deadline is None:
+            return False
+        return (time() if (self.end_time is None) else self.end_time) > self.deadline
+
+    def wait(self, timeout_s: float = None)->bool:
+        #until the job is done in any way, False on timeout
+        return self._event_done.wait(timeout_s)
+
+    def _sort_key(self)->tuple:
+        return (-self.priority, math.inf if (self.deadline is None) else self.deadline, self.job_id)
+
+    def _eligible(self, now: float)->bool:
+        return (self.not_before is None) or (self.not_before <= now)
+
+class JobEvent():
+    name: str = "" #queued, started, finished, stopped, failed, cancelled
+    job: DispenseJob = None
+    time: float = None #host epoch seconds
+
+    def __init__(self, name: str, job: DispenseJob):
+        self.name = name
+        self.job = job
+        self.time = time()
+
+    def __repr__(self):
+        return f"JobEvent(name={self.name}, job={self.job}, time={self.time:.6f})"
+
+class HiPeristalticScheduler():
+    driver = None #HiPeristalticInterface or HiPeristalticRack, connected
+
+    _queues: list = None #queued jobs by pump index, unordered, picked by _next_job()
+    _cond: Condition #guards the queues, notified on submit, cancel and shutdown
+    _ids = None
+    _closed: bool = False
+    _busy_s: list = None #time spent on jobs by pump index since _window_start
+    _running_since: list = None #start time of the running job by pump index, None if idle
+    _window_start: float = 0.0
+    _event_listeners: list = None
+    _threads: list = None
+
+    def __init__(self, driver):
+        self.driver = driver
+        self._queues = [[] for _ in range(driver.pump_count)]
+        self._cond = Condition()
+        self._ids = count()
+        self._busy_s = [0.0] * driver.pump_count
+        self._running_since = [None] * driver.pump_count
+        self._window_start = time()
+        self._event_listeners = []
+        self._threads = [Thread(target=self._worker_thread_func, args=(i,), daemon=True) for i in range(driver.pump_count)]
+        for thread in self._threads:
+            thread.start()
+
+    ### Jobs
+
+    def submit(self, pump_ind: int, volume_uL: float, flow_rate_uLpersec: float, direction: str = None,
+               not_before: float = None, deadline: float = None, priority: int = 0)->DispenseJob:
+        if (pump_ind < 0) or (pump_ind >= len(self._queues)):
+            raise IndexError(f"Pump index {pump_ind} is out of range.")
+        if (volume_uL <= 0) or (flow_rate_uLpersec <= 0):
+            raise ValueError("Volume and flow rate must be positive.")
+        with self._cond:
+            if self._closed:
+                raise RuntimeError("Scheduler is shut down.")
+            job = DispenseJob(next(self._ids), pump_ind, volume_uL, flow_rate_uLpersec, direction, not_before, deadline, priority)
+            self._queues[pump_ind].append(job)
+            self._cond.notify_all()
+        self._dispatch_event(JobEvent("queued", job))
+        return job
+
+    def cancel(self, job: DispenseJob)->bool:
+        #only queued jobs, a running job is stopped with pump_stop() of its pump
+        with self._cond:
+            if not (job in self._queues[job.pump_ind]):
+                return False
+            self._queues[job.pump_ind].remove(job)
+        self._finish(job, "cancelled")
+        return True
+
+    def get_queue(self, pump_ind: int)->list:
+        #queued jobs of the pump in the order they would run if all were eligible
+        with self._cond:
+            return sorted(self._queues[pump_ind], key=DispenseJob._sort_key)
+
+    def get_utilization(self, reset: bool = False)->list:
+        #fraction of time each pump spent on jobs since the scheduler was created or last reset
+        now = time()
+        with self._cond:
+            window_s = now - self._window_start
+            busy_s = [busy + ((now - since) if not (since is None) else 0) for busy, since in zip(self._busy_s, self._running_since)]
+            if reset:
+                self._window_start = now
+                self._busy_s = [0.0] * len(self._busy_s)
+                self._running_since = [None if (since is None) else now for since in self._running_since]
+        return [(busy / window_s) if (window_s > 0) else 0.0 for busy in busy_s]
+
+    def shutdown(self, cancel_queued: bool = True):
+        #running jobs are left to finish
+        with self._cond:
+            self._closed = True
+            jobs = [job for queue in self._queues for job in queue] if cancel_queued else []
+            if cancel_queued:
+                self._queues = [[] for _ in self._queues]
+            self._cond.notify_all()
+        for job in jobs:
+            self._finish(job, "cancelled")
+
+    ### Events
+
+    def _dispatch_event(self, event: JobEvent):
+        #runs in the caller or in the worker of the pump, listeners must return quickly
+        for func in list(self._event_listeners):
+            try:
+                func(event)
+            except Exception as e:
+                logging.error(f"Job event listener failed for {event}: {e}")
+
+    def add_event_listener(self, func: callable):
+        #func(event: JobEvent) is called for every state change of every job
+        self._event_listeners.append(func)
+
+    def remove_event_listener(self, func: callable):
+        if func in self._event_listeners:
+            self._event_listeners.remove(func)
+
+    ### Workers, one per pump
+
+    def _next_job(self, pump_ind: int):
+        #best eligible job and None, or None and the time until the next job becomes eligible (None if the queue is empty)
+        now = time()
+        queue = self._queues[pump_ind]
+        eligible = [job for job in queue if job._eligible(now)]
+        if len(eligible) > 0:
+            return min(eligible, key=DispenseJob._sort_key), None
+        if len(queue) == 0:
+            return None, None
+        return None, min(job.not_before for job in queue) - now
+
+    def _worker_thread_func(self, pump_ind: int):
+        pump = self.driver.pumps[pump_ind]
+        while True:
+            with self._cond:
+                while True:
+                    if self._closed and (len(self._queues[pump_ind]) == 0):
+                        return
+                    job, wait_s = self._next_job(pump_ind)
+                    if not (job is None):
+                        self._queues[pump_ind].remove(job)
+                        break
+                    self._cond.wait(wait_s)
+            while not pump.wait_stopped(): #busy with a run that was not scheduled
+                pass
+            self._run(pump, job)
+
+    def _run(self, pump, job: DispenseJob):
+        try:
+            started = pump.pump_volume(target_volume_uL=job.volume_uL, flow_rate_uLpersec=job.flow_rate_uLpersec, direction=job.direction, blocking=False)
+        except Exception as e:
+            logging.error(f"Starting {job} failed: {e}")
+            started = False
+        if not started:
+            self._finish(job, "failed")
+            return
+        job.start_time = time()
+        job.state = "running"
+        with self._cond:
+            self._running_since[job.pump_ind] = job.start_time
+        self._dispatch_event(JobEvent("started", job))
+        target_volume_uL = pump.get_target_volume_uL()
+        while not pump.wait_stopped():
+            pass
+        remaining_volume_uL = pump.get_remaining_volume_uL()
+        job.end_time = time()
+        job.dispensed_uL = target_volume_uL - remaining_volume_uL
+        with self._cond:
+            self._busy_s[job.pump_ind] += job.end_time - self._running_since[job.pump_ind]
+            self._running_since[job.pump_ind] = None
+        self._finish(job, "finished" if (remaining_volume_uL == 0) else "stopped")
+
+    def _finish(self, job: DispenseJob, state: str):
+        job.state = state
+        if job.end_time is None:
+            job.end_time = time()
+        job._event_done.set()
+        self._dispatch_event(JobEvent(state, job))
+
+#test code
+if __name__ == "__main__":
+    try:
+        from .HiPeristalticInterface import HiPeristalticInterface
+    except ImportError:
+        from HiPeristalticInterface import HiPeristalticInterface
+    hp = HiPeristalticInterface()
+    hp.load_config()
+    hp.connect()
+    scheduler = HiPeristalticScheduler(hp)
+    scheduler.add_event_listener(print)
+    now = time()
+    jobs = [scheduler.submit(pump_ind=i % hp.pump_count, volume_uL=20, flow_rate_uLpersec=20, deadline=now + 30 - i) for i in range(8)]
+    for job in jobs:
+        job.wait()
+    print(f"Utilization: {scheduler.get_utilization()}")
+    scheduler.shutdown()
@@ -0,0 +1,157 @@
+# Copyright 2025 Gun Deniz Akkoc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# https://github.com/gunakkoc/HiPeristaltic
+
+# Step pulse timing analysis from the on-device step edge capture (see HiPeristalticInterface.start_step_capture).
+# Either captures from a connected pump while running it at a given rpm, or analyzes a previously saved capture.
+# Example:
+#   python StepCaptureAnalysis.py --pump 0 --rpm 60 --duration 2 --save capture.npz
+#   python StepCaptureAnalysis.py --load capture.npz --bins 50
+
+import argparse
+import logging
+import numpy as np
+
+_TICK_WRAP = 1 << 32
+
+def ticks_to_intervals_us(ticks: np.ndarray, ticks_per_us: float, decimation: int = 1)->np.ndarray:
+    #intervals between consecutive recorded edges, per step, in us
+    ticks = np.asarray(ticks, dtype=np.int64)
+    deltas = np.diff(ticks) % _TICK_WRAP #wrap-safe
+    return deltas / (ticks_per_us * decimation)
+
+def ticks_to_times_us(ticks: np.ndarray, ticks_per_us: float)->np.ndarray:
+    #edge times relative to the first recorded edge, unwrapped, in us
+    ticks = np.asarray(ticks, dtype=np.int64)
+    deltas = np.diff(ticks) % _TICK_WRAP
+    return np.concatenate(([0], np.cumsum(deltas))) / ticks_per_us
+
+def interval_histogram(intervals_us: np.ndarray, bins: int = 30):
+    #returns (counts, bin edges in us)
+    return np.histogram(intervals_us, bins=bins)
+
+def interval_spectrum(intervals_us: np.ndarray, decimation: int = 1):
+    """
+    Spectrum of the interval deviations, i.e. the periodic components of the step jitter.
+    The interval sequence is sampled once per recorded edge, so the frequency axis uses the mean interval.
+    Returns (frequencies in Hz, amplitudes in us), DC removed, Hann windowed.
+    """
+    n = len(intervals_us)
+    if n < 4:
+        return np.array([]), np.array([])
+    deviation = intervals_us - np.mean(intervals_us)
+    window = np.hanning(n)
+    amplitudes = np.abs(np.fft.rfft(deviation * window)) * 2 / np.sum(window)
+    sample_period_s = np.mean(intervals_us) * decimation / 1e6
+    freqs = np.fft.rfftfreq(n, d=sample_period_s)
+    return freqs[1:], amplitudes[1:]
+
+def analyze_step_capture(ticks: np.ndarray, ticks_per_us: float, decimation: int = 1, expected_interval_us: float = None, n_peaks: int = 5)->dict:
+    """
+    Timing statistics of a step edge capture, all times in us.
+    jitter_rms is the standard deviation of the step intervals (cycle-to-cycle period jitter),
+    tie_rms is the rms time interval error, i.e. the deviation of each edge from an ideal pulse train fitted to all edges.
+    If expected_interval_us is given, the offset of the mean interval from it is reported as well.
+    """
+    intervals = ticks_to_intervals_us(ticks, ticks_per_us, decimation)
+    if len(intervals) < 2:
+        return None
+    times = ticks_to_times_us(ticks, ticks_per_us)
+    edge_ind = np.arange(len(times))
+    slope, intercept = np.polyfit(edge_ind, times, 1)
+    tie = times - (intercept + slope * edge_ind)
+    freqs, amplitudes = interval_spectrum(intervals, decimation)
+    peak_ind = np.argsort(amplitudes)[::-1][:n_peaks]
+    result = {
+        "edge_count": len(ticks),
+        "decimation": decimation,
+        "duration_us": times[-1],
+        "interval_mean_us": np.mean(intervals),
+        "interval_min_us": np.min(intervals),
+        "interval_max_us": np.max(intervals),
+        "interval_p01_us": np.percentile(intervals, 1),
+        "interval_p99_us": np.percentile(intervals, 99),
+        "jitter_rms_us": np.std(intervals),
+        "jitter_pp_us": np.max(intervals) - np.min(intervals),
+        "tie_rms_us": np.sqrt(np.mean(tie ** 2)),
+        "tie_pp_us": np.max(tie) - np.min(tie),
+        "step_rate_hz": 1e6 / np.mean(intervals),
+        "spectrum_peaks": [(freqs[i], amplitudes[i]) for i in peak_ind], #(Hz, us)
+    }
+    if not (expected_interval_us is None):
+        result["expected_interval_us"] = expected_interval_us
+        result["interval_error_ppm"] = (result["interval_mean_us"] / expected_interval_us - 1) * 1e6
+    return result
+
+def print_report(ticks: np.ndarray, ticks_per_us: float, decimation: int = 1, expected_interval_us: float = None, bins: int = 30):
+    result = analyze_step_capture(ticks, ticks_per_us, decimation, expected_interval_us)
+    if result is None:
+        print("Not enough edges captured.")
+        return None
+    for key, val in result.items():
+        if key == "spectrum_peaks":
+            continue
+        print(f"{key:>22}: {val:.4f}" if isinstance(val, float) else f"{key:>22}: {val}")
+    print("Interval histogram (us):")
+    counts, edges = interval_histogram(ticks_to_intervals_us(ticks, ticks_per_us, decimation), bins)
+    bar_scale = 50 / max(1, np.max(counts))
+    for i in range(len(counts)):
+        print(f"  {edges[i]:>12.3f} - {edges[i+1]:>12.3f}: {counts[i]:>7} {'#' * int(np.ceil(counts[i] * bar_scale))}")
+    print("Largest jitter components (Hz: amplitude us):")
+    for freq, amp in result["spectrum_peaks"]:
+        print(f"  {freq:>12.3f}: {amp:.4f}")
+    return result
+
+def capture_from_device(config_fpath: str, pump_ind: int, rpm: float, duration_s: float, decimation: int = 1, oneshot: bool = False, serial_port: str = None):
+    #runs the pump at rpm while capturing, returns (ticks, ticks per us, expected interval in us)
+    from HiPeristalticInterface import HiPeristalticInterface
+    hp = HiPeristalticInterface()
+    hp.load_config(config_fpath)
+    hp.connect(serial_port=serial_port)
+    pump = hp.pumps[pump_ind]
+    if not hp.start_step_capture(pump_ind, decimation=decimation, oneshot=oneshot):
+        raise Exception("Firmware does not support step capture.")
+    pump.pump_duration_rpm(duration_sec=duration_s, rpm=rpm, blocking=True)
+    ticks = hp.read_step_capture()
+    expected_interval_us = pump._motor_step_interval / hp.get_sub_us_divider()
+    return ticks, hp.get_sub_us_divider(), expected_interval_us
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Step pulse timing analysis from the on-device step edge capture.")
+    parser.add_argument("--config", default=None, help="pump config file (toml), default is HiPeristaltic.toml")
+    parser.add_argument("--port", default=None, help="serial port, overrides the config")
+    parser.add_argument("--pump", type=int, default=0, help="pump index, 0 indexed")
+    parser.add_argument("--rpm", type=float, default=60)
+    parser.add_argument("--duration", type=float, default=2, help="run duration in seconds")
+    parser.add_argument("--decimation", type=int, default=1, help="record every nth edge")
+    parser.add_argument("--oneshot", action="store_true", help="keep the first edges instead of the last ones")
+    parser.add_argument("--load", default=None, help="analyze a saved capture (.npz) instead of capturing")
+    parser.add_argument("--save", default=None, help="save the capture (.npz)")
+    parser.add_argument("--bins", type=int, default=30)
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.WARNING)
+
+    if args.load is None:
+        ticks, ticks_per_us, expected_interval_us = capture_from_device(args.config, args.pump, args.rpm, args.duration, args.decimation, args.oneshot, args.port)
+        decimation = args.decimation
+    else:
+        data = np.load(args.load)
+        ticks = data["ticks"]
+        ticks_per_us = float(data["ticks_per_us"])
+        decimation = int(data["decimation"])
+        expected_interval_us = float(data["expected_interval_us"])
+    if not (args.save is None):
+        np.savez(args.save, ticks=ticks, ticks_per_us=ticks_per_us, decimation=decimation, expected_interval_us=expected_interval_us)
+    print_report(ticks, ticks_per_us, decimation, expected_interval_us, args.bins)
@@ -0,0 +1,296 @@
+# Copyright 2025 Gun Deniz Akkoc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# https://github.com/gunakkoc/HiPeristaltic
+
+# Dumps or replays a serial trace recorded by HiPeristalticInterface.start_trace().
+# Without --port, the frames of the trace are printed with their time, direction and decoded command.
+# With --port, the recorded TX frames are written to a board (a serial port or any pyserial URL such as socket://host:port)
+# in the recorded order: each frame waits for the RX frames that preceded it in the recording, then for its recorded time
+# (or not at all with --asap). UART rate changes are applied at the same point. The reply latencies of the replay are then
+# compared to the recorded ones, overall and per command, along with the replies that differ or are missing.
+# With --scripted instead of --port, a ScriptedDevice stands in for the board: it answers each TX frame with the RX frames
+# that followed it in the recording, after their recorded delay. No hardware is needed, the latencies then show the overhead of the replay itself.
+# The replay starts from the first frame of the trace, so traces that begin with connect() replay the connection handshake as well.
+# Example:
+#   hp.start_trace("session.bin"); hp.connect(); ...; hp.stop_trace()
+#   python TraceReplay.py --trace session.bin
+#   python TraceReplay.py --trace session.bin --port /dev/ttyACM0 --asap
+#   python TraceReplay.py --trace session.bin --scripted
+
+from threading import Thread, Condition
+from time import perf_counter_ns, sleep
+from datetime import datetime
+import argparse
+import logging
+import struct
+import serial
+import numpy as np
+try:
+    from .HiPeristalticInterface import HiPeristalticInterface, SerialTrace, _cobs_decode
+except ImportError:
+    from HiPeristalticInterface import HiPeristalticInterface, SerialTrace, _cobs_decode
+
+_MSG = struct.Struct("<BI")
+_KIND_NAMES = {SerialTrace.TX: "TX", SerialTrace.RX: "RX", SerialTrace.RX_CORRUPT: "RX!", SerialTrace.BAUDRATE: "BAUD"}
+_CMD_NAMES = {cmd.cmd_ind: name for name, cmd in HiPeristalticInterface._cmd_map.items()}
+_REPLY_NAMES = {255: "checksum_err", 254: "cmd_err", 253: "ack", 252: "booted", 251: "stop_all_done"}
+_REPLY_NAMES.update({200 + i: f"m{i}_end" for i in range(4)})
+_REPLY_NAMES.update({204 + i: f"m{i}_end_steps" for i in range(4)})
+
+def decode_msg(kind: int, protocol: int, data: bytes):
+    #command byte and argument of a frame, None if it is not a complete message
+    if protocol == 2:
+        data = _cobs_decode(data.strip(b"\x00"))
+    if (data is None) or (len(data) < _MSG.size):
+        return None
+    return _MSG.unpack_from(data, 0)
+
+def msg_name(kind: int, cmd: int)->str:
+    if (kind != SerialTrace.TX) and (cmd in _REPLY_NAMES):
+        return _REPLY_NAMES[cmd]
+    return _CMD_NAMES.get(cmd, str(cmd))
+
+def dump(start_time: float, records: list):
+    print(f"Trace started at {datetime.fromtimestamp(start_time)}, {len(records)} records")
+    for t_ns, kind, protocol, data in records:
+        if kind == SerialTrace.BAUDRATE:
+            print(f"{t_ns / 1e6:12.3f} ms  BAUD {struct.unpack('<I', data)[0]}")
+            continue
+        msg = decode_msg(kind, protocol, data)
+        text = "?" if (msg is None) else f"{msg_name(kind, msg[0])} {msg[1]}"
+        print(f"{t_ns / 1e6:12.3f} ms  {_KIND_NAMES.get(kind, kind):4} v{protocol} {data.hex(' '):30} {text}")
+
+def reply_latencies(events: list)->list:
+    #(command byte of the TX frame, ns until the first RX frame before the next TX frame, None without one) per TX frame
+    latencies = []
+    pending = None
+    for t_ns, is_tx, cmd in events:
+        if is_tx:
+            if not (pending is None):
+                latencies.append((pending[1], None))
+            pending = (t_ns, cmd)
+        elif not (pending is None):
+            latencies.append((pending[1], t_ns - pending[0]))
+            pending = None
+    if not (pending is None):
+        latencies.append((pending[1], None))
+    return latencies
+
+class ScriptedDevice():
+    """
+    Stands in for the board during a replay, with the part of the pyserial API that _Replayer uses.
+    Each TX frame written is answered with the RX frames that followed the same TX frame of the recording (by position),
+    each after its recorded delay from that TX frame. RX frames recorded ahead of the first TX frame are sent at once.
+    """
+    def __init__(self, records: list, timeout: float = 0.05):
+        self.timeout = timeout
+        self.baudrate = None #set by the replay, not used
+        self._script = [] #(TX frame, [(delay ns, RX frame with its delimiter)]) per recorded TX frame
+        self._pending = [] #(due perf_counter_ns(), RX frame), in order
+        self._cond = Condition()
+        replies = []
+        t_tx_ns = records[0][0] if (len(records) > 0) else 0
+        for t_ns, kind, protocol, data in records:
+            if kind == SerialTrace.TX:
+                t_tx_ns = t_ns
+                replies = []
+                self._script.append((bytes(data), replies))
+            elif kind in (SerialTrace.RX, SerialTrace.RX_CORRUPT):
+                frame = (bytes(data) + b"\x00") if (protocol == 2) else bytes(data) #v2 frames are recorded without delimiter
+                if len(self._script) == 0:
+                    self._pending.append((perf_counter_ns(), frame))
+                else:
+                    replies.append((t_ns - t_tx_ns, frame))
+        self._ind = 0 #of the next TX frame in the script
+
+    @property
+    def in_waiting(self)->int:
+        with self._cond:
+            now_ns = perf_counter_ns()
+            return sum(len(frame) for due_ns, frame in self._pending if due_ns <= now_ns)
+
+    def write(self, data: bytes)->int:
+        t_ns = perf_counter_ns()
+        if self._ind >= len(self._script):
+            logging.warning("Scripted device received more frames than recorded, not answered.")
+            return len(data)
+        expected, replies = self._script[self._ind]
+        self._ind += 1
+        if bytes(data) != expected:
+            logging.warning(f"Scripted device received {bytes(data).hex(' ')} instead of {expected.hex(' ')}, answered as recorded.")
+        with self._cond:
+            self._pending.extend((t_ns + delay_ns, frame) for delay_ns, frame in replies)
+            self._pending.sort(key=lambda item: item[0]) #replies of consecutive frames may interleave
+            self._cond.notify()
+        return len(data)
+
+    def read(self, size: int = 1)->bytes:
+        #due bytes up to size, waits up to timeout for the first of them
+        deadline_ns = perf_counter_ns() + self.timeout * 1e9
+        data = bytearray()
+        with self._cond:
+            while True:
+                now_ns = perf_counter_ns()
+                while (len(self._pending) > 0) and (self._pending[0][0] <= now_ns) and (len(data) < size):
+                    frame = self._pending[0][1]
+                    take = min(size - len(data), len(frame))
+                    data += frame[:take]
+                    if take < len(frame):
+                        self._pending[0] = (self._pending[0][0], frame[take:])
+                    else:
+                        del self._pending[0]
+                if (len(data) > 0) or (now_ns >= deadline_ns):
+                    return bytes(data)
+                due_ns = self._pending[0][0] if (len(self._pending) > 0) else deadline_ns
+                self._cond.wait(max(0, min(due_ns, deadline_ns) - now_ns) / 1e9)
+
+    def close(self):
+        pass
+
+class _Replayer():
+    def __init__(self, records: list, port: str, asap: bool, timeout_s: float):
+        #port None replays to a ScriptedDevice
+        self.records = records
+        self.asap = asap
+        self.timeout_s = timeout_s
+        self.rx_protocols = [protocol for _, kind, protocol, _ in records if kind in (SerialTrace.RX, SerialTrace.RX_CORRUPT)]
+        baudrates = [struct.unpack("<I", data)[0] for _, kind, _, data in records if kind == SerialTrace.BAUDRATE]
+        if port is None:
+            self.serial_com = ScriptedDevice(records)
+        else:
+            self.serial_com = serial.serial_for_url(port, baudrate=baudrates[0] if (len(baudrates) > 0) else 115200, timeout=0.05)
+        self.rx = [] #(perf_counter_ns(), frame), appended by the reader thread only
+        self.events = [] #(perf_counter_ns(), is TX, command byte) of the replay
+        self._running = True
+
+    def _read_thread_func(self):
+        #splits the replies with the framing of the recorded reply at the same position
+        buf = bytearray()
+        while self._running:
+            data = self.serial_com.read(max(1, self.serial_com.in_waiting))
+            if len(data) == 0:
+                continue
+            t_ns = perf_counter_ns()
+            buf += data
+            while True:
+                protocol = self.rx_protocols[min(len(self.rx), len(self.rx_protocols) - 1)] if (len(self.rx_protocols) > 0) else 1
+                if protocol == 2:
+                    end = buf.find(0)
+                    if end < 0:
+                        break
+                    frame = bytes(buf[:end])
+                    del buf[:end + 1]
+                    if len(frame) == 0:
+                        continue
+                else:
+                    if len(buf) < 6:
+                        break
+                    frame = bytes(buf[:6])
+                    del buf[:6]
+                msg = decode_msg(SerialTrace.RX, protocol, frame)
+                self.rx.append((t_ns, frame))
+                self.events.append((t_ns, False, None if (msg is None) else msg[0]))
+
+    def _wait_rx(self, count: int)->bool:
+        deadline_ns = perf_counter_ns() + self.timeout_s * 1e9
+        while len(self.rx) < count:
+            if perf_counter_ns() > deadline_ns:
+                return False
+            sleep(0.0001)
+        return True
+
+    def run(self)->int:
+        #returns the number of recorded RX frames that did not arrive
+        reader = Thread(target=self._read_thread_func, daemon=True)
+        reader.start()
+        t0_ns = perf_counter_ns()
+        t0_rec_ns = self.records[0][0] if (len(self.records) > 0) else 0
+        rx_expected = 0
+        rx_missing = 0
+        for t_ns, kind, protocol, data in self.records:
+            if kind in (SerialTrace.RX, SerialTrace.RX_CORRUPT):
+                rx_expected += 1
+                continue
+            if not self._wait_rx(rx_expected - rx_missing):
+                rx_missing = rx_expected - len(self.rx)
+                logging.warning(f"{rx_missing} recorded replies missing at {t_ns / 1e6:.3f} ms of the trace.")
+            if not self.asap:
+                wait_ns = (t0_ns + t_ns - t0_rec_ns) - perf_counter_ns()
+                if wait_ns > 0:
+                    sleep(wait_ns / 1e9)
+            if kind == SerialTrace.BAUDRATE:
+                self.serial_com.baudrate = struct.unpack("<I", data)[0]
+                continue
+            msg = decode_msg(kind, protocol, data)
+            self.events.append((perf_counter_ns(), True, None if (msg is None) else msg[0])) #ahead of the write, as recorded
+            self.serial_com.write(data)
+        if not self._wait_rx(rx_expected - rx_missing):
+            rx_missing = rx_expected - len(self.rx)
+        sleep(0.05) #late frames
+        self._running = False
+        reader.join()
+        self.serial_com.close()
+        return max(0, rx_expected - len(self.rx))
+
+def _summary(name: str, latencies_ns: list)->str:
+    if len(latencies_ns) == 0:
+        return f"{name:>10}: no replies"
+    us = np.array(latencies_ns) / 1e3
+    return f"{name:>10}: n={len(us)} median={np.median(us):.0f} us p95={np.percentile(us, 95):.0f} us max={us.max():.0f} us"
+
+def compare(records: list, replayer: _Replayer, rx_missing: int):
+    recorded_events = []
+    for t_ns, kind, protocol, data in records:
+        if kind == SerialTrace.BAUDRATE:
+            continue
+        msg = decode_msg(kind, protocol, data)
+        recorded_events.append((t_ns, kind == SerialTrace.TX, None if (msg is None) else msg[0]))
+    recorded = reply_latencies(recorded_events)
+    replayed = reply_latencies(sorted(replayer.events, key=lambda event: event[0])) #appended by two threads
+    n = min(len(recorded), len(replayed))
+    print(_summary("recorded", [lat for _, lat in recorded[:n] if not (lat is None)]))
+    print(_summary("replayed", [lat for _, lat in replayed[:n] if not (lat is None)]))
+    print("Median reply latency per command (us), recorded -> replayed:")
+    for cmd in sorted(set(cmd for cmd, _ in recorded[:n] if not (cmd is None))):
+        rec = [lat for (c, lat) in recorded[:n] if (c == cmd) and not (lat is None)]
+        rep = [lat for (c, lat), (c2, _) in zip(replayed[:n], recorded[:n]) if (c2 == cmd) and not (lat is None)]
+        if (len(rec) > 0) and (len(rep) > 0):
+            print(f"  {msg_name(SerialTrace.TX, cmd):28} n={len(rec):5} {np.median(rec) / 1e3:9.0f} -> {np.median(rep) / 1e3:9.0f}")
+    recorded_rx = [decode_msg(kind, protocol, data) for _, kind, protocol, data in records if kind in (SerialTrace.RX, SerialTrace.RX_CORRUPT)]
+    replayed_rx = [decode_msg(SerialTrace.RX, protocol, frame) for (_, frame), protocol in zip(replayer.rx, replayer.rx_protocols)]
+    differing = sum(1 for a, b in zip(recorded_rx, replayed_rx) if (a is None) or (b is None) or (a[0] != b[0]))
+    print(f"Replies: {len(recorded_rx)} recorded, {len(replayer.rx)} replayed, {differing} with a different reply code, {rx_missing} missing")
+    duration = [events[-1][0] - events[0][0] for events in (recorded_events, replayer.events) if len(events) > 0]
+    if len(duration) == 2:
+        print(f"Duration: {duration[0] / 1e9:.3f} s recorded, {duration[1] / 1e9:.3f} s replayed")
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Dumps or replays a serial trace of a HiPeristaltic board.")
+    parser.add_argument("--trace", required=True, help="trace file recorded by HiPeristalticInterface.start_trace()")
+    target = parser.add_mutually_exclusive_group()
+    target.add_argument("--port", default=None, help="serial port or pyserial URL of a board to replay to, the trace is dumped without it or --scripted")
+    target.add_argument("--scripted", action="store_true", help="replay to a scripted device answering with the recorded replies, no board needed")
+    parser.add_argument("--asap", action="store_true", help="send each frame as soon as its preceding replies arrived, instead of at its recorded time")
+    parser.add_argument("--timeout", type=float, default=2.0, help="longest wait (s) for the replies preceding a frame")
+    args = parser.parse_args()
+    logging.basicConfig(level=logging.INFO)
+
+    start_time, records = SerialTrace.read(args.trace)
+    if (args.port is None) and not args.scripted:
+        dump(start_time, records)
+    else:
+        replayer = _Replayer(records, args.port, args.asap, args.timeout)
+        rx_missing = replayer.run()
+        compare(records, replayer, rx_missing)
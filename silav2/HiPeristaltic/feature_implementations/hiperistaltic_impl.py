@@ -17,14 +17,23 @@
 # Generated by sila2.code_generator; sila2.__version__: 0.12.2
 from __future__ import annotations
 from .HiPeristalticInterface import HiPeristalticInterface
+from .HiPeristalticRack import HiPeristalticRack
+from .HiPeristalticMetrics import MetricsServer
 from datetime import timedelta
-from time import sleep
-from typing import TYPE_CHECKING
+from concurrent.futures import ThreadPoolExecutor
+from threading import Thread, Event, Lock
+from time import perf_counter, sleep
+from typing import TYPE_CHECKING, List
+import logging
+import os
 
 from sila2.server import MetadataDict, ObservableCommandInstance, ObservableCommandInstanceWithIntermediateResponses
 
 from ..generated.hiperistaltic import (
     HiPeristalticBase,
+    DispenseBatch_IntermediateResponses,
+    DispenseBatch_Responses,
+    DispenseEntry,
     ResumePump_IntermediateResponses,
     ResumePump_Responses,
     SetPumpCalibration_Responses,
@@ -38,7 +47,7 @@ from ..generated.hiperistaltic import (
     FlowRateOutOfRange,
     TargetVolumeOutOfRange,
     RPMOutOfRange,
-    # PumpIndexOutOfRange, #one can add other exceptions defined in XML to here
+    PumpIndexOutOfRange, #one can add other exceptions defined in XML to here
 )
 
 if TYPE_CHECKING:
@@ -47,11 +56,17 @@ if TYPE_CHECKING:
 
 class HiPeristalticImpl(HiPeristalticBase):
 
-    driver: HiPeristalticInterface = None
+    driver: HiPeristalticInterface = None #or a HiPeristalticRack, both have the same pumps list
+    progress_interval_s: float = 0.33 #max interval of the intermediate responses of running pumps, also the max age of their step counts
+    status_interval_s: float = 0.5 #sampling interval of the observable properties, shared by all subscribers
+    metrics_port: int = 9464 #local HTTP port of the metrics in the Prometheus text format, 0 to disable
 
     def __init__(self, parent_server: Server) -> None:
         super().__init__(parent_server=parent_server)
-        self.driver = HiPeristalticInterface()
+        if os.path.exists(os.path.dirname(__file__) + "/HiPeristalticRack.toml"): #several boards, pump indices continue across boards
+            self.driver = HiPeristalticRack()
+        else:
+            self.driver = HiPeristalticInterface()
         self.driver.load_config()
         self.driver.connect()
         # Default lifetime of observable command instances. Possible values:
@@ -62,20 +77,93 @@ class HiPeristalticImpl(HiPeristalticBase):
         self.StopPump_default_lifetime_of_execution = timedelta(minutes=30)
         self.ResumePump_default_lifetime_of_execution = timedelta(minutes=30)
         self.StartPumpCalibration_default_lifetime_of_execution = timedelta(minutes=30)
+        self.DispenseBatch_default_lifetime_of_execution = timedelta(minutes=30)
+        # Observable properties are sampled by one thread, the sila2 server forwards each update to all subscribers
+        self._status_wake = Event()
+        self.driver.add_event_listener(lambda event: self._status_wake.set()) #end of runs are published at once
+        Thread(target=self._status_thread_func, daemon=True).start()
+        self._metrics_server = None
+        if self.metrics_port > 0:
+            try:
+                self._metrics_server = MetricsServer(self.driver, port=self.metrics_port)
+                self._metrics_server.start()
+            except OSError as e: #e.g. port in use by another server instance, pumps work without metrics
+                logging.error(f"Metrics server could not be started on port {self.metrics_port}: {e}")
+
+    def _sample_status(self)->dict:
+        #values of the observable properties from the state cache of the driver, only the remaining steps of running
+        #finite runs are read from the MCU, at most once per status_interval_s
+        status = self.driver.status
+        pumps = self.driver.pumps
+        running = [bool(pump.get_running()) for pump in pumps]
+        return {
+            "PumpConnected": status == "Connected",
+            "DriverStatus": status,
+            "PumpRunning": running,
+            "PumpFlowRate": [float(pump.get_flow_rate_uLpersec()) if running[i] else 0.0 for i, pump in enumerate(pumps)],
+            "PumpRemainingVolume": [float(pump.get_remaining_volume_uL(max_age_s=self.status_interval_s)) for pump in pumps],
+            "PumpTargetVolume": [float(pump.get_target_volume_uL()) for pump in pumps],
+        }
+
+    def _status_thread_func(self):
+        #updates only the properties that changed, immediately on pump events and commands, otherwise every status_interval_s
+        last_status = {}
+        while True:
+            try:
+                status = self._sample_status()
+            except Exception as e:
+                logging.error(f"Sampling the pump status failed: {e}")
+                status = {"PumpConnected": False, "DriverStatus": self.driver.status}
+            for name, val in status.items():
+                if last_status.get(name) != val:
+                    getattr(self, "update_" + name)(val)
+            last_status.update(status)
+            self._status_wake.wait(self.status_interval_s)
+            self._status_wake.clear()
 
     def SetPumpCalibration(
         self, PumpIndex: int, CalibrationParameter: float, *, metadata: MetadataDict
     ) -> SetPumpCalibration_Responses:
         PumpIndex = PumpIndex - 1
+        if (PumpIndex < 0) or (PumpIndex >= self.driver.pump_count):
+            raise PumpIndexOutOfRange
         if self.driver.pumps[PumpIndex].get_running():
-            # If the pump is already running then stop it first
+            # If the pump is already running then stop it first, acked by the MCU and seen at once by the command observing it
             self.driver.pumps[PumpIndex].pump_stop()
-            #then wait for the stopping to be registered by sila
-            sleep(1.5)
         self.driver.pumps[PumpIndex].uL_per_rev = CalibrationParameter
+        self.driver.pumps[PumpIndex].calibration_curve = None #a single factor replaces the rpm dependent calibration
         self.driver.save_config()
         return SetPumpCalibration_Responses(True)
 
+    def _observe_run(self, pump, instance, send_volume: callable, target_volume_uL: float = None)->float:
+        #waits for the end or stop of the run of pump, sends the pumped volume in uL by send_volume(vol) when it changes,
+        #at most every progress_interval_s and once more when the pump stops, returns the final pumped volume
+        #finite runs (target_volume_uL given) are measured by the remaining steps of the MCU, continuous runs by integrating
+        #the flow rate from the start acknowledgement on, so that rate changes are followed
+        self._status_wake.set()
+        pumped_vol_uL = None
+        integrated_vol_uL = 0.0
+        t_last = perf_counter()
+        while True:
+            stopped = pump.wait_stopped(self.progress_interval_s)
+            if target_volume_uL is None:
+                t = perf_counter()
+                integrated_vol_uL += pump.get_flow_rate_uLpersec() * (t - t_last)
+                t_last = t
+                vol_uL = integrated_vol_uL
+            else:
+                remaining_vol_uL = pump.get_remaining_volume_uL(max_age_s=self.progress_interval_s)
+                vol_uL = target_volume_uL - remaining_vol_uL
+                flow_rate_uLpersec = pump.get_flow_rate_uLpersec()
+                remaining_time_s = (remaining_vol_uL / flow_rate_uLpersec) if (flow_rate_uLpersec > 0) else 0
+                instance.estimated_remaining_time = timedelta(seconds=max(remaining_time_s, 0))
+                instance.progress = min(max(vol_uL / target_volume_uL, 0), 1)
+            if vol_uL != pumped_vol_uL:
+                pumped_vol_uL = vol_uL
+                send_volume(pumped_vol_uL)
+            if stopped:
+                return pumped_vol_uL
+
     def StartPump(
         self,
         PumpIndex: int,
@@ -89,39 +177,28 @@ class HiPeristalticImpl(HiPeristalticBase):
         # set execution status from `waiting` to `running`
         instance.begin_execution()
         PumpIndex = PumpIndex - 1
-        if self.driver.pumps[PumpIndex].get_running():
+        if (PumpIndex < 0) or (PumpIndex >= self.driver.pump_count):
+            raise PumpIndexOutOfRange
+        pump = self.driver.pumps[PumpIndex]
+        if pump.get_running():
             # If the pump is already running then stop it first
-            self.driver.pumps[PumpIndex].pump_stop()
-            #then wait for the stopping to be registered by sila
-            sleep(1.5)
-        if FlowRate > self.driver.pumps[PumpIndex].get_max_flow_rate_uLpersec():
+            pump.pump_stop()
+        if FlowRate > pump.get_max_flow_rate_uLpersec(PumpDirection):
             raise FlowRateOutOfRange
-        if FlowRate < self.driver.pumps[PumpIndex].get_min_flow_rate_uLpersec():
+        if FlowRate < pump.get_min_flow_rate_uLpersec(PumpDirection):
             raise FlowRateOutOfRange
-        if TargetVolume > self.driver.pumps[PumpIndex].get_max_volume_uL():
+        if TargetVolume > pump.get_max_volume_uL(PumpDirection):
             raise TargetVolumeOutOfRange
-        if TargetVolume < self.driver.pumps[PumpIndex].get_min_volume_uL():
+        if TargetVolume < pump.get_min_volume_uL(PumpDirection):
             raise TargetVolumeOutOfRange
+        instance.lifetime_of_execution = timedelta(seconds=TargetVolume / FlowRate + 300)
         # Start the pump
-        self.driver.pumps[PumpIndex].pump_volume(flow_rate_uLpersec=FlowRate, target_volume_uL=TargetVolume, direction=PumpDirection,blocking=False)
-        total_time_s = TargetVolume / FlowRate
-        instance.lifetime_of_execution = timedelta(seconds=total_time_s + 300)
-        elapsed_time_s = 0
-        while self.driver.pumps[PumpIndex].get_running():
-            sleep(0.33)
-            elapsed_time_s += 0.33
-            remaining_time_s = total_time_s - elapsed_time_s
-            if remaining_time_s < 0:
-                remaining_time_s = 0
-            instance.estimated_remaining_time = timedelta(seconds=remaining_time_s)
-            progress = elapsed_time_s / total_time_s
-            if progress > 1:
-                progress = 1
-            instance.progress = progress
-            instance.send_intermediate_response(StartPump_IntermediateResponses(elapsed_time_s*FlowRate)) #amount of liquid pumped in uL
-        
-        remaining_vol_uL = self.driver.pumps[PumpIndex].get_remaining_volume_uL()
-        pumped_vol_uL = TargetVolume - remaining_vol_uL
+        if not pump.pump_volume(flow_rate_uLpersec=FlowRate, target_volume_uL=TargetVolume, direction=PumpDirection, blocking=False):
+            return StartPump_Responses(0)
+        target_volume_uL = pump.get_target_volume_uL() #as rounded to steps
+        pumped_vol_uL = self._observe_run(pump, instance,
+                                          lambda vol: instance.send_intermediate_response(StartPump_IntermediateResponses(vol)), #amount of liquid pumped in uL
+                                          target_volume_uL=target_volume_uL)
         return StartPump_Responses(pumped_vol_uL)
 
     def StartPumpContinuous(
@@ -136,26 +213,23 @@ class HiPeristalticImpl(HiPeristalticBase):
         # set execution status from `waiting` to `running`
         instance.begin_execution()
         PumpIndex = PumpIndex - 1
-        if self.driver.pumps[PumpIndex].get_running():
+        if (PumpIndex < 0) or (PumpIndex >= self.driver.pump_count):
+            raise PumpIndexOutOfRange
+        pump = self.driver.pumps[PumpIndex]
+        if pump.get_running():
             # If the pump is already running then stop it first
-            self.driver.pumps[PumpIndex].pump_stop()
-            #then wait for the stopping to be registered by sila
-            sleep(1.5)
-        if FlowRate > self.driver.pumps[PumpIndex].get_max_flow_rate_uLpersec():
+            pump.pump_stop()
+        if FlowRate > pump.get_max_flow_rate_uLpersec(PumpDirection):
             raise FlowRateOutOfRange
-        if FlowRate < self.driver.pumps[PumpIndex].get_min_flow_rate_uLpersec():
+        if FlowRate < pump.get_min_flow_rate_uLpersec(PumpDirection):
             raise FlowRateOutOfRange
-        # Start the pump
-        self.driver.pumps[PumpIndex].pump_continuous(flow_rate_uLpersec=FlowRate, direction=PumpDirection)
         instance.lifetime_of_execution = timedelta(days=1)
-        elapsed_time_s = 0
-        while self.driver.pumps[PumpIndex].get_running():
-            sleep(0.33)
-            elapsed_time_s += 0.33
-            instance.send_intermediate_response(StartPump_IntermediateResponses(elapsed_time_s*FlowRate)) #amount of liquid pumped in uL
-        
-        pumped_vol_uL = elapsed_time_s*FlowRate
-        return StartPump_Responses(pumped_vol_uL)
+        # Start the pump
+        if not pump.pump_continuous(flow_rate_uLpersec=FlowRate, direction=PumpDirection):
+            return StartPumpContinuous_Responses(0)
+        pumped_vol_uL = self._observe_run(pump, instance,
+                                          lambda vol: instance.send_intermediate_response(StartPumpContinuous_IntermediateResponses(vol))) #amount of liquid pumped in uL
+        return StartPumpContinuous_Responses(pumped_vol_uL)
 
     def StopPump(
         self, PumpIndex: int, *, metadata: MetadataDict, instance: ObservableCommandInstance
@@ -163,7 +237,10 @@ class HiPeristalticImpl(HiPeristalticBase):
         # set execution status from `waiting` to `running`
         instance.begin_execution()
         PumpIndex = PumpIndex - 1
+        if (PumpIndex < 0) or (PumpIndex >= self.driver.pump_count):
+            raise PumpIndexOutOfRange
         result = self.driver.pumps[PumpIndex].pump_stop()
+        self._status_wake.set()
         return StopPump_Responses(result)
 
     def ResumePump(
@@ -176,31 +253,23 @@ class HiPeristalticImpl(HiPeristalticBase):
         # set execution status from `waiting` to `running`
         instance.begin_execution()
         PumpIndex = PumpIndex - 1
-        if self.driver.pumps[PumpIndex].get_running():
+        if (PumpIndex < 0) or (PumpIndex >= self.driver.pump_count):
+            raise PumpIndexOutOfRange
+        pump = self.driver.pumps[PumpIndex]
+        if pump.get_running():
             return ResumePump_Responses(0)
-        
+        finite = pump.get_state()["finite_mode"] == 1
+        target_volume_uL = pump.get_target_volume_uL() if finite else None
+        if finite:
+            instance.lifetime_of_execution = timedelta(seconds=pump.get_remaining_time().total_seconds() + 300)
+        else:
+            instance.lifetime_of_execution = timedelta(days=1)
         # Start the pump
-        target_volume_uL = self.driver.pumps[PumpIndex].get_target_volume_uL()
-        flow_rate_uLpersec = self.driver.pumps[PumpIndex].get_flow_rate_uLpersec()
-        self.driver.pumps[PumpIndex].pump_resume()
-        total_time_s = target_volume_uL / flow_rate_uLpersec
-        instance.lifetime_of_execution = timedelta(seconds=total_time_s + 300)
-        elapsed_time_s = total_time_s - self.driver.pumps[PumpIndex].get_remaining_time().total_seconds()
-        while self.driver.pumps[PumpIndex].get_running():
-            remaining_time_s = total_time_s - elapsed_time_s
-            if remaining_time_s < 0:
-                remaining_time_s = 0
-            instance.estimated_remaining_time = timedelta(seconds=remaining_time_s)
-            progress = elapsed_time_s / total_time_s
-            if progress > 1:
-                progress = 1
-            instance.progress = progress
-            instance.send_intermediate_response(ResumePump_IntermediateResponses(elapsed_time_s*flow_rate_uLpersec)) #amount of liquid pumped in uL
-            sleep(0.33)
-            elapsed_time_s += 0.33
-        
-        remaining_vol_uL = self.driver.pumps[PumpIndex].get_remaining_volume_uL()
-        pumped_vol_uL = target_volume_uL - remaining_vol_uL
+        pump.pump_resume()
+        #the pumped volume of a finite run includes the part pumped before it was stopped
+        pumped_vol_uL = self._observe_run(pump, instance,
+                                          lambda vol: instance.send_intermediate_response(ResumePump_IntermediateResponses(vol)), #amount of liquid pumped in uL
+                                          target_volume_uL=target_volume_uL)
         return ResumePump_Responses(pumped_vol_uL)
 
     def StartPumpCalibration(
@@ -216,32 +285,106 @@ class HiPeristalticImpl(HiPeristalticBase):
         # set execution status from `waiting` to `running`
         instance.begin_execution()
         PumpIndex = PumpIndex - 1
-        if self.driver.pumps[PumpIndex].get_running():
+        if (PumpIndex < 0) or (PumpIndex >= self.driver.pump_count):
+            raise PumpIndexOutOfRange
+        pump = self.driver.pumps[PumpIndex]
+        if pump.get_running():
             # If the pump is already running then stop it first
-            self.driver.pumps[PumpIndex].pump_stop()
-            #then wait for the stopping to be registered by sila
-            sleep(1.5)
-        if RPM > self.driver.pumps[PumpIndex].get_max_rpm():
+            pump.pump_stop()
+        if RPM > pump.get_max_rpm():
             raise RPMOutOfRange
-        if RPM < self.driver.pumps[PumpIndex].get_min_rpm():
+        if RPM < pump.get_min_rpm():
             raise RPMOutOfRange
-        temp_vol_uL = TargetRevolutions * self.driver.pumps[PumpIndex].uL_per_rev
-        total_time_s = (TargetRevolutions / RPM) * 60
-        temp_flow_rate_uLpersec = temp_vol_uL / total_time_s
-        elapsed_time_s = 0
-        instance.lifetime_of_execution = timedelta(seconds=total_time_s + 300)
-        self.driver.pumps[PumpIndex].pump_volume(flow_rate_uLpersec=temp_flow_rate_uLpersec, target_volume_uL=temp_vol_uL, direction=PumpDirection,blocking=False)
-        while self.driver.pumps[PumpIndex].get_running():
-            remaining_time_s = total_time_s - elapsed_time_s
-            if remaining_time_s < 0:
-                remaining_time_s = 0
-            instance.estimated_remaining_time = timedelta(seconds=remaining_time_s)
-            progress = elapsed_time_s / total_time_s
-            if progress > 1:
-                progress = 1
-            instance.progress = progress
-            instance.send_intermediate_response(StartPumpCalibration_IntermediateResponses((elapsed_time_s/60) * RPM))
-            sleep(0.33)
-            elapsed_time_s += 0.33
-
+        uL_per_rev = pump.get_uL_per_rev(RPM, PumpDirection) #volumes of the run are converted with it
+        instance.lifetime_of_execution = timedelta(seconds=(TargetRevolutions / RPM) * 60 + 300)
+        if not pump.pump_revs(revs=TargetRevolutions, rpm=RPM, direction=PumpDirection, blocking=False):
+            return StartPumpCalibration_Responses(False)
+        self._observe_run(pump, instance,
+                          lambda vol: instance.send_intermediate_response(StartPumpCalibration_IntermediateResponses(vol / uL_per_rev)), #revolutions done
+                          target_volume_uL=pump.get_target_volume_uL())
         return StartPumpCalibration_Responses(True)
+
+    def DispenseBatch(
+        self,
+        Entries: List[DispenseEntry],
+        *,
+        metadata: MetadataDict,
+        instance: ObservableCommandInstanceWithIntermediateResponses[DispenseBatch_IntermediateResponses],
+    ) -> DispenseBatch_Responses:
+        # set execution status from `waiting` to `running`
+        instance.begin_execution()
+        # All entries are checked before any pump starts
+        pump_entries = {} #entry indices by pump index, in the given order
+        pump_time_s = {} #delays and run times by pump index
+        total_volume_uL = 0.0
+        for i, entry in enumerate(Entries):
+            pump_ind = entry.PumpIndex - 1
+            if (pump_ind < 0) or (pump_ind >= self.driver.pump_count):
+                raise PumpIndexOutOfRange
+            pump = self.driver.pumps[pump_ind]
+            if (entry.FlowRate > pump.get_max_flow_rate_uLpersec(entry.PumpDirection)) or (entry.FlowRate < pump.get_min_flow_rate_uLpersec(entry.PumpDirection)):
+                raise FlowRateOutOfRange
+            if (entry.Volume > pump.get_max_volume_uL(entry.PumpDirection)) or (entry.Volume < pump.get_min_volume_uL(entry.PumpDirection)):
+                raise TargetVolumeOutOfRange
+            pump_entries.setdefault(pump_ind, []).append(i)
+            pump_time_s[pump_ind] = pump_time_s.get(pump_ind, 0) + entry.Delay + entry.Volume / entry.FlowRate
+            total_volume_uL += entry.Volume
+        if len(Entries) == 0:
+            return DispenseBatch_Responses([], True)
+        instance.lifetime_of_execution = timedelta(seconds=max(pump_time_s.values()) + 300)
+
+        dispensed_vol_uL = [0.0] * len(Entries)
+        finished = [0] #entries ended so far
+        active = {} #(entry index, target volume) of the running entry by pump index
+        lock_progress = Lock()
+        wake = Event() #an entry started or ended
+
+        def run_entries(pump_ind: int, entry_inds: list)->bool:
+            #entries of one pump one after another, False if the pump was stopped by another command (the rest is skipped)
+            pump = self.driver.pumps[pump_ind]
+            for i in entry_inds:
+                entry = Entries[i]
+                if entry.Delay > 0:
+                    sleep(entry.Delay)
+                if pump.get_running():
+                    pump.pump_stop()
+                if not pump.pump_volume(target_volume_uL=entry.Volume, flow_rate_uLpersec=entry.FlowRate, direction=entry.PumpDirection, blocking=False):
+                    return False
+                with lock_progress:
+                    active[pump_ind] = (i, pump.get_target_volume_uL())
+                wake.set()
+                self._status_wake.set()
+                while not pump.wait_stopped():
+                    pass
+                remaining_vol_uL = pump.get_remaining_volume_uL()
+                with lock_progress:
+                    dispensed_vol_uL[i] = active.pop(pump_ind)[1] - remaining_vol_uL
+                    finished[0] += 1
+                wake.set()
+                self._status_wake.set()
+                if remaining_vol_uL > 0:
+                    return False
+            return True
+
+        # One thread per pump, the command thread only reports the progress of all of them
+        with ThreadPoolExecutor(max_workers=len(pump_entries)) as executor:
+            futures = [executor.submit(run_entries, pump_ind, entry_inds) for pump_ind, entry_inds in pump_entries.items()]
+            last_progress = None
+            while True:
+                done = all(future.done() for future in futures)
+                with lock_progress:
+                    running = list(active.items())
+                    vol_uL = sum(dispensed_vol_uL)
+                    completed = finished[0]
+                for pump_ind, (i, target_volume_uL) in running:
+                    vol_uL += target_volume_uL - self.driver.pumps[pump_ind].get_remaining_volume_uL(max_age_s=self.progress_interval_s)
+                instance.progress = min(max(vol_uL / total_volume_uL, 0), 1)
+                if (vol_uL, completed) != last_progress:
+                    last_progress = (vol_uL, completed)
+                    instance.send_intermediate_response(DispenseBatch_IntermediateResponses(vol_uL, completed))
+                if done:
+                    break
+                wake.wait(self.progress_interval_s)
+                wake.clear()
+            results = [future.result() for future in futures]
+        return DispenseBatch_Responses(dispensed_vol_uL, all(results))
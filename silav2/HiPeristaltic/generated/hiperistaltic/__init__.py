@@ -13,6 +13,9 @@ from .hiperistaltic_errors import (
 )
 from .hiperistaltic_feature import HiPeristalticFeature
 from .hiperistaltic_types import (
+    DispenseBatch_IntermediateResponses,
+    DispenseBatch_Responses,
+    DispenseEntry,
     ResumePump_IntermediateResponses,
     ResumePump_Responses,
     SetPumpCalibration_Responses,
@@ -39,6 +42,9 @@ __all__ = [
     "ResumePump_IntermediateResponses",
     "StartPumpCalibration_Responses",
     "StartPumpCalibration_IntermediateResponses",
+    "DispenseBatch_Responses",
+    "DispenseBatch_IntermediateResponses",
+    "DispenseEntry",
     "PumpIndexOutOfRange",
     "FlowRateOutOfRange",
     "TargetVolumeOutOfRange",
@@ -4,7 +4,7 @@ from __future__ import annotations
 from abc import ABC, abstractmethod
 from datetime import timedelta
 from queue import Queue
-from typing import TYPE_CHECKING, Optional, Union
+from typing import TYPE_CHECKING, List, Optional, Union
 
 from sila2.server import (
     FeatureImplementationBase,
@@ -14,6 +14,9 @@ from sila2.server import (
 )
 
 from .hiperistaltic_types import (
+    DispenseBatch_IntermediateResponses,
+    DispenseBatch_Responses,
+    DispenseEntry,
     ResumePump_IntermediateResponses,
     ResumePump_Responses,
     SetPumpCalibration_Responses,
@@ -37,6 +40,21 @@ class HiPeristalticBase(FeatureImplementationBase, ABC):
     _PumpConnected_producer_queue: Queue[Union[bool, Exception]]
     _PumpConnected_current_value: bool
 
+    _PumpRunning_producer_queue: Queue[Union[List[bool], Exception]]
+    _PumpRunning_current_value: List[bool]
+
+    _PumpFlowRate_producer_queue: Queue[Union[List[float], Exception]]
+    _PumpFlowRate_current_value: List[float]
+
+    _PumpRemainingVolume_producer_queue: Queue[Union[List[float], Exception]]
+    _PumpRemainingVolume_current_value: List[float]
+
+    _PumpTargetVolume_producer_queue: Queue[Union[List[float], Exception]]
+    _PumpTargetVolume_current_value: List[float]
+
+    _DriverStatus_producer_queue: Queue[Union[str, Exception]]
+    _DriverStatus_current_value: str
+
     StartPump_default_lifetime_of_execution: Optional[timedelta]
 
     StartPumpContinuous_default_lifetime_of_execution: Optional[timedelta]
@@ -47,6 +65,8 @@ class HiPeristalticBase(FeatureImplementationBase, ABC):
 
     StartPumpCalibration_default_lifetime_of_execution: Optional[timedelta]
 
+    DispenseBatch_default_lifetime_of_execution: Optional[timedelta]
+
     def __init__(self, parent_server: Server):
         """
 
@@ -56,12 +76,18 @@ class HiPeristalticBase(FeatureImplementationBase, ABC):
         super().__init__(parent_server=parent_server)
 
         self._PumpConnected_producer_queue = Queue()
+        self._PumpRunning_producer_queue = Queue()
+        self._PumpFlowRate_producer_queue = Queue()
+        self._PumpRemainingVolume_producer_queue = Queue()
+        self._PumpTargetVolume_producer_queue = Queue()
+        self._DriverStatus_producer_queue = Queue()
 
         self.StartPump_default_lifetime_of_execution = None
         self.StartPumpContinuous_default_lifetime_of_execution = None
         self.StopPump_default_lifetime_of_execution = None
         self.ResumePump_default_lifetime_of_execution = None
         self.StartPumpCalibration_default_lifetime_of_execution = None
+        self.DispenseBatch_default_lifetime_of_execution = None
 
     def update_PumpConnected(self, PumpConnected: bool, queue: Optional[Queue[bool]] = None) -> None:
         """
@@ -108,6 +134,231 @@ class HiPeristalticBase(FeatureImplementationBase, ABC):
         except AttributeError:
             raise AttributeError("Observable property PumpConnected has never been set")
 
+    def update_PumpRunning(self, PumpRunning: List[bool], queue: Optional[Queue[List[bool]]] = None) -> None:
+        """
+        Whether each pump is running, one element per pump starting with pump index 1.
+
+        This method updates the observable property 'PumpRunning'.
+
+        :param queue: The queue to send updates to. If None, the default Queue will be used.
+        """
+        if queue is None:
+            queue = self._PumpRunning_producer_queue
+            self._PumpRunning_current_value = PumpRunning
+        queue.put(PumpRunning)
+
+    def PumpRunning_on_subscription(self, *, metadata: MetadataDict) -> Optional[Queue[List[bool]]]:
+        """
+        Whether each pump is running, one element per pump starting with pump index 1.
+
+        This method is called when a client subscribes to the observable property 'PumpRunning'
+
+        :param metadata: The SiLA Client Metadata attached to the call
+        :return: Optional `Queue` that should be used for updating this property.
+            If None, the default Queue will be used.
+        """
+
+    def abort_PumpRunning_subscriptions(self, error: Exception, queue: Optional[Queue[List[bool]]] = None) -> None:
+        """
+        Whether each pump is running, one element per pump starting with pump index 1.
+
+        This method aborts subscriptions to the observable property 'PumpRunning'.
+
+        :param error: The Exception to be sent to the subscribing client.
+            If it is no DefinedExecutionError or UndefinedExecutionError, it will be wrapped in an UndefinedExecutionError.
+        :param queue: The queue to abort. If None, the default Queue will be used.
+        """
+        if queue is None:
+            queue = self._PumpRunning_producer_queue
+        queue.put(error)
+
+    @property
+    def current_PumpRunning(self) -> List[bool]:
+        try:
+            return self._PumpRunning_current_value
+        except AttributeError:
+            raise AttributeError("Observable property PumpRunning has never been set")
+
+    def update_PumpFlowRate(self, PumpFlowRate: List[float], queue: Optional[Queue[List[float]]] = None) -> None:
+        """
+        Current flow rate of each pump in microliters per second, one element per pump starting with pump index 1.
+
+        This method updates the observable property 'PumpFlowRate'.
+
+        :param queue: The queue to send updates to. If None, the default Queue will be used.
+        """
+        if queue is None:
+            queue = self._PumpFlowRate_producer_queue
+            self._PumpFlowRate_current_value = PumpFlowRate
+        queue.put(PumpFlowRate)
+
+    def PumpFlowRate_on_subscription(self, *, metadata: MetadataDict) -> Optional[Queue[List[float]]]:
+        """
+        Current flow rate of each pump in microliters per second, one element per pump starting with pump index 1.
+
+        This method is called when a client subscribes to the observable property 'PumpFlowRate'
+
+        :param metadata: The SiLA Client Metadata attached to the call
+        :return: Optional `Queue` that should be used for updating this property.
+            If None, the default Queue will be used.
+        """
+
+    def abort_PumpFlowRate_subscriptions(self, error: Exception, queue: Optional[Queue[List[float]]] = None) -> None:
+        """
+        Current flow rate of each pump in microliters per second, one element per pump starting with pump index 1.
+
+        This method aborts subscriptions to the observable property 'PumpFlowRate'.
+
+        :param error: The Exception to be sent to the subscribing client.
+            If it is no DefinedExecutionError or UndefinedExecutionError, it will be wrapped in an UndefinedExecutionError.
+        :param queue: The queue to abort. If None, the default Queue will be used.
+        """
+        if queue is None:
+            queue = self._PumpFlowRate_producer_queue
+        queue.put(error)
+
+    @property
+    def current_PumpFlowRate(self) -> List[float]:
+        try:
+            return self._PumpFlowRate_current_value
+        except AttributeError:
+            raise AttributeError("Observable property PumpFlowRate has never been set")
+
+    def update_PumpRemainingVolume(self, PumpRemainingVolume: List[float], queue: Optional[Queue[List[float]]] = None) -> None:
+        """
+        Remaining volume of the current or last finite run of each pump in microliters, one element per pump starting with pump index 1.
+
+        This method updates the observable property 'PumpRemainingVolume'.
+
+        :param queue: The queue to send updates to. If None, the default Queue will be used.
+        """
+        if queue is None:
+            queue = self._PumpRemainingVolume_producer_queue
+            self._PumpRemainingVolume_current_value = PumpRemainingVolume
+        queue.put(PumpRemainingVolume)
+
+    def PumpRemainingVolume_on_subscription(self, *, metadata: MetadataDict) -> Optional[Queue[List[float]]]:
+        """
+        Remaining volume of the current or last finite run of each pump in microliters, one element per pump starting with pump index 1.
+
+        This method is called when a client subscribes to the observable property 'PumpRemainingVolume'
+
+        :param metadata: The SiLA Client Metadata attached to the call
+        :return: Optional `Queue` that should be used for updating this property.
+            If None, the default Queue will be used.
+        """
+
+    def abort_PumpRemainingVolume_subscriptions(self, error: Exception, queue: Optional[Queue[List[float]]] = None) -> None:
+        """
+        Remaining volume of the current or last finite run of each pump in microliters, one element per pump starting with pump index 1.
+
+        This method aborts subscriptions to the observable property 'PumpRemainingVolume'.
+
+        :param error: The Exception to be sent to the subscribing client.
+            If it is no DefinedExecutionError or UndefinedExecutionError, it will be wrapped in an UndefinedExecutionError.
+        :param queue: The queue to abort. If None, the default Queue will be used.
+        """
+        if queue is None:
+            queue = self._PumpRemainingVolume_producer_queue
+        queue.put(error)
+
+    @property
+    def current_PumpRemainingVolume(self) -> List[float]:
+        try:
+            return self._PumpRemainingVolume_current_value
+        except AttributeError:
+            raise AttributeError("Observable property PumpRemainingVolume has never been set")
+
+    def update_PumpTargetVolume(self, PumpTargetVolume: List[float], queue: Optional[Queue[List[float]]] = None) -> None:
+        """
+        Total volume of the current or last finite run of each pump in microliters, one element per pump starting with pump index 1.
+
+        This method updates the observable property 'PumpTargetVolume'.
+
+        :param queue: The queue to send updates to. If None, the default Queue will be used.
+        """
+        if queue is None:
+            queue = self._PumpTargetVolume_producer_queue
+            self._PumpTargetVolume_current_value = PumpTargetVolume
+        queue.put(PumpTargetVolume)
+
+    def PumpTargetVolume_on_subscription(self, *, metadata: MetadataDict) -> Optional[Queue[List[float]]]:
+        """
+        Total volume of the current or last finite run of each pump in microliters, one element per pump starting with pump index 1.
+
+        This method is called when a client subscribes to the observable property 'PumpTargetVolume'
+
+        :param metadata: The SiLA Client Metadata attached to the call
+        :return: Optional `Queue` that should be used for updating this property.
+            If None, the default Queue will be used.
+        """
+
+    def abort_PumpTargetVolume_subscriptions(self, error: Exception, queue: Optional[Queue[List[float]]] = None) -> None:
+        """
+        Total volume of the current or last finite run of each pump in microliters, one element per pump starting with pump index 1.
+
+        This method aborts subscriptions to the observable property 'PumpTargetVolume'.
+
+        :param error: The Exception to be sent to the subscribing client.
+            If it is no DefinedExecutionError or UndefinedExecutionError, it will be wrapped in an UndefinedExecutionError.
+        :param queue: The queue to abort. If None, the default Queue will be used.
+        """
+        if queue is None:
+            queue = self._PumpTargetVolume_producer_queue
+        queue.put(error)
+
+    @property
+    def current_PumpTargetVolume(self) -> List[float]:
+        try:
+            return self._PumpTargetVolume_current_value
+        except AttributeError:
+            raise AttributeError("Observable property PumpTargetVolume has never been set")
+
+    def update_DriverStatus(self, DriverStatus: str, queue: Optional[Queue[str]] = None) -> None:
+        """
+        Connection status of the pump driver, either Connected or Disconnected.
+
+        This method updates the observable property 'DriverStatus'.
+
+        :param queue: The queue to send updates to. If None, the default Queue will be used.
+        """
+        if queue is None:
+            queue = self._DriverStatus_producer_queue
+            self._DriverStatus_current_value = DriverStatus
+        queue.put(DriverStatus)
+
+    def DriverStatus_on_subscription(self, *, metadata: MetadataDict) -> Optional[Queue[str]]:
+        """
+        Connection status of the pump driver, either Connected or Disconnected.
+
+        This method is called when a client subscribes to the observable property 'DriverStatus'
+
+        :param metadata: The SiLA Client Metadata attached to the call
+        :return: Optional `Queue` that should be used for updating this property.
+            If None, the default Queue will be used.
+        """
+
+    def abort_DriverStatus_subscriptions(self, error: Exception, queue: Optional[Queue[str]] = None) -> None:
+        """
+        Connection status of the pump driver, either Connected or Disconnected.
+
+        This method aborts subscriptions to the observable property 'DriverStatus'.
+
+        :param error: The Exception to be sent to the subscribing client.
+            If it is no DefinedExecutionError or UndefinedExecutionError, it will be wrapped in an UndefinedExecutionError.
+        :param queue: The queue to abort. If None, the default Queue will be used.
+        """
+        if queue is None:
+            queue = self._DriverStatus_producer_queue
+        queue.put(error)
+
+    @property
+    def current_DriverStatus(self) -> str:
+        try:
+            return self._DriverStatus_current_value
+        except AttributeError:
+            raise AttributeError("Observable property DriverStatus has never been set")
+
     @abstractmethod
     def SetPumpCalibration(
         self, PumpIndex: int, CalibrationParameter: float, *, metadata: MetadataDict
@@ -119,7 +370,7 @@ class HiPeristalticBase(FeatureImplementationBase, ABC):
 
 
           :param PumpIndex:
-          The target pump channel index from 1 to 4 (both inclusive).
+          The target pump channel index from 1 to the number of pumps (both inclusive), 4 per board.
 
 
           :param CalibrationParameter:
@@ -153,7 +404,7 @@ class HiPeristalticBase(FeatureImplementationBase, ABC):
 
 
           :param PumpIndex:
-          The target pump channel index from 1 to 4 (both inclusive).
+          The target pump channel index from 1 to the number of pumps (both inclusive), 4 per board.
 
 
           :param FlowRate:
@@ -195,7 +446,7 @@ class HiPeristalticBase(FeatureImplementationBase, ABC):
 
 
           :param PumpIndex:
-          The target pump channel index from 1 to 4 (both inclusive).
+          The target pump channel index from 1 to the number of pumps (both inclusive), 4 per board.
 
 
           :param FlowRate:
@@ -227,7 +478,7 @@ class HiPeristalticBase(FeatureImplementationBase, ABC):
 
 
           :param PumpIndex:
-          The target pump channel index from 1 to 4 (both inclusive).
+          The target pump channel index from 1 to the number of pumps (both inclusive), 4 per board.
 
 
           :param metadata: The SiLA Client Metadata attached to the call
@@ -255,7 +506,7 @@ class HiPeristalticBase(FeatureImplementationBase, ABC):
 
 
           :param PumpIndex:
-          The target pump channel index from 1 to 4 (both inclusive).
+          The target pump channel index from 1 to the number of pumps (both inclusive), 4 per board.
 
 
           :param metadata: The SiLA Client Metadata attached to the call
@@ -286,7 +537,7 @@ class HiPeristalticBase(FeatureImplementationBase, ABC):
 
 
           :param PumpIndex:
-          The target pump channel index from 1 to 4 (both inclusive).
+          The target pump channel index from 1 to the number of pumps (both inclusive), 4 per board.
 
 
           :param RPM:
@@ -309,4 +560,35 @@ class HiPeristalticBase(FeatureImplementationBase, ABC):
               - Completed: Whether the target number of revolution is achieved successfully.
 
 
+        """
+
+    @abstractmethod
+    def DispenseBatch(
+        self,
+        Entries: List[DispenseEntry],
+        *,
+        metadata: MetadataDict,
+        instance: ObservableCommandInstanceWithIntermediateResponses[DispenseBatch_IntermediateResponses],
+    ) -> DispenseBatch_Responses:
+        """
+
+        Dispenses a list of entries, e.g. a plate map. Entries of the same pump run one after another in the given order, different pumps run in parallel.
+
+
+
+          :param Entries:
+          The dispenses to run.
+
+
+          :param metadata: The SiLA Client Metadata attached to the call
+          :param instance: The command instance, enabling sending status updates to subscribed clients
+
+          :return:
+
+              - DispensedVolumes: Dispensed volume of each entry in microliters, in the order of the entries.
+
+
+              - Completed: Whether all entries were dispensed completely, false if a pump was stopped meanwhile.
+
+
         """
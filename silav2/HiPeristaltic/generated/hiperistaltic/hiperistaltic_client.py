@@ -10,9 +10,12 @@ from typing import TYPE_CHECKING
 
 if TYPE_CHECKING:
 
-    from typing import Iterable, Optional
+    from typing import Iterable, List, Optional
 
     from hiperistaltic_types import (
+        DispenseBatch_IntermediateResponses,
+        DispenseBatch_Responses,
+        DispenseEntry,
         ResumePump_IntermediateResponses,
         ResumePump_Responses,
         SetPumpCalibration_Responses,
@@ -44,6 +47,31 @@ class HiPeristalticClient:
     Pump is connected.
     """
 
+    PumpRunning: ClientObservableProperty[List[bool]]
+    """
+    Whether each pump is running, one element per pump starting with pump index 1.
+    """
+
+    PumpFlowRate: ClientObservableProperty[List[float]]
+    """
+    Current flow rate of each pump in microliters per second, one element per pump starting with pump index 1.
+    """
+
+    PumpRemainingVolume: ClientObservableProperty[List[float]]
+    """
+    Remaining volume of the current or last finite run of each pump in microliters, one element per pump starting with pump index 1.
+    """
+
+    PumpTargetVolume: ClientObservableProperty[List[float]]
+    """
+    Total volume of the current or last finite run of each pump in microliters, one element per pump starting with pump index 1.
+    """
+
+    DriverStatus: ClientObservableProperty[str]
+    """
+    Connection status of the pump driver, either Connected or Disconnected.
+    """
+
     def SetPumpCalibration(
         self,
         PumpIndex: int,
@@ -130,3 +158,18 @@ class HiPeristalticClient:
 
         """
         ...
+
+    def DispenseBatch(
+        self,
+        Entries: List[DispenseEntry],
+        *,
+        metadata: Optional[Iterable[ClientMetadataInstance]] = None,
+    ) -> ClientObservableCommandInstanceWithIntermediateResponses[
+        DispenseBatch_IntermediateResponses, DispenseBatch_Responses
+    ]:
+        """
+
+        Dispenses a list of entries, e.g. a plate map. Entries of the same pump run one after another in the given order, different pumps run in parallel.
+
+        """
+        ...
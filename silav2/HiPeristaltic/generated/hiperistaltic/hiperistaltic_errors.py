@@ -11,7 +11,7 @@ from .hiperistaltic_feature import HiPeristalticFeature
 class PumpIndexOutOfRange(DefinedExecutionError):
     def __init__(self, message: Optional[str] = None):
         if message is None:
-            message = "The selected pump channel index is out of range. Must be 1-4."
+            message = "The selected pump channel index is out of range. Must be from 1 to the number of pumps."
         super().__init__(HiPeristalticFeature.defined_execution_errors["PumpIndexOutOfRange"], message=message)
 
 
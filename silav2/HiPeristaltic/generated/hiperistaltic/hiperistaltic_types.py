@@ -1,7 +1,38 @@
 # Generated by sila2.code_generator; sila2.__version__: 0.12.2
 from __future__ import annotations
 
-from typing import NamedTuple
+from typing import List, NamedTuple
+
+
+class DispenseEntry_Struct(NamedTuple):
+
+    PumpIndex: int
+    """
+    The target pump channel index from 1 to the number of pumps (both inclusive), 4 per board.
+    """
+
+    Volume: float
+    """
+    The volume to dispense in microliters.
+    """
+
+    FlowRate: float
+    """
+    The flow rate in microliters per second.
+    """
+
+    PumpDirection: str
+    """
+    Pump direction, either 'clockwise' (or CW) or 'counter-clockwise' (or CCW). If empty, default direction defined in the configuration file will be used.
+    """
+
+    Delay: float
+    """
+    Wait in seconds before this entry starts, counted from the end of the previous entry of the same pump (or from the start of the batch).
+    """
+
+
+DispenseEntry = DispenseEntry_Struct
 
 
 class SetPumpCalibration_Responses(NamedTuple):
@@ -52,6 +83,19 @@ class StartPumpCalibration_Responses(NamedTuple):
     """
 
 
+class DispenseBatch_Responses(NamedTuple):
+
+    DispensedVolumes: List[float]
+    """
+    Dispensed volume of each entry in microliters, in the order of the entries.
+    """
+
+    Completed: bool
+    """
+    Whether all entries were dispensed completely, false if a pump was stopped meanwhile.
+    """
+
+
 class StartPump_IntermediateResponses(NamedTuple):
 
     CurrentVolume: float
@@ -82,3 +126,16 @@ class StartPumpCalibration_IntermediateResponses(NamedTuple):
     """
     Current number of revolution.
     """
+
+
+class DispenseBatch_IntermediateResponses(NamedTuple):
+
+    DispensedVolume: float
+    """
+    Total volume dispensed so far by all entries in microliters.
+    """
+
+    CompletedEntries: int
+    """
+    Number of entries finished so far.
+    """